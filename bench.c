@@ -0,0 +1,649 @@
+/*
+ * Copyright Nick Clifford, 2021
+ *
+ * Nick Clifford (nick@crypto.geek.nz)
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+/*
+ * Benchmarks. Each workload is run against fstring and against the equivalent snprintf,
+ * and reports ns/op, p50/p99 latency and bytes/sec.
+ *
+ * Usage: ./bench [--csv | --json] [--quick] [workload name filter]
+ *
+ * Ops are timed in batches (timing every call would mostly measure the clock), so the
+ * percentiles are of the per op time of each batch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fstring.h"
+
+#define BATCH_OPS       32
+#define SAMPLES         20000
+#define WARMUP_OPS      2000
+
+#define OUTPUT_TEXT     0
+#define OUTPUT_CSV      1
+#define OUTPUT_JSON     2
+
+/* One op of a workload, returning the number of bytes produced */
+typedef size_t (*bench_fn)(void);
+
+typedef struct {
+    const char *name;
+    const char *api;
+    bench_fn run;
+    bench_fn baseline;      /* The snprintf equivalent */
+    int cached;             /* Run with the template cache on */
+    int big;                /* Ops are 10000 rows, so take fewer samples */
+    int threads;            /* Threads for the parallel batch */
+} workload;
+
+typedef struct {
+    double ns_op, p50, p99, bytes_sec;
+} result;
+
+
+static char buffer[16384];
+static volatile size_t sink;
+
+
+/*
+ * Workload data.
+ */
+static const char *method = "GET", *path = "/api/v1/users/12345/messages", *name = "Nick";
+static int status = 200, count = 12;
+static long bytes = 1234567;
+static double ms = 12.625;
+
+static fstr_value request_list[] = {
+    { .name = "method", .type = fstr_vt_str, .value.s = "GET" },
+    { .name = "path", .type = fstr_vt_str, .value.s = "/api/v1/users/12345/messages" },
+    { .name = "status", .type = fstr_vt_int, .value.i = 200 },
+    { .name = "bytes", .type = fstr_vt_long, .value.l = 1234567 },
+    { .name = "ms", .type = fstr_vt_double, .value.d = 12.625 },
+};
+static fstr_value *request_values[] = { 
+    &request_list[0], &request_list[1], &request_list[2], &request_list[3], &request_list[4], fstr_end 
+};
+static fstr_template *request_tpl;
+#define REQUEST_FORMAT  "{method} {path} HTTP/1.1 {status} {bytes} bytes in {ms}ms"
+#define REQUEST_PRINTF  "%s %s HTTP/1.1 %d %ld bytes in %gms"
+
+static char long_format[2048], long_printf[2048];
+static fstr_value long_list[20], *long_values[21];
+static int v[20];
+static fstr_template *long_tpl;
+static fstr_view *long_view;
+
+static char literal_format[8192], literal_printf[8192];
+
+static fstr_value table_list[100], *table_values[101];
+
+static fstr_value batch_rows[500];
+static size_t batch_offsets[101];
+static fstr_template *batch_tpl;
+
+#define BIG_ROWS        10000
+#define BIG_SAMPLES     1000
+static fstr_value big_rows[BIG_ROWS * 5];
+static char big_buffer[1048576];
+static fstr_buf big_buf = FSTR_BUF_INIT;
+static int threads;
+#define BATCH_FORMAT    "{method},{path},{status},{bytes},{ms}\n"
+#define BATCH_PRINTF    "%s,%s,%d,%ld,%g\n"
+static fstr_table *table;
+static fstr_logger *logger;
+static fstr_template *log_tpl;
+static int null_fd, log_len;
+
+static const char *cb_value(void *data, const char *name)
+{
+    return "callback";
+}
+
+
+static void setup()
+{
+    static char vname[20][8], names[100][8];
+    char *lp = long_format, *pp = long_printf;
+    int i;
+
+    request_tpl = fstr_compile(REQUEST_FORMAT);
+
+    /* 20 integer placeholders in about 1KB */
+    for(i = 0; i < 20; i++) {
+        v[i] = i * 1000 + 7;
+        sprintf(vname[i], "v%d", i);
+        lp += sprintf(lp, "field %-2d is {v%d}, which is a number in a long-ish line ", i, i);
+        pp += sprintf(pp, "field %-2d is %%d, which is a number in a long-ish line ", i);
+        memcpy(&long_list[i], fstr_nint(vname[i], v[i]), sizeof(fstr_value));
+        long_values[i] = &long_list[i];
+    }
+    long_values[20] = fstr_end;
+    long_tpl = fstr_compile(long_format);
+    long_view = fstr_view_new(long_tpl, long_values);
+
+    /* 4KB of literal text, with two placeholders */
+    strcpy(literal_format, "<html><head><title>{name}</title></head><body>\n");
+    while(strlen(literal_format) < 4000) {
+        strcat(literal_format, "<p class=\"text\">Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod.</p>\n");
+    }
+    strcat(literal_format, "<p>{count} messages</p></body></html>\n");
+    strcpy(literal_printf, literal_format);
+    memcpy(strstr(literal_printf, "{name}"), "%s    ", 6);
+    memcpy(strstr(literal_printf, "{count}"), "%d     ", 7);
+
+    /* 100 values, looking up the last one */
+    for(i = 0; i < 100; i++) {
+        sprintf(names[i], "n%d", i);
+        memcpy(&table_list[i], fstr_nstr(names[i], names[i]), sizeof(fstr_value));
+        table_values[i] = &table_list[i];
+    }
+    table_values[100] = fstr_end;
+    table = fstr_table_new(table_values);
+
+    for(i = 0; i < 100; i++) {
+        memcpy(&batch_rows[i * 5], &request_list[0], sizeof(fstr_value));
+        memcpy(&batch_rows[i * 5 + 1], &request_list[1], sizeof(fstr_value));
+        memcpy(&batch_rows[i * 5 + 2], fstr_nint("status", i), sizeof(fstr_value));
+        memcpy(&batch_rows[i * 5 + 3], fstr_nlong("bytes", (long)i * 1000), sizeof(fstr_value));
+        memcpy(&batch_rows[i * 5 + 4], fstr_ndouble("ms", i / 8.0), sizeof(fstr_value));
+    }
+    batch_tpl = fstr_compile(BATCH_FORMAT);
+
+    for(i = 0; i < BIG_ROWS; i++) {
+        memcpy(&big_rows[i * 5], &batch_rows[(i % 100) * 5], sizeof(fstr_value) * 2);
+        memcpy(&big_rows[i * 5 + 2], fstr_nint("status", i), sizeof(fstr_value));
+        memcpy(&big_rows[i * 5 + 3], fstr_nlong("bytes", (long)i * 1000), sizeof(fstr_value));
+        memcpy(&big_rows[i * 5 + 4], fstr_ndouble("ms", i / 8.0), sizeof(fstr_value));
+    }
+
+    null_fd = open("/dev/null", O_WRONLY);
+    logger = fstr_logger_new(fstr_fd_sink(null_fd), 1 << 22, FSTR_LOG_BLOCK);
+    log_tpl = fstr_compile(REQUEST_FORMAT "\n");
+    log_len = fstr_measure(REQUEST_FORMAT "\n", request_values);
+}
+
+
+/*
+ * Format length and placeholder count.
+ */
+static size_t short_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "Hello {name}!", fstr_values_cast { fstr_str(name), fstr_end });
+}
+
+static size_t short_printf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "Hello %s!", name);
+}
+
+static size_t request_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), REQUEST_FORMAT, request_values);
+}
+
+static size_t request_printf(void)
+{
+    return snprintf(buffer, sizeof(buffer), REQUEST_PRINTF, method, path, status, bytes, ms);
+}
+
+static size_t long_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), long_format, long_values);
+}
+
+static size_t long_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), long_printf, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8],
+                    v[9], v[10], v[11], v[12], v[13], v[14], v[15], v[16], v[17], v[18], v[19]);
+}
+
+static size_t literal_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), literal_format, fstr_values_cast { fstr_str(name), fstr_int(count), fstr_end });
+}
+
+static size_t literal_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), literal_printf, name, count);
+}
+
+
+/*
+ * Value list size.
+ */
+static size_t list1_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "{n99}", table_values + 99);
+}
+
+static size_t list10_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "{n99}", table_values + 90);
+}
+
+static size_t list100_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "{n99}", table_values);
+}
+
+static size_t table100_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "{n99}", fstr_values_cast { fstr_tbl(table), fstr_end });
+}
+
+static size_t list_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "%s", table_values[99]->value.s);
+}
+
+
+/*
+ * Value types.
+ */
+static size_t str_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "value {v}", fstr_values_cast { fstr_nstr("v", path), fstr_end });
+}
+
+static size_t str_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "value %s", path);
+}
+
+static size_t int_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "value {v}", fstr_values_cast { fstr_nlong("v", bytes), fstr_end });
+}
+
+static size_t int_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "value %ld", bytes);
+}
+
+static size_t double_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "value {v}", fstr_values_cast { fstr_ndouble("v", ms), fstr_end });
+}
+
+static size_t double_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "value %g", ms);
+}
+
+static size_t spec_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "value {v:>12.3f}", fstr_values_cast { fstr_ndouble("v", ms), fstr_end });
+}
+
+static size_t spec_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "value %12.3f", ms);
+}
+
+static size_t cb_fstring(void)
+{
+    return lbfstring(buffer, sizeof(buffer), "value {v}", fstr_values_cast { fstr_ncb("v", cb_value, NULL), fstr_end });
+}
+
+static size_t cb_snprintf(void)
+{
+    return snprintf(buffer, sizeof(buffer), "value %s", cb_value(NULL, "v"));
+}
+
+
+/*
+ * The different APIs, all with the request format.
+ */
+static size_t lfstring_run(void)
+{
+    char *s = lfstring(REQUEST_FORMAT, request_values);
+    size_t len = strlen(s);
+    free(s);
+    return len;
+}
+
+static size_t fstring_run(void)
+{
+    char *s = fstring(REQUEST_FORMAT, request_values[0], request_values[1], request_values[2],
+                      request_values[3], request_values[4], fstr_end);
+    size_t len = strlen(s);
+    free(s);
+    return len;
+}
+
+static size_t bfstring_run(void)
+{
+    return bfstring(buffer, sizeof(buffer), REQUEST_FORMAT, request_values[0], request_values[1],
+                    request_values[2], request_values[3], request_values[4], fstr_end);
+}
+
+static size_t render_run(void)
+{
+    return fstr_render(buffer, sizeof(buffer), request_tpl, request_values);
+}
+
+static size_t measure_run(void)
+{
+    return fstr_measure(REQUEST_FORMAT, request_values);
+}
+
+/*
+ * 100 CSV rows at a time, with a batch vs a loop of fstr_render.
+ */
+static size_t batch_run(void)
+{
+    fstr_batch batch = { batch_rows, 100, 5, 0 };
+    return fstr_render_batch(buffer, sizeof(buffer), batch_offsets, batch_tpl, &batch, NULL);
+}
+
+static size_t batch_loop_run(void)
+{
+    size_t i, len = 0;
+    fstr_value *row[6] = { NULL };
+
+    for(i = 0; i < 100; i++) {
+        row[0] = &batch_rows[i * 5];
+        row[1] = &batch_rows[i * 5 + 1];
+        row[2] = &batch_rows[i * 5 + 2];
+        row[3] = &batch_rows[i * 5 + 3];
+        row[4] = &batch_rows[i * 5 + 4];
+        len += fstr_render(buffer + len, sizeof(buffer) - len, batch_tpl, row);
+    }
+    return len;
+}
+
+static size_t batch_printf(void)
+{
+    size_t i, len = 0;
+
+    for(i = 0; i < 100; i++) {
+        len += snprintf(buffer + len, sizeof(buffer) - len, BATCH_PRINTF, request_list[0].value.s, 
+                        request_list[1].value.s, (int)i, (long)i * 1000, i / 8.0);
+    }
+    return len;
+}
+
+/*
+ * Building a 100 row response, by concatenating fstring()s vs appending to a reused fstr_buf.
+ */
+static fstr_buf build_buf = FSTR_BUF_INIT;
+
+static size_t build_concat_run(void)
+{
+    size_t i, len = 0, size = 0, slen;
+    char *out = NULL, *s;
+
+    for(i = 0; i < 100; i++) {
+        s = fstring(BATCH_FORMAT, &batch_rows[i * 5], &batch_rows[i * 5 + 1], &batch_rows[i * 5 + 2],
+                    &batch_rows[i * 5 + 3], &batch_rows[i * 5 + 4], fstr_end);
+        slen = strlen(s);
+        if (len + slen + 1 > size) {
+            size = (len + slen + 1) * 2;
+            out = realloc(out, size);
+        }
+        memcpy(out + len, s, slen + 1);
+        len += slen;
+        free(s);
+    }
+    free(out);
+    return len;
+}
+
+static size_t build_buf_run(void)
+{
+    size_t i;
+
+    fstr_buf_reset(&build_buf);
+    for(i = 0; i < 100; i++) {
+        fstr_buf_append(&build_buf, BATCH_FORMAT, &batch_rows[i * 5], &batch_rows[i * 5 + 1], &batch_rows[i * 5 + 2],
+                        &batch_rows[i * 5 + 3], &batch_rows[i * 5 + 4], fstr_end);
+    }
+    return build_buf.len;
+}
+
+/*
+ * 10000 CSV rows at a time, on one thread and then in parallel, to show how it scales.
+ */
+static size_t big_batch_run(void)
+{
+    fstr_batch batch = { big_rows, BIG_ROWS, 5, 0 };
+    return fstr_render_batch(big_buffer, sizeof(big_buffer), NULL, batch_tpl, &batch, NULL);
+}
+
+static size_t big_parallel_run(void)
+{
+    fstr_batch batch = { big_rows, BIG_ROWS, 5, 0 };
+
+    fstr_buf_reset(&big_buf);
+    return fstr_render_batch_parallel(&big_buf, NULL, batch_tpl, &batch, NULL, threads);
+}
+
+static size_t big_batch_printf(void)
+{
+    size_t i, len = 0;
+
+    for(i = 0; i < BIG_ROWS; i++) {
+        len += snprintf(big_buffer + len, sizeof(big_buffer) - len, BATCH_PRINTF, request_list[0].value.s, 
+                        request_list[1].value.s, (int)i, (long)i * 1000, i / 8.0);
+    }
+    return len;
+}
+
+/*
+ * The long20 line again with one value changed, rendering it all vs bringing a view up to date.
+ */
+static size_t refresh_render_run(void)
+{
+    memcpy(&long_list[7], fstr_nint("v7", ++v[7]), sizeof(fstr_value));
+    return fstr_render(buffer, sizeof(buffer), long_tpl, long_values);
+}
+
+static size_t refresh_view_run(void)
+{
+    fstr_range ranges[4];
+    size_t len;
+
+    fstr_view_set(long_view, fstr_nint("v7", ++v[7]));
+    fstr_view_render(long_view, ranges, 4);
+    fstr_view_text(long_view, &len);
+    return len;
+}
+
+/*
+ * A log line, as the caller sees it: handing it to the logger's thread vs rendering and writing it.
+ */
+static size_t log_run(void)
+{
+    fstr_llog(logger, log_tpl, request_values);
+    return log_len;
+}
+
+static size_t log_write(void)
+{
+    ssize_t len = bfstring(buffer, sizeof(buffer), REQUEST_FORMAT "\n", request_values[0], request_values[1],
+                           request_values[2], request_values[3], request_values[4], fstr_end);
+    return write(null_fd, buffer, len) < 0 ? 0 : len;
+}
+
+static size_t alloc_printf(void)
+{
+    int len = snprintf(NULL, 0, REQUEST_PRINTF, method, path, status, bytes, ms);
+    char *s = malloc(len + 1);
+    snprintf(s, len + 1, REQUEST_PRINTF, method, path, status, bytes, ms);
+    free(s);
+    return len;
+}
+
+
+static const workload workloads[] = {
+    { "short",              "lbfstring",    short_fstring,      short_printf },
+    { "request",            "lbfstring",    request_fstring,    request_printf },
+    { "long20",             "lbfstring",    long_fstring,       long_snprintf },
+    { "literal4k",          "lbfstring",    literal_fstring,    literal_snprintf },
+    { "list1",              "lbfstring",    list1_fstring,      list_snprintf },
+    { "list10",             "lbfstring",    list10_fstring,     list_snprintf },
+    { "list100",            "lbfstring",    list100_fstring,    list_snprintf },
+    { "table100",           "lbfstring",    table100_fstring,   list_snprintf },
+    { "type_str",           "lbfstring",    str_fstring,        str_snprintf },
+    { "type_int",           "lbfstring",    int_fstring,        int_snprintf },
+    { "type_double",        "lbfstring",    double_fstring,     double_snprintf },
+    { "type_double_spec",   "lbfstring",    spec_fstring,       spec_snprintf },
+    { "type_callback",      "lbfstring",    cb_fstring,         cb_snprintf },
+    { "api_request",        "lfstring",     lfstring_run,       alloc_printf },
+    { "api_request",        "fstring",      fstring_run,        alloc_printf },
+    { "api_request",        "bfstring",     bfstring_run,       request_printf },
+    { "api_request",        "fstr_render",  render_run,         request_printf },
+    { "api_request",        "fstr_measure", measure_run,        request_printf },
+    { "csv_100_rows",       "fstr_render",  batch_loop_run,     batch_printf },
+    { "csv_100_rows",       "fstr_render_batch", batch_run,     batch_printf },
+    { "build_100_rows",     "fstring+concat", build_concat_run, batch_printf },
+    { "build_100_rows",     "fstr_buf",     build_buf_run,      batch_printf },
+    { "short_cached",       "lbfstring",    short_fstring,      short_printf,       1 },
+    { "request_cached",     "lbfstring",    request_fstring,    request_printf,     1 },
+    { "long20_cached",      "lbfstring",    long_fstring,       long_snprintf,      1 },
+    { "literal4k_cached",   "lbfstring",    literal_fstring,    literal_snprintf,   1 },
+    { "refresh_long20",     "fstr_render",  refresh_render_run, long_snprintf },
+    { "refresh_long20",     "fstr_view",    refresh_view_run,   long_snprintf },
+    { "csv_10k_rows",       "fstr_render_batch", big_batch_run, big_batch_printf,   0, 1 },
+    { "csv_10k_rows",       "parallel/1",   big_parallel_run,   big_batch_printf,   0, 1, 1 },
+    { "csv_10k_rows",       "parallel/2",   big_parallel_run,   big_batch_printf,   0, 1, 2 },
+    { "csv_10k_rows",       "parallel/4",   big_parallel_run,   big_batch_printf,   0, 1, 4 },
+    { "csv_10k_rows",       "parallel/8",   big_parallel_run,   big_batch_printf,   0, 1, 8 },
+    { "log_request",        "fstr_log",     log_run,            log_write },
+    { NULL, NULL, NULL, NULL }
+};
+
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+
+static result measure(bench_fn fn, int samples, int warmup)
+{
+    static double times[SAMPLES];
+    double start, total = 0;
+    size_t len = 0;
+    int i, j;
+    result r;
+
+    for(i = 0; i < warmup; i++) {
+        sink += fn();
+    }
+    for(i = 0; i < samples; i++) {
+        start = now_ns();
+        for(j = 0; j < BATCH_OPS; j++) {
+            len += fn();
+        }
+        times[i] = (now_ns() - start) / BATCH_OPS;
+        total += times[i];
+    }
+    sink += len;
+    qsort(times, samples, sizeof(double), compare_double);
+    r.ns_op = total / samples;
+    r.p50 = times[samples / 2];
+    r.p99 = times[samples * 99 / 100];
+    r.bytes_sec = len / (total * BATCH_OPS / 1e9);
+    return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int i, output = OUTPUT_TEXT, samples = SAMPLES, first = 1, big;
+    const char *filter = NULL;
+    result r, b;
+
+    for(i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            output = OUTPUT_CSV;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            output = OUTPUT_JSON;
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            samples = SAMPLES / 10;
+        } else {
+            filter = argv[i];
+        }
+    }
+    setup();
+
+    if (output == OUTPUT_TEXT) {
+        printf("%-18s %-17s %9s %9s %9s %10s | %9s %9s %9s %10s | %6s\n", "workload", "api", "ns/op", "p50", "p99", "MB/s",
+                "snprintf", "p50", "p99", "MB/s", "ratio");
+    } else if (output == OUTPUT_CSV) {
+        printf("workload,api,ns_op,p50_ns,p99_ns,bytes_sec,baseline_ns_op,baseline_p50_ns,baseline_p99_ns,baseline_bytes_sec\n");
+    } else {
+        printf("{\n  \"batch_ops\": %d,\n  \"samples\": %d,\n  \"results\": [\n", BATCH_OPS, samples);
+    }
+
+    for(i = 0; workloads[i].name != NULL; i++) {
+        if (filter && strstr(workloads[i].name, filter) == NULL && strstr(workloads[i].api, filter) == NULL) {
+            continue;
+        }
+        if (workloads[i].cached) {
+            fstr_cache_enable(64);
+        }
+        threads = workloads[i].threads;
+        big = workloads[i].big ? samples / BIG_SAMPLES + 2 : 0;
+        r = measure(workloads[i].run, big ? big : samples, big ? 2 : WARMUP_OPS);
+        fstr_cache_enable(0);
+        b = measure(workloads[i].baseline, big ? big : samples, big ? 2 : WARMUP_OPS);
+        if (output == OUTPUT_TEXT) {
+            printf("%-18s %-17s %9.1f %9.1f %9.1f %10.1f | %9.1f %9.1f %9.1f %10.1f | %6.2f\n",
+                    workloads[i].name, workloads[i].api, r.ns_op, r.p50, r.p99, r.bytes_sec / 1e6,
+                    b.ns_op, b.p50, b.p99, b.bytes_sec / 1e6, r.ns_op / b.ns_op);
+        } else if (output == OUTPUT_CSV) {
+            printf("%s,%s,%.2f,%.2f,%.2f,%.0f,%.2f,%.2f,%.2f,%.0f\n", workloads[i].name, workloads[i].api,
+                    r.ns_op, r.p50, r.p99, r.bytes_sec, b.ns_op, b.p50, b.p99, b.bytes_sec);
+        } else {
+            printf("%s    {\"workload\": \"%s\", \"api\": \"%s\", \"ns_op\": %.2f, \"p50_ns\": %.2f, \"p99_ns\": %.2f, "
+                   "\"bytes_sec\": %.0f, \"baseline\": {\"ns_op\": %.2f, \"p50_ns\": %.2f, \"p99_ns\": %.2f, \"bytes_sec\": %.0f}}",
+                    first ? "" : ",\n", workloads[i].name, workloads[i].api, r.ns_op, r.p50, r.p99, r.bytes_sec,
+                    b.ns_op, b.p50, b.p99, b.bytes_sec);
+        }
+        fflush(stdout);
+        first = 0;
+    }
+    if (output == OUTPUT_JSON) {
+        printf("\n  ]\n}\n");
+    }
+    fstr_logger_free(logger);
+    close(null_fd);
+    return 0;
+}
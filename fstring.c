@@ -27,308 +27,5061 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "fstring.h"
 
 
-/* The maximum size of a buffer that will be allocated by fstring, vfstring or lfstring */
-#define MAX_BUFFER_LEN      1048576
+/* Scratch space for formatting a numeric value, big enough for the longest %f of a double */
+#define VALUE_BUFFER_LEN    384
 
 
-fstr_value **_va_to_list(fstr_value *first, va_list vl);
+/* How many varargs values fit in the list on the stack before it has to be allocated */
+#define VA_LIST_LEN         32
+
+
+fstr_value **_va_to_list(fstr_value **stack, const fstr_allocator *allocator, fstr_value *first, va_list vl);
+
+
+/*
+ * Allocators.
+ *
+ * Everything fstring(), vfstring() and lfstring() (and friends) allocate goes through an
+ * fstr_allocator, either the one given in the call or the global one. Long lived objects
+ * (tables and templates) always use malloc.
+ */
+static void *_malloc_alloc(void *data, size_t size)
+{
+    return malloc(size);
+}
+
+static void _malloc_free(void *data, void *ptr)
+{
+    free(ptr);
+}
+
+static const fstr_allocator _malloc_allocator = { _malloc_alloc, _malloc_free, NULL };
+static fstr_allocator _allocator = { _malloc_alloc, _malloc_free, NULL };
+
+
+void fstr_set_allocator(const fstr_allocator *allocator)
+{
+    _allocator = allocator ? *allocator : _malloc_allocator;
+}
+
+
+void fstr_free(void *ptr)
+{
+    _allocator.free(_allocator.data, ptr);
+}
+
+
+/**
+ * @brief Internal function to release a list from _va_to_list(), if it isn't on the stack
+ */
+static inline void _va_list_free(fstr_value **stack, const fstr_allocator *allocator, fstr_value **list)
+{
+    if (list != stack) {
+        allocator->free(allocator->data, list);
+    }
+}
+
+
+/* The default size of each arena chunk */
+#define ARENA_CHUNK_LEN     65536
+
+/* Arena allocations are aligned to this */
+#define ARENA_ALIGN         16
+
+typedef struct fstr_arena_chunk {
+    struct fstr_arena_chunk *next;
+    size_t size;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} fstr_arena_chunk;
+
+struct fstr_arena {
+    fstr_allocator allocator;
+    fstr_arena_chunk *chunks;       /* The newest chunk first */
+    size_t used;                    /* How much of the newest chunk is used */
+    size_t chunk_size;
+};
+
+static __thread fstr_arena *_thread_arena;
+static pthread_key_t _thread_arena_key;
+static pthread_once_t _thread_arena_once = PTHREAD_ONCE_INIT;
+
+
+static void *_arena_alloc(void *data, size_t size)
+{
+    fstr_arena *arena = data ? data : fstr_thread_arena();
+    fstr_arena_chunk *chunk;
+    void *ptr;
+
+    if (arena == NULL) {
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (arena->chunks == NULL || arena->used + size > arena->chunks->size) {
+        chunk = malloc(sizeof(fstr_arena_chunk) + (size > arena->chunk_size ? size : arena->chunk_size));
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+    ptr = arena->chunks->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+
+static void _arena_free(void *data, void *ptr)
+{
+    /* Memory is only given back by fstr_arena_reset() */
+}
+
+
+fstr_arena *fstr_arena_new(size_t chunk_size)
+{
+    fstr_arena *arena = calloc(1, sizeof(fstr_arena));
+
+    if (arena) {
+        arena->allocator = (fstr_allocator){ _arena_alloc, _arena_free, arena };
+        arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_LEN;
+    }
+    return arena;
+}
+
+
+void fstr_arena_reset(fstr_arena *arena)
+{
+    fstr_arena_chunk *chunk, *next;
+
+    if (arena == NULL && (arena = _thread_arena) == NULL) {
+        return;
+    }
+    /* Keep the newest chunk for reuse, unless it was an oversized one */
+    chunk = arena->chunks;
+    if (chunk && chunk->size == arena->chunk_size) {
+        chunk = chunk->next;
+        arena->chunks->next = NULL;
+    } else {
+        arena->chunks = NULL;
+    }
+    for(; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->used = 0;
+}
+
+
+void fstr_arena_free(fstr_arena *arena)
+{
+    if (arena) {
+        fstr_arena_reset(arena);
+        free(arena->chunks);
+        if (arena == _thread_arena) {
+            _thread_arena = NULL;
+            pthread_setspecific(_thread_arena_key, NULL);
+        }
+        free(arena);
+    }
+}
+
+
+static void _thread_arena_destroy(void *arena)
+{
+    _thread_arena = arena;
+    fstr_arena_free(arena);
+}
+
+
+static void _thread_arena_init(void)
+{
+    pthread_key_create(&_thread_arena_key, _thread_arena_destroy);
+}
+
+
+fstr_arena *fstr_thread_arena(void)
+{
+    if (_thread_arena == NULL) {
+        pthread_once(&_thread_arena_once, _thread_arena_init);
+        _thread_arena = fstr_arena_new(0);
+        pthread_setspecific(_thread_arena_key, _thread_arena);
+    }
+    return _thread_arena;
+}
+
+
+const fstr_allocator *fstr_arena_allocator(fstr_arena *arena)
+{
+    static const fstr_allocator thread_allocator = { _arena_alloc, _arena_free, NULL };
+
+    return arena ? &arena->allocator : &thread_allocator;
+}
+
+
+/*
+ * Stats.
+ *
+ * Built with -DFSTR_STATS, each thread counts what it does in its own record, which only it
+ * writes (so a count is a plain load and store, not a locked add), and fstr_stats() adds the
+ * records up. Records of threads that have finished are reused, keeping their counts.
+ * Without FSTR_STATS the STAT macros are empty and nothing is counted.
+ *
+ * Counting by format uses a shared table indexed by the format's address, like the
+ * template cache, with atomic adds as it is shared.
+ */
+#ifdef FSTR_STATS
+
+typedef struct fstr_stats_thread {
+    fstr_stats_info counts;
+    atomic_int active;
+    struct fstr_stats_thread *next;
+} fstr_stats_thread;
+
+typedef struct {
+    _Atomic(const char *) key;  /* The format's address, NULL if the slot is free */
+    char *text;                 /* A copy of the format */
+    atomic_ulong renders, bytes, ns;
+} fstr_stats_slot;
+
+struct fstr_stats_table {
+    size_t mask;
+    size_t max, count;
+    fstr_stats_slot *slots;
+    fstr_stats_slot other;      /* Formats that didn't fit */
+};
+
+/* How many slots a format can be in */
+#define STATS_PROBES        8
+
+static _Atomic(fstr_stats_thread *) _stats_threads;
+static __thread fstr_stats_thread *_thread_stats;
+static pthread_key_t _stats_key;
+static pthread_once_t _stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static fstr_stats_info _stats_base;     /* The totals when fstr_stats_reset() was called */
+static struct fstr_stats_table *_stats_table;
+static fstr_stats_hook_t _stats_hook_fn;
+static void *_stats_hook_data;
+
+
+static void _stats_release(void *record)
+{
+    atomic_store(&((fstr_stats_thread *)record)->active, 0);
+}
+
+
+static void _stats_init(void)
+{
+    pthread_key_create(&_stats_key, _stats_release);
+}
+
+
+/**
+ * @brief Internal function to get the calling thread's counters, reusing a finished thread's if there is one
+ */
+static fstr_stats_thread *_stats_thread_get(void)
+{
+    fstr_stats_thread *st;
+    int inactive;
+
+    pthread_once(&_stats_once, _stats_init);
+    for(st = atomic_load(&_stats_threads); st != NULL; st = st->next) {
+        inactive = 0;
+        if (atomic_compare_exchange_strong(&st->active, &inactive, 1)) {
+            break;
+        }
+    }
+    if (st == NULL) {
+        st = calloc(1, sizeof(fstr_stats_thread));
+        if (st == NULL) {
+            return NULL;
+        }
+        atomic_store(&st->active, 1);
+        st->next = atomic_load(&_stats_threads);
+        while(!atomic_compare_exchange_weak(&_stats_threads, &st->next, st)) {
+        }
+    }
+    pthread_setspecific(_stats_key, st);
+    _thread_stats = st;
+    return st;
+}
+
+
+/**
+ * @brief Internal function to add to one of this thread's counters. Only this thread writes it.
+ */
+static inline void _stats_add(size_t offset, unsigned long n)
+{
+    fstr_stats_thread *st = _thread_stats ? _thread_stats : _stats_thread_get();
+    unsigned long *counter;
+
+    if (st != NULL) {
+        counter = (unsigned long *)((char *)&st->counts + offset);
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+
+static inline uint64_t _stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+#define STAT_ADD(FIELD, N)      _stats_add(offsetof(fstr_stats_info, FIELD), N)
+
+/* Make a call to a callback, counting it and the time it takes */
+#define STAT_CALLBACK(CALL)     do { \
+                                    uint64_t _start = _stats_now(); \
+                                    CALL; \
+                                    STAT_ADD(callbacks, 1); \
+                                    STAT_ADD(callback_ns, _stats_now() - _start); \
+                                } while(0)
+
+
+/**
+ * @brief Internal function to add a render to its format's counters
+ */
+static void _stats_format_add(const char *format, unsigned long renders, size_t len, uint64_t ns)
+{
+    struct fstr_stats_table *table = _stats_table;
+    fstr_stats_slot *slot = &table->other;
+    const char *key;
+    size_t i, probe;
+
+    i = ((uintptr_t)format >> 3) * 0x9e3779b97f4a7c15ull >> 32;
+    for(probe = 0; probe < STATS_PROBES; probe++, i++) {
+        key = atomic_load_explicit(&table->slots[i & table->mask].key, memory_order_acquire);
+        if (key == format) {
+            slot = &table->slots[i & table->mask];
+            break;
+        }
+        if (key != NULL) {
+            continue;
+        }
+        /* A new format. Slots are only ever filled, so only this one needs checking again */
+        pthread_mutex_lock(&_stats_lock);
+        key = atomic_load(&table->slots[i & table->mask].key);
+        if (key == NULL && table->count < table->max && (table->slots[i & table->mask].text = strdup(format)) != NULL) {
+            atomic_store_explicit(&table->slots[i & table->mask].key, format, memory_order_release);
+            table->count++;
+            key = format;
+        }
+        pthread_mutex_unlock(&_stats_lock);
+        if (key == format) {
+            slot = &table->slots[i & table->mask];
+        }
+        if (key == format || key == NULL) {
+            break;
+        }
+    }
+    atomic_fetch_add_explicit(&slot->renders, renders, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->bytes, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->ns, ns, memory_order_relaxed);
+}
+
+
+/**
+ * @brief Internal function to count a finished render, and pass it to the hook
+ * 
+ * @param start     When the render started, or 0 if it wasn't timed
+ */
+static void _stats_render(const char *format, unsigned long renders, size_t len, uint64_t start)
+{
+    uint64_t ns;
+
+    STAT_ADD(renders, renders);
+    STAT_ADD(bytes, len);
+    if (start != 0) {
+        ns = _stats_now() - start;
+        if (_stats_table != NULL) {
+            _stats_format_add(format, renders, len, ns);
+        }
+        if (_stats_hook_fn != NULL) {
+            _stats_hook_fn(_stats_hook_data, format, len, ns);
+        }
+    }
+}
+
+
+static void _stats_total(fstr_stats_info *info)
+{
+    fstr_stats_thread *st;
+    unsigned long *total = (unsigned long *)info, *counts;
+    size_t i;
+
+    memset(info, 0, sizeof(*info));
+    for(st = atomic_load(&_stats_threads); st != NULL; st = st->next) {
+        counts = (unsigned long *)&st->counts;
+        for(i = 0; i < sizeof(fstr_stats_info) / sizeof(unsigned long); i++) {
+            total[i] += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+int fstr_stats(fstr_stats_info *info)
+{
+    unsigned long *total = (unsigned long *)info, *base = (unsigned long *)&_stats_base;
+    size_t i;
+
+    _stats_total(info);
+    pthread_mutex_lock(&_stats_lock);
+    for(i = 0; i < sizeof(fstr_stats_info) / sizeof(unsigned long); i++) {
+        total[i] -= base[i];
+    }
+    pthread_mutex_unlock(&_stats_lock);
+    return 0;
+}
+
+
+static void _stats_slot_reset(fstr_stats_slot *slot)
+{
+    atomic_store(&slot->renders, 0);
+    atomic_store(&slot->bytes, 0);
+    atomic_store(&slot->ns, 0);
+}
+
+
+void fstr_stats_reset(void)
+{
+    fstr_stats_info now;
+    size_t i;
+
+    /* Other threads own their counters, so rather than zero them, remember where they were */
+    _stats_total(&now);
+    pthread_mutex_lock(&_stats_lock);
+    _stats_base = now;
+    if (_stats_table != NULL) {
+        for(i = 0; i <= _stats_table->mask; i++) {
+            _stats_slot_reset(&_stats_table->slots[i]);
+        }
+        _stats_slot_reset(&_stats_table->other);
+    }
+    pthread_mutex_unlock(&_stats_lock);
+}
+
+
+int fstr_stats_formats(size_t max_formats)
+{
+    struct fstr_stats_table *table = NULL;
+    size_t size = STATS_PROBES, i;
+
+    if (max_formats > 0) {
+        while(size < max_formats * 2) {
+            size <<= 1;
+        }
+        table = calloc(1, sizeof(struct fstr_stats_table));
+        if (table == NULL || (table->slots = calloc(size, sizeof(fstr_stats_slot))) == NULL) {
+            free(table);
+            return -1;
+        }
+        table->mask = size - 1;
+        table->max = max_formats;
+    }
+
+    pthread_mutex_lock(&_stats_lock);
+    if (_stats_table != NULL) {
+        for(i = 0; i <= _stats_table->mask; i++) {
+            free(_stats_table->slots[i].text);
+        }
+        free(_stats_table->slots);
+        free(_stats_table);
+    }
+    _stats_table = table;
+    pthread_mutex_unlock(&_stats_lock);
+    return 0;
+}
+
+
+static int _format_stats_cmp(const void *a, const void *b)
+{
+    const fstr_format_stats *fa = a, *fb = b;
+
+    return fa->renders < fb->renders ? 1 : fa->renders > fb->renders ? -1 : 0;
+}
+
+
+size_t fstr_stats_top(fstr_format_stats *formats, size_t max)
+{
+    fstr_format_stats *all;
+    fstr_stats_slot *slot;
+    size_t i, n = 0;
+
+    pthread_mutex_lock(&_stats_lock);
+    if (_stats_table == NULL || (all = malloc(sizeof(fstr_format_stats) * (_stats_table->count + 1))) == NULL) {
+        pthread_mutex_unlock(&_stats_lock);
+        return 0;
+    }
+    for(i = 0; i <= _stats_table->mask + 1; i++) {
+        slot = i <= _stats_table->mask ? &_stats_table->slots[i] : &_stats_table->other;
+        if (atomic_load(&slot->renders) == 0) {
+            continue;
+        }
+        all[n].format = atomic_load(&slot->key) ? slot->text : NULL;
+        all[n].renders = atomic_load(&slot->renders);
+        all[n].bytes = atomic_load(&slot->bytes);
+        all[n].ns = atomic_load(&slot->ns);
+        n++;
+    }
+    pthread_mutex_unlock(&_stats_lock);
+    qsort(all, n, sizeof(fstr_format_stats), _format_stats_cmp);
+    if (n > max) {
+        n = max;
+    }
+    memcpy(formats, all, sizeof(fstr_format_stats) * n);
+    free(all);
+    return n;
+}
+
+
+void fstr_stats_hook(fstr_stats_hook_t hook, void *data)
+{
+    _stats_hook_data = data;
+    _stats_hook_fn = hook;
+}
+
+#else
+
+#define STAT_ADD(FIELD, N)
+#define STAT_CALLBACK(CALL)     do { CALL; } while(0)
+
+
+int fstr_stats(fstr_stats_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    return -1;
+}
+
+
+void fstr_stats_reset(void)
+{
+}
+
+
+int fstr_stats_formats(size_t max_formats)
+{
+    return max_formats > 0 ? -1 : 0;
+}
+
+
+size_t fstr_stats_top(fstr_format_stats *formats, size_t max)
+{
+    return 0;
+}
+
+
+void fstr_stats_hook(fstr_stats_hook_t hook, void *data)
+{
+}
+
+#endif
+
+
+/*
+ * Value tables.
+ *
+ * An open addressing (linear probing) hash of the case folded names. Each slot holds
+ * the name's hash (see _name_hash()) and the index+1 of the entry (0 is an empty
+ * slot). Entries keep the order
+ * of the original list so the "first match wins" and wildcard rules can be honoured.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t index;
+} fstr_table_slot;
+
+struct fstr_table {
+    size_t count;
+    size_t mask;
+    long wildcard;          /* Index of the first "*" entry, or -1 */
+    fstr_value *entries;
+    fstr_table_slot *slots;
+};
+
+
+/**
+ * @brief Internal function to hash a name, case insensitively (FNV-1a, of the name in lower case)
+ */
+static uint32_t _name_hash(const char *name, size_t name_len)
+{
+    uint32_t h = 2166136261u;
+    unsigned char c;
+
+    while(name_len-- > 0) {
+        c = *name++;
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+
+uint32_t fstr_name_hash(const char *name, size_t name_len)
+{
+    return _name_hash(name, name_len);
+}
+
+
+/**
+ * @brief Internal function to get a value's name hash and length, working them out if the value doesn't have them
+ */
+static inline uint32_t _value_name_hash(const fstr_value *val, uint32_t *name_len)
+{
+    *name_len = val->name_len != 0 ? val->name_len : strlen(val->name);
+    return val->name_hashed ? val->name_hash : _name_hash(val->name, *name_len);
+}
+
+
+/**
+ * @brief Internal function to check if finding values in a list needs the names' hashes, ie it has tables or hashed values
+ */
+static int _values_hashed(fstr_value *values[])
+{
+    int i;
+
+    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        if (values[i]->type == fstr_vt_table || values[i]->name_hashed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to pick a table slot for a hash, which mixes the high bits into the low ones
+ */
+static inline size_t _hash_slot(uint32_t hash, size_t mask)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    return hash & mask;
+}
+
+
+/**
+ * @brief Internal function to compare a value's name with a (not \0 terminated) name
+ */
+static int _name_equal(const char *value_name, const char *name, size_t name_len)
+{
+    return strncasecmp(value_name, name, name_len) == 0 && value_name[name_len] == 0;
+}
+
+
+/**
+ * @brief Internal function to count the entries a values list will add to a table
+ */
+static size_t _table_count(fstr_value *values[])
+{
+    size_t i, n = 0;
+
+    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        n += values[i]->type == fstr_vt_table ? values[i]->value.t->count : 1;
+    }
+    return n;
+}
+
+
+/**
+ * @brief Internal function to add an entry to a table, unless the name is already there
+ */
+static void _table_insert(fstr_table *table, const fstr_value *val)
+{
+    uint32_t hash, idx, name_len;
+    fstr_value *entry = &table->entries[table->count];
+    size_t slot;
+
+    if (val->name[0] == '*' && val->name[1] == 0) {
+        if (table->wildcard < 0) {
+            memcpy(&table->entries[table->count], val, sizeof(fstr_value));
+            table->wildcard = table->count++;
+        }
+        return;
+    }
+    memcpy(entry, val, sizeof(fstr_value));
+    hash = _value_name_hash(entry, &name_len);
+    for(slot = _hash_slot(hash, table->mask); (idx = table->slots[slot].index) != 0; slot = (slot + 1) & table->mask) {
+        if (table->slots[slot].hash == hash && strcasecmp(table->entries[idx - 1].name, val->name) == 0) {
+            return;
+        }
+    }
+    table->slots[slot].hash = hash;
+    table->slots[slot].index = ++table->count;
+}
+
+
+fstr_table *fstr_table_new(fstr_value *values[])
+{
+    fstr_table *table;
+    size_t i, j, n, nslots = 8;
+
+    n = _table_count(values);
+    while(nslots < n * 2) {
+        nslots *= 2;
+    }
+    table = calloc(1, sizeof(fstr_table) + sizeof(fstr_value) * n + sizeof(fstr_table_slot) * nslots);
+    if (table == NULL) {
+        return NULL;
+    }
+    table->mask = nslots - 1;
+    table->wildcard = -1;
+    table->slots = (fstr_table_slot *)(table + 1);
+    table->entries = (fstr_value *)(table->slots + nslots);
+
+    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        if (values[i]->type == fstr_vt_table) {
+            for(j = 0; j < values[i]->value.t->count; j++) {
+                _table_insert(table, &values[i]->value.t->entries[j]);
+            }
+        } else {
+            _table_insert(table, values[i]);
+        }
+    }
+    return table;
+}
+
+
+void fstr_table_free(fstr_table *table)
+{
+    free(table);
+}
+
+
+/**
+ * @brief Internal function to find the entry for a name in a table
+ * 
+ * @return The matching entry (which may be the wildcard), or NULL.
+ */
+static const fstr_value *_table_lookup(const fstr_table *table, const char *name, size_t name_len, uint32_t hash)
+{
+    uint32_t idx;
+    size_t slot;
+
+    for(slot = _hash_slot(hash, table->mask); (idx = table->slots[slot].index) != 0; slot = (slot + 1) & table->mask) {
+        if (table->slots[slot].hash == hash && _name_equal(table->entries[idx - 1].name, name, name_len)) {
+            /* A wildcard earlier in the list takes precedence */
+            if (table->wildcard >= 0 && table->wildcard < idx - 1) {
+                break;
+            }
+            return &table->entries[idx - 1];
+        }
+    }
+    return table->wildcard >= 0 ? &table->entries[table->wildcard] : NULL;
+}
+
+
+/*
+ * Number formatting.
+ *
+ * Integers are converted two digits at a time using a lookup table. Floating point
+ * numbers are printed with the fewest digits that read back as the same number, in the
+ * same style as Python (3.14159, 2.0, 1e+16), using Florian Loitsch's Grisu2 algorithm.
+ * FSTR_FLOAT_FIXED instead gives exactly what printf's %f would, worked out with big
+ * integers so there is no rounding error. None of this depends on the locale.
+ */
+#define NUMBER_MAX_LEN      32
+#define BIGNUM_LIMBS        36
+
+static int _float_mode = FSTR_FLOAT_SHORTEST;
+
+static const char _digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t _pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/* Normalised 64 bit approximations of 10^-348, 10^-340, ... 10^340 */
+static const struct {
+    uint64_t f;
+    int e;
+} _cached_powers[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 }, { 0x8b16fb203055ac76ULL, -1166 },
+    { 0xcf42894a5dce35eaULL, -1140 }, { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 }, { 0xbe5691ef416bd60cULL, -1007 },
+    { 0x8dd01fad907ffc3cULL, -980 }, { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 }, { 0x823c12795db6ce57ULL, -847 },
+    { 0xc21094364dfb5637ULL, -821 }, { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 }, { 0xb23867fb2a35b28eULL, -688 },
+    { 0x84c8d4dfd2c63f3bULL, -661 }, { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 }, { 0xf3e2f893dec3f126ULL, -529 },
+    { 0xb5b5ada8aaff80b8ULL, -502 }, { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 }, { 0xa6dfbd9fb8e5b88fULL, -369 },
+    { 0xf8a95fcf88747d94ULL, -343 }, { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 }, { 0xe45c10c42a2b3b06ULL, -210 },
+    { 0xaa242499697392d3ULL, -183 }, { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 }, { 0x9c40000000000000ULL, -50 },
+    { 0xe8d4a51000000000ULL, -24 }, { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 }, { 0xd5d238a4abe98068ULL, 109 },
+    { 0x9f4f2726179a2245ULL, 136 }, { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 }, { 0x924d692ca61be758ULL, 269 },
+    { 0xda01ee641a708deaULL, 295 }, { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 }, { 0xc83553c5c8965d3dULL, 428 },
+    { 0x952ab45cfa97a0b3ULL, 455 }, { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 }, { 0x88fcf317f22241e2ULL, 588 },
+    { 0xcc20ce9bd35c78a5ULL, 614 }, { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 }, { 0xbb764c4ca7a44410ULL, 747 },
+    { 0x8bab8eefb6409c1aULL, 774 }, { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 }, { 0x80444b5e7aa7cf85ULL, 907 },
+    { 0xbf21e44003acdd2dULL, 933 }, { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 }, { 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+typedef struct {
+    uint64_t f;
+    int e;
+} fstr_diyfp;
+
+typedef struct {
+    uint32_t d[BIGNUM_LIMBS];
+    int n;
+} fstr_bignum;
+
+
+int fstr_float_mode(int mode)
+{
+    int old = _float_mode;
+
+    _float_mode = mode;
+    return old;
+}
+
+
+/**
+ * @brief Internal function to write an unsigned number to out, which must have room for 20 characters.
+ * 
+ * @return The number of characters written.
+ */
+static int _fmt_uint64(char *out, uint64_t v)
+{
+    int len = 1;
+    unsigned i;
+    char *p;
+
+    while(len < 20 && v >= _pow10[len]) {
+        len++;
+    }
+    p = out + len;
+    while(v >= 100) {
+        i = (v % 100) * 2;
+        v /= 100;
+        *--p = _digit_pairs[i + 1];
+        *--p = _digit_pairs[i];
+    }
+    if (v >= 10) {
+        *--p = _digit_pairs[v * 2 + 1];
+        *--p = _digit_pairs[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Internal function to write a signed number to out, which must have room for 21 characters.
+ */
+static int _fmt_int64(char *out, int64_t v)
+{
+    if (v < 0) {
+        *out = '-';
+        return 1 + _fmt_uint64(out + 1, 0 - (uint64_t)v);
+    }
+    return _fmt_uint64(out, v);
+}
+
+
+static fstr_diyfp _diyfp_mul(fstr_diyfp x, fstr_diyfp y)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1U << 31);
+    fstr_diyfp r;
+
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+
+static fstr_diyfp _diyfp_normalize(fstr_diyfp x)
+{
+    while(!(x.f & 0xFFF0000000000000ULL)) {
+        x.f <<= 12;
+        x.e -= 12;
+    }
+    while(!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+
+static void _grisu_round(char *digits, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while(rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+
+/**
+ * @brief Internal function to generate the digits of the shortest number between the boundaries
+ */
+static int _grisu_digits(fstr_diyfp w, fstr_diyfp mp, uint64_t delta, char *digits, int *K)
+{
+    fstr_diyfp one = { (uint64_t)1 << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f, p2 = mp.f & (one.f - 1), tmp;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e), d;
+    int kappa = 1, len = 0;
+
+    while(kappa < 10 && p1 >= _pow10[kappa]) {
+        kappa++;
+    }
+    while(kappa > 0) {
+        d = p1 / _pow10[kappa - 1];
+        p1 %= _pow10[kappa - 1];
+        if (d || len) {
+            digits[len++] = '0' + d;
+        }
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *K += kappa;
+            _grisu_round(digits, len, delta, tmp, _pow10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+    for(;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || len) {
+            digits[len++] = '0' + d;
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            _grisu_round(digits, len, delta, p2, one.f, -kappa < 20 ? wp_w * _pow10[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+
+/**
+ * @brief Internal function to find the shortest digits for f * 2^e
+ * 
+ * @param[in] hidden    The hidden bit of the floating point type f came from.
+ * 
+ * @return The number of digits. The number is then digits * 10^K.
+ */
+static int _grisu2(uint64_t f, int e, uint64_t hidden, char *digits, int *K)
+{
+    fstr_diyfp v = { f, e }, pl, mi, c, w, wp, wm;
+    double dk;
+    int k, index;
+
+    pl.f = (f << 1) + 1;
+    pl.e = e - 1;
+    pl = _diyfp_normalize(pl);
+    if (f == hidden) {
+        mi.f = (f << 2) - 1;
+        mi.e = e - 2;
+    } else {
+        mi.f = (f << 1) - 1;
+        mi.e = e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    /* Pick the cached power of ten that puts the product's exponent in range */
+    dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+    k = (int)dk;
+    if (dk - k > 0.0) {
+        k++;
+    }
+    index = (k >> 3) + 1;
+    *K = -(-348 + index * 8);
+    c.f = _cached_powers[index].f;
+    c.e = _cached_powers[index].e;
+
+    w = _diyfp_mul(_diyfp_normalize(v), c);
+    wp = _diyfp_mul(pl, c);
+    wm = _diyfp_mul(mi, c);
+    wm.f++;
+    wp.f--;
+    return _grisu_digits(w, wp, wp.f - wm.f, digits, K);
+}
+
+
+/**
+ * @brief Internal function to lay out digits * 10^K the way Python does
+ */
+static int _fmt_digits(char *out, const char *digits, int len, int K)
+{
+    int exp10 = len + K - 1, i;
+    char *p = out;
+
+    if (exp10 >= -4 && exp10 < 16) {
+        if (K >= 0) {
+            memcpy(p, digits, len);
+            p += len;
+            memset(p, '0', K);
+            p += K;
+            *p++ = '.';
+            *p++ = '0';
+        } else if (exp10 >= 0) {
+            memcpy(p, digits, exp10 + 1);
+            p += exp10 + 1;
+            *p++ = '.';
+            memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+            p += len - exp10 - 1;
+        } else {
+            *p++ = '0';
+            *p++ = '.';
+            for(i = exp10 + 1; i < 0; i++) {
+                *p++ = '0';
+            }
+            memcpy(p, digits, len);
+            p += len;
+        }
+        return p - out;
+    }
+    *p++ = digits[0];
+    if (len > 1) {
+        *p++ = '.';
+        memcpy(p, digits + 1, len - 1);
+        p += len - 1;
+    }
+    *p++ = 'e';
+    *p++ = exp10 < 0 ? '-' : '+';
+    if (exp10 < 0) {
+        exp10 = -exp10;
+    }
+    if (exp10 < 10) {
+        *p++ = '0';
+    }
+    p += _fmt_uint64(p, exp10);
+    return p - out;
+}
+
+
+/**
+ * @brief Internal function to write the shortest form of a floating point number
+ * 
+ * @return The number of characters written, at most NUMBER_MAX_LEN.
+ */
+static int _fmt_shortest(char *out, int negative, uint64_t f, int e, uint64_t hidden)
+{
+    char digits[24];
+    int len, K;
+    char *p = out;
+
+    if (negative) {
+        *p++ = '-';
+    }
+    if (f == 0) {
+        memcpy(p, "0.0", 3);
+        return p + 3 - out;
+    }
+    len = _grisu2(f, e, hidden, digits, &K);
+    return p - out + _fmt_digits(p, digits, len, K);
+}
+
+
+/**
+ * @brief Internal function to split a double into sign, significand and exponent
+ * 
+ * @return 0 for finite numbers, 1 for infinity and 2 for NaN.
+ */
+static int _double_parts(double v, int *negative, uint64_t *f, int *e)
+{
+    uint64_t bits;
+    int be;
+
+    memcpy(&bits, &v, sizeof(bits));
+    *negative = bits >> 63;
+    be = (bits >> 52) & 0x7FF;
+    *f = bits & 0xFFFFFFFFFFFFFULL;
+    if (be == 0x7FF) {
+        return *f ? 2 : 1;
+    }
+    if (be == 0) {
+        *e = -1074;
+    } else {
+        *f |= 1ULL << 52;
+        *e = be - 1075;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to split a float into sign, significand and exponent. See _double_parts().
+ */
+static int _float_parts(float v, int *negative, uint64_t *f, int *e)
+{
+    uint32_t bits;
+    int be;
+
+    memcpy(&bits, &v, sizeof(bits));
+    *negative = bits >> 31;
+    be = (bits >> 23) & 0xFF;
+    *f = bits & 0x7FFFFF;
+    if (be == 0xFF) {
+        return *f ? 2 : 1;
+    }
+    if (be == 0) {
+        *e = -149;
+    } else {
+        *f |= 1ULL << 23;
+        *e = be - 150;
+    }
+    return 0;
+}
+
+
+static int _fmt_special(char *out, int negative, int kind)
+{
+    char *p = out;
+
+    if (negative) {
+        *p++ = '-';
+    }
+    memcpy(p, kind == 1 ? "inf" : "nan", 3);
+    return p + 3 - out;
+}
+
+
+static int _fmt_double(char *out, double v)
+{
+    uint64_t f;
+    int e, negative, kind;
+
+    kind = _double_parts(v, &negative, &f, &e);
+    if (kind) {
+        return _fmt_special(out, negative, kind);
+    }
+    return _fmt_shortest(out, negative, f, e, 1ULL << 52);
+}
+
+
+static int _fmt_float(char *out, float v)
+{
+    uint64_t f;
+    int e, negative, kind;
+
+    kind = _float_parts(v, &negative, &f, &e);
+    if (kind) {
+        return _fmt_special(out, negative, kind);
+    }
+    return _fmt_shortest(out, negative, f, e, 1ULL << 23);
+}
+
+
+/**
+ * @brief Internal function to shift a bignum left
+ */
+static void _bignum_shl(fstr_bignum *b, int bits)
+{
+    int words = bits / 32, shift = bits % 32, i;
+
+    if (shift) {
+        b->d[b->n] = 0;
+        for(i = b->n; i > 0; i--) {
+            b->d[i] = (b->d[i] << shift) | (b->d[i - 1] >> (32 - shift));
+        }
+        b->d[0] <<= shift;
+        b->n++;
+    }
+    if (words) {
+        memmove(b->d + words, b->d, sizeof(uint32_t) * b->n);
+        memset(b->d, 0, sizeof(uint32_t) * words);
+        b->n += words;
+    }
+    while(b->n > 0 && b->d[b->n - 1] == 0) {
+        b->n--;
+    }
+}
+
+
+/**
+ * @brief Internal function to divide a bignum by 10^9
+ * 
+ * @return The remainder
+ */
+static uint32_t _bignum_div1e9(fstr_bignum *b)
+{
+    uint64_t rem = 0, cur;
+    int i;
+
+    for(i = b->n - 1; i >= 0; i--) {
+        cur = (rem << 32) | b->d[i];
+        b->d[i] = cur / 1000000000u;
+        rem = cur % 1000000000u;
+    }
+    while(b->n > 0 && b->d[b->n - 1] == 0) {
+        b->n--;
+    }
+    return rem;
+}
+
+
+/**
+ * @brief Internal function to get the next decimal digit of the fraction b / 2^shift
+ * 
+ * Multiplies b by 10 and takes off the whole part, which is the digit.
+ */
+static int _bignum_next_digit(fstr_bignum *b, int shift)
+{
+    uint64_t carry = 0;
+    int i, word = shift / 32, bit = shift % 32, digit;
+
+    for(i = 0; i < b->n; i++) {
+        carry += (uint64_t)b->d[i] * 10;
+        b->d[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry) {
+        b->d[b->n++] = carry;
+    }
+    if (word >= b->n) {
+        return 0;
+    }
+    digit = b->d[word] >> bit;
+    if (bit && word + 1 < b->n) {
+        digit |= b->d[word + 1] << (32 - bit);
+    }
+    b->d[word] &= ((uint32_t)1 << bit) - 1;
+    b->n = word + 1;
+    while(b->n > 0 && b->d[b->n - 1] == 0) {
+        b->n--;
+    }
+    return digit;
+}
+
+
+/*
+ * Exact decimal expansion of a double, used for printf style fixed and exponent output.
+ * The whole number part is written out with big integer division, and then the digits
+ * of the fraction are generated one at a time by multiplying by 10.
+ */
+typedef struct {
+    fstr_bignum big;
+    uint64_t frac;
+    int shift;              /* The fraction is frac / 2^shift (or big / 2^shift) */
+    int use_big;
+} fstr_exact;
+
+
+/**
+ * @brief Internal function to start expanding f * 2^e. Writes out the whole number part.
+ * 
+ * @return The number of digits written (at most 309).
+ */
+static int _exact_start(fstr_exact *x, uint64_t f, int e, char *out)
+{
+    uint32_t chunks[40], c;
+    int nchunks = 0, i;
+    char *p = out;
+
+    x->frac = 0;
+    x->shift = 0;
+    x->use_big = 0;
+    if (e >= 0) {
+        x->big.d[0] = (uint32_t)f;
+        x->big.d[1] = (uint32_t)(f >> 32);
+        x->big.n = x->big.d[1] ? 2 : (x->big.d[0] ? 1 : 0);
+        _bignum_shl(&x->big, e);
+        while(x->big.n > 0) {
+            chunks[nchunks++] = _bignum_div1e9(&x->big);
+        }
+        if (nchunks == 0) {
+            *p++ = '0';
+            return 1;
+        }
+        p += _fmt_uint64(p, chunks[--nchunks]);
+        while(nchunks > 0) {
+            c = chunks[--nchunks];
+            for(i = 8; i >= 0; i--) {
+                p[i] = '0' + c % 10;
+                c /= 10;
+            }
+            p += 9;
+        }
+        return p - out;
+    }
+    x->shift = -e;
+    if (x->shift < 64) {
+        p += _fmt_uint64(p, f >> x->shift);
+        x->frac = f & (((uint64_t)1 << x->shift) - 1);
+    } else {
+        *p++ = '0';
+        x->frac = f;
+    }
+    if (x->shift > 60) {
+        /* Multiplying by 10 could overflow 64 bits */
+        x->use_big = 1;
+        x->big.d[0] = (uint32_t)x->frac;
+        x->big.d[1] = (uint32_t)(x->frac >> 32);
+        x->big.n = x->big.d[1] ? 2 : (x->big.d[0] ? 1 : 0);
+    }
+    return p - out;
+}
+
+
+/**
+ * @brief Internal function to get the next digit of the fraction
+ */
+static int _exact_next(fstr_exact *x)
+{
+    int d;
+
+    if (x->shift == 0) {
+        return 0;
+    } else if (x->use_big) {
+        return _bignum_next_digit(&x->big, x->shift);
+    }
+    x->frac *= 10;
+    d = x->frac >> x->shift;
+    x->frac &= ((uint64_t)1 << x->shift) - 1;
+    return d;
+}
+
+
+/**
+ * @brief Internal function to check if there are any more non zero digits
+ */
+static int _exact_more(fstr_exact *x)
+{
+    return x->use_big ? x->big.n > 0 : x->frac != 0;
+}
+
+
+/**
+ * @brief Internal function to round a string of digits, given the next digit and whether there's more after it
+ * 
+ * Rounds to the nearest, with exact halves going to even, skipping over any '.'.
+ * 
+ * @return 1 if the carry went off the front (eg 99.9 to 00.0), in which case a 1 needs to go in front.
+ */
+static int _round_digits(char *first, char *end, int next, int sticky)
+{
+    char *q = end - 1;
+
+    if (q >= first && *q == '.') {
+        q--;
+    }
+    if (q < first || !(next > 5 || (next == 5 && (sticky || ((*q - '0') & 1))))) {
+        return 0;
+    }
+    for(; q >= first; q--) {
+        if (*q == '.') {
+            continue;
+        }
+        if (*q != '9') {
+            (*q)++;
+            return 0;
+        }
+        *q = '0';
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Internal function to write f * 2^e with a fixed number of decimal places, exactly as %f would.
+ * 
+ * out needs room for 311 + precision characters.
+ * 
+ * @return The number of characters written.
+ */
+static int _fmt_fixed_parts(char *out, uint64_t f, int e, int precision, int alt)
+{
+    fstr_exact x;
+    char *p = out;
+    int i, next;
+
+    p += _exact_start(&x, f, e, p);
+    if (precision > 0 || alt) {
+        *p++ = '.';
+    }
+    for(i = 0; i < precision; i++) {
+        *p++ = '0' + _exact_next(&x);
+    }
+    next = _exact_next(&x);
+    if (_round_digits(out, p, next, _exact_more(&x))) {
+        memmove(out + 1, out, p - out);
+        *out = '1';
+        p++;
+    }
+    return p - out;
+}
+
+
+/**
+ * @brief Internal function to get the first ndigits significant digits of f * 2^e, rounded.
+ * 
+ * @return The decimal exponent of the first digit.
+ */
+static int _fmt_sig_digits(char *digits, uint64_t f, int e, int ndigits)
+{
+    fstr_exact x;
+    char whole[320];
+    int n, i, exp10, next, sticky;
+
+    if (f == 0) {
+        memset(digits, '0', ndigits);
+        return 0;
+    }
+    n = _exact_start(&x, f, e, whole);
+    if (n > 1 || whole[0] != '0') {
+        exp10 = n - 1;
+        if (n > ndigits) {
+            memcpy(digits, whole, ndigits);
+            next = whole[ndigits] - '0';
+            for(sticky = 0, i = ndigits + 1; i < n && !sticky; i++) {
+                sticky = whole[i] != '0';
+            }
+            sticky = sticky || _exact_more(&x);
+        } else {
+            memcpy(digits, whole, n);
+            for(i = n; i < ndigits; i++) {
+                digits[i] = '0' + _exact_next(&x);
+            }
+            next = _exact_next(&x);
+            sticky = _exact_more(&x);
+        }
+    } else {
+        exp10 = -1;
+        while((next = _exact_next(&x)) == 0) {
+            exp10--;
+        }
+        digits[0] = '0' + next;
+        for(i = 1; i < ndigits; i++) {
+            digits[i] = '0' + _exact_next(&x);
+        }
+        next = _exact_next(&x);
+        sticky = _exact_more(&x);
+    }
+    if (_round_digits(digits, digits + ndigits, next, sticky)) {
+        digits[0] = '1';
+        exp10++;
+    }
+    return exp10;
+}
+
+
+/**
+ * @brief Internal function to write a double with a fixed number of decimal places, exactly as %f would.
+ */
+static int _fmt_fixed(char *out, double v, int precision)
+{
+    uint64_t f;
+    int e, negative, kind;
+    char *p = out;
+
+    kind = _double_parts(v, &negative, &f, &e);
+    if (negative) {
+        *p++ = '-';
+    }
+    if (kind) {
+        return p - out + _fmt_special(p, 0, kind);
+    }
+    return p - out + _fmt_fixed_parts(p, f, e, precision, 0);
+}
+
+
+/*
+ * Format specs.
+ *
+ * A placeholder can have a Python style format spec after a colon, eg {pi:.3f} or
+ * {id:08x}:
+ *      [[fill]align][sign][#][0][width][grouping][.precision][type]
+ * The spec is parsed once into a fstr_spec (when the template is compiled, or as the
+ * format is scanned) and then applied by the formatters below, without building or
+ * parsing a printf format.
+ */
+#define SPEC_BUFFER_LEN     1024
+#define MAX_PRECISION       100
+#define MAX_WIDTH           9999
+
+typedef struct {
+    char fill[4];
+    unsigned char fill_len;
+    char align;             /* '<', '>', '^', '=' or 0 for the default */
+    char zero;              /* The '0' option was given */
+    char sign;              /* '+', '-' or ' ' */
+    char alt;               /* The '#' option was given */
+    char grouping;          /* ',', '_' or 0 */
+    char type;              /* One of "sbdoxXeEfFgG%", or 0 */
+    int width;
+    int precision;          /* -1 if not given */
+} fstr_spec;
+
+
+/**
+ * @brief Internal function to get the length of the UTF-8 character starting at c
+ */
+static size_t _utf8_len(unsigned char c)
+{
+    if ((c & 0xE0) == 0xC0) return 2;
+    if ((c & 0xF0) == 0xE0) return 3;
+    if ((c & 0xF8) == 0xF0) return 4;
+    return 1;
+}
+
+
+/**
+ * @brief Internal function to count the characters (not bytes) in a UTF-8 string
+ */
+static size_t _utf8_chars(const char *s, size_t len)
+{
+    size_t i, n = 0;
+
+    for(i = 0; i < len; i++) {
+        n += (s[i] & 0xC0) != 0x80;
+    }
+    return n;
+}
+
+
+/**
+ * @brief Internal function to parse a format spec (the part after the colon)
+ * 
+ * @return 0 on success, -1 if it isn't a valid spec.
+ */
+static int _parse_spec(const char *sp, size_t len, fstr_spec *spec)
+{
+    const char *end = sp + len;
+    size_t cl;
+    int has_fill = 0;
+
+    memset(spec, 0, sizeof(fstr_spec));
+    spec->fill[0] = ' ';
+    spec->fill_len = 1;
+    spec->sign = '-';
+    spec->precision = -1;
+
+    if (sp < end) {
+        cl = _utf8_len(*sp);
+        if (sp + cl < end && sp[cl] != 0 && strchr("<>^=", sp[cl])) {
+            memcpy(spec->fill, sp, cl);
+            spec->fill_len = cl;
+            spec->align = sp[cl];
+            has_fill = 1;
+            sp += cl + 1;
+        } else if (strchr("<>^=", *sp)) {
+            spec->align = *sp++;
+        }
+    }
+    if (sp < end && (*sp == '+' || *sp == '-' || *sp == ' ')) {
+        spec->sign = *sp++;
+    }
+    if (sp < end && *sp == '#') {
+        spec->alt = 1;
+        sp++;
+    }
+    if (sp < end && *sp == '0') {
+        spec->zero = 1;
+        sp++;
+    }
+    while(sp < end && *sp >= '0' && *sp <= '9') {
+        spec->width = spec->width * 10 + *sp++ - '0';
+        if (spec->width > MAX_WIDTH) {
+            return -1;
+        }
+    }
+    if (sp < end && (*sp == ',' || *sp == '_')) {
+        spec->grouping = *sp++;
+    }
+    if (sp < end && *sp == '.') {
+        sp++;
+        if (sp == end || *sp < '0' || *sp > '9') {
+            return -1;
+        }
+        spec->precision = 0;
+        while(sp < end && *sp >= '0' && *sp <= '9') {
+            spec->precision = spec->precision * 10 + *sp++ - '0';
+            if (spec->precision > MAX_PRECISION) {
+                return -1;
+            }
+        }
+    }
+    if (sp < end && *sp != 0 && strchr("sbdoxXeEfFgG%", *sp)) {
+        spec->type = *sp++;
+    }
+    /* Like Python, 0 pads with zeros unless there's a fill character, whatever the alignment */
+    if (spec->zero && !has_fill) {
+        spec->fill[0] = '0';
+    }
+    return sp == end ? 0 : -1;
+}
+
+
+/**
+ * @brief Internal function to split a placeholder into its name and spec
+ * 
+ * If what follows the colon isn't a valid spec the whole thing is the name, as it was before
+ * specs were supported.
+ * 
+ * @return The length of the name. has_spec is set if a spec was found.
+ */
+static size_t _split_spec(const char *name, size_t len, fstr_spec *spec, int *has_spec)
+{
+    const char *colon = memchr(name, ':', len);
+
+    *has_spec = 0;
+    if (colon == NULL || _parse_spec(colon + 1, name + len - colon - 1, spec) < 0) {
+        return len;
+    }
+    *has_spec = 1;
+    return colon - name;
+}
+
+
+/**
+ * @brief Internal function to write the digits of a number in base 2, 8 or 16
+ */
+static int _fmt_base(char *out, uint64_t v, int bits, int upper)
+{
+    const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    unsigned mask = (1 << bits) - 1;
+    int len = 1, i;
+    uint64_t t;
+
+    for(t = v >> bits; t; t >>= bits) {
+        len++;
+    }
+    for(i = len - 1; i >= 0; i--, v >>= bits) {
+        out[i] = hex[v & mask];
+    }
+    return len;
+}
+
+
+/**
+ * @brief Internal function to lay out significant digits in exponent form, eg 1.234e+05
+ */
+static int _fmt_exp_layout(char *out, const char *digits, int ndigits, int exp10, int alt, int upper)
+{
+    char *p = out;
+
+    *p++ = digits[0];
+    if (ndigits > 1 || alt) {
+        *p++ = '.';
+    }
+    memcpy(p, digits + 1, ndigits - 1);
+    p += ndigits - 1;
+    *p++ = upper ? 'E' : 'e';
+    *p++ = exp10 < 0 ? '-' : '+';
+    if (exp10 < 0) {
+        exp10 = -exp10;
+    }
+    if (exp10 < 10) {
+        *p++ = '0';
+    }
+    p += _fmt_uint64(p, exp10);
+    return p - out;
+}
+
+
+/**
+ * @brief Internal function to lay out significant digits with a decimal point, eg 1234.5
+ */
+static int _fmt_point_layout(char *out, const char *digits, int ndigits, int exp10, int alt)
+{
+    char *p = out;
+    int i;
+
+    if (exp10 >= ndigits) {
+        /* Trailing zeros were stripped from the digits, eg 100 with 'g' */
+        memcpy(p, digits, ndigits);
+        p += ndigits;
+        for(i = ndigits; i <= exp10; i++) {
+            *p++ = '0';
+        }
+        if (alt) {
+            *p++ = '.';
+        }
+    } else if (exp10 >= 0) {
+        memcpy(p, digits, exp10 + 1);
+        p += exp10 + 1;
+        if (ndigits > exp10 + 1 || alt) {
+            *p++ = '.';
+        }
+        memcpy(p, digits + exp10 + 1, ndigits - exp10 - 1);
+        p += ndigits - exp10 - 1;
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for(i = exp10 + 1; i < 0; i++) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, ndigits);
+        p += ndigits;
+    }
+    return p - out;
+}
+
+
+/**
+ * @brief Internal function for the 'g' type, and no type with a precision
+ */
+static int _fmt_general(char *out, uint64_t f, int e, const fstr_spec *spec)
+{
+    char digits[MAX_PRECISION + 1];
+    int P = spec->precision < 0 ? 6 : (spec->precision == 0 ? 1 : spec->precision);
+    int exp10, len, switch_at = spec->type ? P : P - 1;
+    char *p;
+
+    exp10 = _fmt_sig_digits(digits, f, e, P);
+    if (!spec->alt) {
+        while(P > 1 && digits[P - 1] == '0') {
+            P--;
+        }
+    }
+    if (exp10 < -4 || exp10 >= switch_at) {
+        return _fmt_exp_layout(out, digits, P, exp10, spec->alt, spec->type == 'G');
+    }
+    len = _fmt_point_layout(out, digits, P, exp10, spec->alt);
+    if (spec->type == 0 && memchr(out, '.', len) == NULL) {
+        /* Like Python, always show it's not an integer */
+        p = out + len;
+        *p++ = '.';
+        *p++ = '0';
+        len += 2;
+    }
+    return len;
+}
+
+
+/**
+ * @brief Internal function to write the digits of a number according to the spec
+ * 
+ * The sign and any prefix (like 0x) are not written, instead negative is set if the number
+ * is negative, and the prefix is copied into prefix (which needs room for 3 characters).
+ * 
+ * @return The length.
+ */
+static int _fmt_spec_number(char *out, const fstr_value *val, const fstr_spec *spec, int *negative, char *prefix)
+{
+    char type = spec->type, *p = out, digits[MAX_PRECISION + 2];
+    int64_t iv = 0;
+    uint64_t f, mag = 0;
+    double d = 0;
+    int e, kind, len, upper = type == 'X' || type == 'E' || type == 'F' || type == 'G';
+    int is_int = val->type == fstr_vt_int || val->type == fstr_vt_long || val->type == fstr_vt_ulong;
+
+    if (is_int) {
+        if (val->type == fstr_vt_ulong) {
+            mag = val->value.ul;
+        } else {
+            iv = val->type == fstr_vt_int ? val->value.i : val->value.l;
+            mag = iv < 0 ? 0 - (uint64_t)iv : (uint64_t)iv;
+        }
+        if (type != 0 && strchr("eEfFgG%", type)) {
+            d = val->type == fstr_vt_ulong ? (double)mag : (double)iv;
+            is_int = 0;
+        }
+    } else {
+        d = val->type == fstr_vt_float ? val->value.f : val->value.d;
+    }
+
+    if (is_int) {
+        *negative = iv < 0;
+        if (spec->alt && (type == 'b' || type == 'o' || type == 'x' || type == 'X')) {
+            prefix[0] = '0';
+            prefix[1] = type;
+            prefix[2] = 0;
+        }
+        switch(type) {
+        case 'b': return _fmt_base(p, mag, 1, 0);
+        case 'o': return _fmt_base(p, mag, 3, 0);
+        case 'x': return _fmt_base(p, mag, 4, 0);
+        case 'X': return _fmt_base(p, mag, 4, 1);
+        default:  return _fmt_uint64(p, mag);
+        }
+    }
+
+    if (type == '%') {
+        d *= 100;
+    }
+    if (val->type == fstr_vt_float && type == 0 && spec->precision < 0) {
+        kind = _float_parts(val->value.f, negative, &f, &e);
+    } else {
+        kind = _double_parts(d, negative, &f, &e);
+    }
+    if (kind) {
+        if (kind == 2) {
+            *negative = 0;
+        }
+        memcpy(p, kind == 1 ? (upper ? "INF" : "inf") : (upper ? "NAN" : "nan"), 3);
+        p += 3;
+        if (type == '%') {
+            *p++ = '%';
+        }
+        return p - out;
+    }
+    switch(type) {
+    case 'f':
+    case 'F':
+    case '%':
+        p += _fmt_fixed_parts(p, f, e, spec->precision < 0 ? 6 : spec->precision, spec->alt);
+        if (type == '%') {
+            *p++ = '%';
+        }
+        return p - out;
+    case 'e':
+    case 'E':
+        len = (spec->precision < 0 ? 6 : spec->precision) + 1;
+        e = _fmt_sig_digits(digits, f, e, len);
+        return _fmt_exp_layout(p, digits, len, e, spec->alt, upper);
+    case 'g':
+    case 'G':
+        return _fmt_general(p, f, e, spec);
+    default:
+        if (spec->precision >= 0) {
+            return _fmt_general(p, f, e, spec);
+        }
+        if (f == 0) {
+            memcpy(p, "0.0", 3);
+            return 3;
+        }
+        len = _grisu2(f, e, val->type == fstr_vt_float ? 1ULL << 23 : 1ULL << 52, digits, &kind);
+        return _fmt_digits(p, digits, len, kind);
+    }
+}
+
+
+/**
+ * @brief Internal function to put grouping separators into the whole number part of a formatted number
+ * 
+ * If the result would be shorter than min_len, the number is padded with zeros (which are
+ * grouped too, eg 00,001,234). num must have room for SPEC_BUFFER_LEN characters.
+ * 
+ * @return The new length.
+ */
+static int _fmt_grouping(char *num, int len, int group, char sep, int hex, int min_len)
+{
+    char tmp[SPEC_BUFFER_LEN];
+    int ndigits = 0, i, j, grouped;
+
+    while(ndigits < len && ((num[ndigits] >= '0' && num[ndigits] <= '9') ||
+            (hex && ((num[ndigits] >= 'a' && num[ndigits] <= 'f') || (num[ndigits] >= 'A' && num[ndigits] <= 'F'))))) {
+        ndigits++;
+    }
+    if (ndigits == 0) {
+        return len;
+    }
+    while(ndigits + (ndigits - 1) / group + len - ndigits < min_len && len < SPEC_BUFFER_LEN / 2) {
+        memmove(num + 1, num, len);
+        num[0] = '0';
+        ndigits++;
+        len++;
+    }
+    grouped = ndigits + (ndigits - 1) / group;
+    for(i = ndigits - 1, j = grouped - 1; i >= 0; i--) {
+        tmp[j--] = num[i];
+        if (i > 0 && (ndigits - i) % group == 0) {
+            tmp[j--] = sep;
+        }
+    }
+    memmove(num + grouped, num + ndigits, len - ndigits);
+    memcpy(num, tmp, grouped);
+    return len + grouped - ndigits;
+}
+
+
+/**
+ * @brief Internal function used to find the value for the given name in the values list
+ * 
+ * The name does not need to be \0 terminated, so it can point straight into the format.
+ * Values that have their name's length (or hash, see fstr_name_hash()) are passed over without comparing
+ * the names when the length (or hash) doesn't match. hash is only used if there are tables or hashed values.
+ * 
+ * @return Returns the value for that name, or NULL if not found.
+ */
+static const fstr_value *_value_find(const char *name, size_t name_len, uint32_t hash, fstr_value *values[])
+{
+    int i;
+    const fstr_value *val;
+    
+    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        val = values[i];
+
+        if (val->type == fstr_vt_table) {
+            val = _table_lookup(val->value.t, name, name_len, hash);
+            if (val != NULL) {
+                return val;
+            }
+        } else if (val->name_len != 0 ? val->name_len == name_len && (!val->name_hashed || val->name_hash == hash) && 
+                strncasecmp(val->name, name, name_len) == 0 : _name_equal(val->name, name, name_len)) {
+            return val;
+        } else if (val->name[0] == '*' && val->name[1] == 0) {
+            return val;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Internal function to get the most space formatting a value will need, or 0 if it isn't formatted
+ */
+static size_t _value_max_len(const fstr_value *val)
+{
+    switch(val->type) {
+    case fstr_vt_int:
+    case fstr_vt_long:
+    case fstr_vt_ulong:
+        return NUMBER_MAX_LEN;
+    case fstr_vt_float:
+    case fstr_vt_double:
+        return _float_mode == FSTR_FLOAT_FIXED ? VALUE_BUFFER_LEN : NUMBER_MAX_LEN;
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * @brief Internal function to check if a value's text is the caller's own, so stays put during a render
+ */
+static inline int _value_is_stable(const fstr_value *val)
+{
+    return val->type == fstr_vt_str || val->type == fstr_vt_strn;
+}
+
+
+/**
+ * @brief Internal function to get a \0 terminated copy of a name to pass to a callback
+ * 
+ * @return name itself if it is already terminated, namebuff, a malloc()'d copy if it
+ *         doesn't fit, or NULL if out of memory. Release with _cb_name_free().
+ */
+static char *_cb_name(const char *name, size_t name_len, char *namebuff, size_t namebuff_len)
+{
+    char *cb_name = (char *)name;
+
+    if (name[name_len] != 0) {
+        if (name_len < namebuff_len) {
+            cb_name = namebuff;
+        } else if ((cb_name = malloc(name_len + 1)) == NULL) {
+            return NULL;
+        } else {
+            STAT_ADD(allocs, 1);
+        }
+        memcpy(cb_name, name, name_len);
+        cb_name[name_len] = 0;
+    }
+    return cb_name;
+}
+
+
+static void _cb_name_free(char *cb_name, const char *name, char *namebuff)
+{
+    if (cb_name != name && cb_name != namebuff) {
+        free(cb_name);
+    }
+}
+
+
+/**
+ * @brief Internal function to get the text of a value
+ * 
+ * Will call the callback function if provided. Numeric values are formatted into tmpbuff,
+ * which is supplied by the caller (and must have room for _value_max_len() characters) so
+ * that this is safe to call from multiple threads at once.
+ * 
+ * @return Returns the text, and its length in value_len, or NULL on error.
+ */
+static const char *_value_format(const fstr_value *val, const char *name, size_t name_len, char *tmpbuff, size_t *value_len)
+{
+    const char *r;
+    char *cb_name, namebuff[128];
+
+    switch(val->type) {
+    case fstr_vt_str: 
+        *value_len = strlen(val->value.s);
+        return val->value.s; 
+    case fstr_vt_strn:
+        *value_len = val->value.sn.len;
+        return val->value.sn.s;
+    case fstr_vt_int:
+        *value_len = _fmt_int64(tmpbuff, val->value.i);
+        return tmpbuff;
+    case fstr_vt_long:
+        *value_len = _fmt_int64(tmpbuff, val->value.l);
+        return tmpbuff;
+    case fstr_vt_ulong:
+        *value_len = _fmt_uint64(tmpbuff, val->value.ul);
+        return tmpbuff;
+    case fstr_vt_float:
+        *value_len = _float_mode == FSTR_FLOAT_FIXED ? _fmt_fixed(tmpbuff, val->value.f, 6) : _fmt_float(tmpbuff, val->value.f);
+        return tmpbuff;
+    case fstr_vt_double:
+        *value_len = _float_mode == FSTR_FLOAT_FIXED ? _fmt_fixed(tmpbuff, val->value.d, 6) : _fmt_double(tmpbuff, val->value.d);
+        return tmpbuff;
+    case fstr_vt_cb:
+        cb_name = _cb_name(name, name_len, namebuff, sizeof(namebuff));
+        if (cb_name == NULL) {
+            return NULL;
+        }
+        STAT_CALLBACK(r = (val->value.cb)(val->cb_data, cb_name));
+        _cb_name_free(cb_name, name, namebuff);
+        if (r != NULL) {
+            *value_len = strlen(r);
+        }
+        return r;
+    default:
+        fprintf(stderr, "Unknown value type\n");
+        return NULL;
+    }
+}
+
+
+/**
+ * @brief Internal function to get the text of a write callback value, written into tmpbuff
+ * 
+ * If the text doesn't fit in tmpbuff the callback is called again with an allocated
+ * buffer of the size it asked for.
+ * 
+ * @param[out] alloced  Set to the allocated buffer if one was needed, to free() after
+ * @return Returns the text, and its length in value_len, or NULL if there is no value.
+ */
+static const char *_wcb_format(const fstr_value *val, const char *name, size_t name_len, 
+        char *tmpbuff, size_t tmpbuff_len, size_t *value_len, char **alloced)
+{
+    char *cb_name, namebuff[128], *text = tmpbuff;
+    int r;
+
+    *alloced = NULL;
+    cb_name = _cb_name(name, name_len, namebuff, sizeof(namebuff));
+    if (cb_name == NULL) {
+        return NULL;
+    }
+    STAT_CALLBACK(r = (val->value.wcb)(val->cb_data, cb_name, tmpbuff, tmpbuff_len));
+    if (r >= 0 && (size_t)r >= tmpbuff_len) {
+        text = *alloced = malloc((size_t)r + 1);
+        if (text == NULL) {
+            r = -1;
+        } else {
+            STAT_ADD(allocs, 1);
+            STAT_ADD(resizes, 1);
+            STAT_CALLBACK(r = (val->value.wcb)(val->cb_data, cb_name, text, (size_t)r + 1) != r ? -1 : r);
+        }
+    }
+    _cb_name_free(cb_name, name, namebuff);
+    if (r < 0) {
+        free(*alloced);
+        *alloced = NULL;
+        return NULL;
+    }
+    *value_len = r;
+    return text;
+}
+
+
+/**
+ * @brief Internal debug function, prints the contents of a value list
+ * 
+ */
+void _debug_dump_values(fstr_value *values[])
+{
+    int i;
+    char tmpbuff[128];
+    const char *str;
+    fstr_value *val;
+    printf("Dumping values list\n");
+    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        val = values[i];
+        switch(val->type) {
+            case fstr_vt_str: 
+                str = val->value.s; 
+                break;
+            case fstr_vt_int:
+                //ntoa is not standard
+                snprintf(tmpbuff, sizeof(tmpbuff), "%d", val->value.i);
+                str = tmpbuff;
+                break;
+            case fstr_vt_cb:
+                str = (val->value.cb)(val->cb_data, val->name);
+                break;
+            case fstr_vt_table:
+                snprintf(tmpbuff, sizeof(tmpbuff), "table of %lu values", (unsigned long)val->value.t->count);
+                str = tmpbuff;
+                break;
+            case fstr_vt_wcb:
+                str = "(write callback)";
+                break;
+            case fstr_vt_strn:
+                snprintf(tmpbuff, sizeof(tmpbuff), "%.*s", (int)val->value.sn.len, val->value.sn.s);
+                str = tmpbuff;
+                break;
+            default:
+                snprintf(tmpbuff, sizeof(tmpbuff), "INVALID TYPE %d", val->type);
+                str = tmpbuff;
+        }
+        printf("#%d: %s type %d: val: %s\n", i, val->name, val->type, str);
+    }
+    printf("End of list\n");
+}
+
+
+/**
+ * @brief Internal function to gather varargs values into a list.
+ * 
+ * The list is built in stack (which must have room for VA_LIST_LEN entries), and only if
+ * there are more values than that is it moved to memory from the allocator. Release it
+ * with _va_list_free(). first is the first value, so the list ends there if it's NULL (for
+ * a va_list on its own, pass va_arg(vl, fstr_value *)).
+ * 
+ * @return The list, or NULL if out of memory.
+ */
+fstr_value **_va_to_list(fstr_value **stack, const fstr_allocator *allocator, fstr_value *first, va_list vl)
+{
+    int list_size = VA_LIST_LEN - 1, l_count = 0;
+    fstr_value *val;
+    fstr_value **list = stack, **bigger;
+
+    list[l_count++] = first;
+    for(val = first; val != NULL; l_count++) {
+        if (l_count == list_size) {
+            bigger = allocator->alloc(allocator->data, sizeof(fstr_value *) * (list_size * 2 + 1));
+            if (bigger == NULL) {
+                _va_list_free(stack, allocator, list);
+                return NULL;
+            }
+            STAT_ADD(allocs, 1);
+            memcpy(bigger, list, sizeof(fstr_value *) * list_size);
+            _va_list_free(stack, allocator, list);
+            list = bigger;
+            list_size *= 2;
+        }
+        val = va_arg(vl, fstr_value *);
+        list[l_count] = val;
+    }
+    //_debug_dump_values(list);
+    return list;
+}
+
+
+/*
+ * Resolved output.
+ *
+ * To size the output exactly without calling the callbacks twice, the format is first
+ * resolved into a list of pieces. Literal text and string values are stable for the
+ * duration of the call so the pieces just point at them, anything else (formatted
+ * numbers and callback results) is copied into a scratch area. Small outputs fit in the
+ * space on the stack, larger ones spill over to the heap.
+ */
+#define RESOLVED_PIECES     32
+#define RESOLVED_SCRATCH    512
+
+typedef struct {
+    const char *text;       /* NULL if the text is in the scratch area */
+    size_t offset;          /* Where the text is in the scratch area */
+    size_t len;
+} fstr_piece;
+
+typedef struct {
+    fstr_piece *pieces;
+    size_t npieces, max_pieces;
+    char *scratch;
+    size_t scratch_used, scratch_len;
+    size_t total;           /* Length of the output, excluding the \0 */
+    int error;
+    fstr_piece stack_pieces[RESOLVED_PIECES];
+    char stack_scratch[RESOLVED_SCRATCH];
+} fstr_resolved;
+
+
+static void _resolved_init(fstr_resolved *res)
+{
+    res->pieces = res->stack_pieces;
+    res->npieces = 0;
+    res->max_pieces = RESOLVED_PIECES;
+    res->scratch = res->stack_scratch;
+    res->scratch_used = 0;
+    res->scratch_len = RESOLVED_SCRATCH;
+    res->total = 0;
+    res->error = 0;
+}
+
+
+static void _resolved_free(fstr_resolved *res)
+{
+    if (res->pieces != res->stack_pieces) free(res->pieces);
+    if (res->scratch != res->stack_scratch) free(res->scratch);
+}
+
+
+/**
+ * @brief Internal function to grow one of the resolved arrays, moving it off the stack if need be
+ */
+static void *_resolved_grow(void *ptr, void *stack_ptr, size_t new_size, size_t old_size)
+{
+    void *r;
+
+    STAT_ADD(resizes, 1);
+    STAT_ADD(allocs, 1);
+    if (ptr != stack_ptr) {
+        return realloc(ptr, new_size);
+    }
+    r = malloc(new_size);
+    if (r != NULL) {
+        memcpy(r, ptr, old_size);
+    }
+    return r;
+}
+
+
+/**
+ * @brief Internal function to add some text to the output. If copy is set, the text is copied.
+ */
+static void _resolved_add(fstr_resolved *res, const char *text, size_t len, int copy)
+{
+    fstr_piece *piece;
+    void *p;
+
+    if (len == 0 || res->error) {
+        return;
+    }
+    if (res->npieces == res->max_pieces) {
+        p = _resolved_grow(res->pieces, res->stack_pieces, sizeof(fstr_piece) * res->max_pieces * 2,
+                sizeof(fstr_piece) * res->max_pieces);
+        if (p == NULL) {
+            res->error = 1;
+            return;
+        }
+        res->pieces = p;
+        res->max_pieces *= 2;
+    }
+    piece = &res->pieces[res->npieces++];
+    piece->text = text;
+    piece->len = len;
+    if (copy) {
+        if (res->scratch_used + len > res->scratch_len) {
+            size_t new_len = res->scratch_len * 2;
+
+            while(new_len < res->scratch_used + len) {
+                new_len *= 2;
+            }
+            p = _resolved_grow(res->scratch, res->stack_scratch, new_len, res->scratch_used);
+            if (p == NULL) {
+                res->error = 1;
+                return;
+            }
+            res->scratch = p;
+            res->scratch_len = new_len;
+        }
+        memcpy(res->scratch + res->scratch_used, text, len);
+        piece->text = NULL;
+        piece->offset = res->scratch_used;
+        res->scratch_used += len;
+    }
+    res->total += len;
+}
+
+
+/*
+ * Brace scanning.
+ *
+ * Formats are mostly literal text, so most of the time goes in finding the next '{'. The
+ * SSE2 and AVX2 versions check 16 or 32 bytes at a time. Their loads are aligned, so they
+ * never touch a page past the end of the string (bytes before the start are masked off),
+ * which also means they read past the \0 and so are hidden from the address and thread
+ * sanitizers.
+ * The best one the CPU supports is picked when the library is loaded.
+ */
+typedef const char *(*fstr_scan_t)(const char *s);
+
+
+/**
+ * @brief Internal function to find the next '{', or the \0 at the end of the string.
+ */
+static const char *_scan_scalar(const char *s)
+{
+    while(*s != 0 && *s != '{') {
+        s++;
+    }
+    return s;
+}
+
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SCAN_SIMD
+
+__attribute__((no_sanitize("address", "thread")))
+static const char *_scan_sse2(const char *s)
+{
+    const __m128i brace = _mm_set1_epi8('{'), zero = _mm_setzero_si128();
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+    __m128i v = _mm_load_si128((const __m128i *)p);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, brace), _mm_cmpeq_epi8(v, zero)));
+
+    mask &= ~0u << (s - p);
+    while(mask == 0) {
+        p += 16;
+        v = _mm_load_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, brace), _mm_cmpeq_epi8(v, zero)));
+    }
+    return p + __builtin_ctz(mask);
+}
+
+
+__attribute__((no_sanitize("address", "thread"), target("avx2")))
+static const char *_scan_avx2(const char *s)
+{
+    const __m256i brace = _mm256_set1_epi8('{'), zero = _mm256_setzero_si256();
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)31);
+    __m256i v = _mm256_load_si256((const __m256i *)p);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, brace), _mm256_cmpeq_epi8(v, zero)));
+
+    mask &= ~0u << (s - p);
+    while(mask == 0) {
+        p += 32;
+        v = _mm256_load_si256((const __m256i *)p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, brace), _mm256_cmpeq_epi8(v, zero)));
+    }
+    return p + __builtin_ctz(mask);
+}
+
+static fstr_scan_t _find_brace = _scan_sse2;
+static int _scan_mode = FSTR_SCAN_SSE2;
+#else
+static fstr_scan_t _find_brace = _scan_scalar;
+static int _scan_mode = FSTR_SCAN_SCALAR;
+#endif
+
+
+int fstr_scan_mode(int mode)
+{
+#ifdef HAVE_SCAN_SIMD
+    if (mode == FSTR_SCAN_AUTO || mode == FSTR_SCAN_AVX2) {
+        __builtin_cpu_init();
+        mode = __builtin_cpu_supports("avx2") ? FSTR_SCAN_AVX2 : FSTR_SCAN_SSE2;
+    }
+    _find_brace = mode == FSTR_SCAN_AVX2 ? _scan_avx2 : (mode == FSTR_SCAN_SSE2 ? _scan_sse2 : _scan_scalar);
+    _scan_mode = mode == FSTR_SCAN_AVX2 || mode == FSTR_SCAN_SSE2 ? mode : FSTR_SCAN_SCALAR;
+#endif
+    return _scan_mode;
+}
+
+
+__attribute__((constructor))
+static void _scan_init(void)
+{
+    fstr_scan_mode(FSTR_SCAN_AUTO);
+}
+
+
+/*
+ * Rendering.
+ *
+ * Output goes to a fstr_out, which is either a buffer, a sink (through a small staging
+ * buffer that is flushed whenever it fills up), a caller's iovec array (with buffer as
+ * the scratch space for text that has to be copied) or (when res is set) a list of
+ * resolved pieces. When writing to a buffer and it runs out of room, the length keeps
+ * being counted so the size needed can be returned, unless it's a fstr_buf's buffer
+ * (grow is set), in which case it is made bigger.
+ */
+typedef struct {
+    char *buffer;
+    size_t buffer_len;
+    size_t pos;             /* Length of the output so far, which may be more than fits */
+    fstr_resolved *res;
+    fstr_sink *sink;        /* If set, buffer is the staging buffer for the sink */
+    size_t flushed;         /* Bytes already passed to the sink */
+    int error;              /* The sink failed, or the iovec array or scratch space is full */
+    struct iovec *iov;      /* If set, output goes to these, buffer is the scratch space */
+    int iov_len;
+    int iov_count;
+    fstr_buf *grow;         /* If set, buffer is the builder's, and pos starts at its length */
+} fstr_out;
+
+/* Size of the staging buffer used when writing to a sink */
+#define SINK_BUFFER_LEN     4096
+
+/* Smallest allocation for a fstr_buf */
+#define BUF_MIN_LEN         256
+
+
+/**
+ * @brief Internal function to make a builder's buffer at least size bytes, keeping the first used bytes
+ * 
+ * The size at least doubles each time, so appending is amortized linear.
+ * 
+ * @return 0, or -1 if out of memory.
+ */
+static int _buf_grow(fstr_buf *buf, size_t used, size_t size)
+{
+    const fstr_allocator *allocator = buf->allocator ? buf->allocator : &_malloc_allocator;
+    size_t new_size = buf->size ? buf->size : BUF_MIN_LEN;
+    char *data;
+
+    if (size <= buf->size) {
+        return 0;
+    }
+    while(new_size < size) {
+        if (new_size > SIZE_MAX / 2) {
+            return -1;
+        }
+        new_size *= 2;
+    }
+    data = allocator->alloc(allocator->data, new_size);
+    if (data == NULL) {
+        return -1;
+    }
+    STAT_ADD(allocs, 1);
+    if (buf->data != NULL) {
+        STAT_ADD(resizes, 1);
+        memcpy(data, buf->data, used);
+        allocator->free(allocator->data, buf->data);
+    }
+    buf->data = data;
+    buf->size = new_size;
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to grow a builder's buffer so that len more characters (and a \0) fit
+ * 
+ * @return 0, or -1 if out of memory, which is remembered in out->error.
+ */
+static int _out_grow(fstr_out *out, size_t len)
+{
+    if (out->error || out->pos + len < out->pos || _buf_grow(out->grow, out->pos, out->pos + len + 1) < 0) {
+        out->error = 1;
+        return -1;
+    }
+    out->buffer = out->grow->data;
+    out->buffer_len = out->grow->size;
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to pass text to the sink, remembering if it fails
+ */
+static void _sink_write(fstr_out *out, const char *text, size_t len)
+{
+    if (len > 0 && !out->error && out->sink->write(out->sink->data, text, len) < 0) {
+        out->error = 1;
+    }
+    out->flushed += len;
+}
+
+
+/**
+ * @brief Internal function to empty the staging buffer into the sink
+ */
+static void _out_flush(fstr_out *out)
+{
+    _sink_write(out, out->buffer, out->pos);
+    out->pos = 0;
+}
+
+
+/**
+ * @brief Internal function to add an iovec entry, or extend the last one if the text follows on from it
+ */
+static void _iov_add(fstr_out *out, const char *text, size_t len, int copy)
+{
+    struct iovec *last;
+
+    if (len == 0 || out->error) {
+        return;
+    }
+    if (copy) {
+        if (out->pos + len > out->buffer_len) {
+            out->error = 1;
+            return;
+        }
+        memcpy(out->buffer + out->pos, text, len);
+        text = out->buffer + out->pos;
+        out->pos += len;
+    }
+    if (out->iov_count > 0) {
+        last = out->iov + out->iov_count - 1;
+        if ((const char *)last->iov_base + last->iov_len == text) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (out->iov_count < out->iov_len) {
+        out->iov[out->iov_count].iov_base = (void *)text;
+        out->iov[out->iov_count].iov_len = len;
+        out->iov_count++;
+    } else {
+        out->error = 1;
+    }
+}
+
+
+/**
+ * @brief Internal function to add some text to the output. If copy is set, the text is not stable.
+ */
+static inline void _out_write(fstr_out *out, const char *text, size_t len, int copy)
+{
+    if (out->res) {
+        _resolved_add(out->res, text, len, copy);
+    } else if (out->iov) {
+        _iov_add(out, text, len, copy);
+        return;
+    } else if (out->pos + len < out->buffer_len) {
+        memcpy(out->buffer + out->pos, text, len);
+    } else if (out->grow) {
+        if (_out_grow(out, len) < 0) {
+            return;
+        }
+        memcpy(out->buffer + out->pos, text, len);
+    } else if (out->sink) {
+        /* Text too big for the staging buffer skips it and goes straight to the sink */
+        _out_flush(out);
+        if (len < out->buffer_len) {
+            memcpy(out->buffer, text, len);
+        } else {
+            _sink_write(out, text, len);
+            return;
+        }
+    }
+    out->pos += len;
+}
+
+
+/**
+ * @brief Internal function to get somewhere to write len characters directly in the output buffer
+ * 
+ * @return Where to write, or NULL if there isn't room (or len is 0).
+ */
+static inline char *_out_space(fstr_out *out, size_t len)
+{
+    if (len == 0 || out->res || out->iov) {
+        return NULL;
+    }
+    if (out->pos + len >= out->buffer_len) {
+        if (out->grow) {
+            return _out_grow(out, len) == 0 ? out->buffer + out->pos : NULL;
+        }
+        if (!out->sink || len >= out->buffer_len) {
+            return NULL;
+        }
+        _out_flush(out);
+    }
+    return out->buffer + out->pos;
+}
+
+
+/**
+ * @brief Internal function to \0 terminate the output buffer
+ * 
+ * @return The length of the output, or the size needed as a negative number. See lbfstring.
+ */
+static int _out_finish(fstr_out *out)
+{
+    if (out->pos >= out->buffer_len) {
+        return 0 - out->pos - 1;
+    }
+    out->buffer[out->pos] = 0;
+    return out->pos;
+}
+
+
+/**
+ * @brief Internal function to flush whatever is left to the sink
+ * 
+ * @return The number of bytes written, or -1 if the sink failed.
+ */
+static ssize_t _out_finish_sink(fstr_out *out)
+{
+    _out_flush(out);
+    return out->error ? -1 : (ssize_t)out->flushed;
+}
+
+
+#ifdef FSTR_STATS
+/**
+ * @brief Internal function to get the length of the output so far, wherever it's going
+ */
+static size_t _out_total(const fstr_out *out)
+{
+    size_t total = 0;
+    int i;
+
+    if (out->res) {
+        return out->res->total;
+    }
+    if (out->iov) {
+        for(i = 0; i < out->iov_count; i++) {
+            total += out->iov[i].iov_len;
+        }
+        return total;
+    }
+    return out->flushed + out->pos;
+}
+
+/* Count a render (or N of them), from the output's length at the start to the end */
+#define STATS_BEGIN(OUT)        size_t _stats_len = _out_total(OUT); \
+                                uint64_t _stats_start = _stats_table || _stats_hook_fn ? _stats_now() : 0
+#define STATS_END(OUT, FORMAT, N)   _stats_render(FORMAT, N, _out_total(OUT) - _stats_len, _stats_start)
+#else
+#define STATS_BEGIN(OUT)
+#define STATS_END(OUT, FORMAT, N)
+#endif
+
+
+/**
+ * @brief Internal function to output the fill character n times
+ */
+static void _out_fill(fstr_out *out, const fstr_spec *spec, size_t n)
+{
+    char pad[64];
+    size_t i, chunk = sizeof(pad) / spec->fill_len, c;
+
+    for(i = 0; i < chunk && i < n; i++) {
+        memcpy(pad + i * spec->fill_len, spec->fill, spec->fill_len);
+    }
+    while(n > 0) {
+        c = n < chunk ? n : chunk;
+        _out_write(out, pad, c * spec->fill_len, 1);
+        n -= c;
+    }
+}
+
+
+/**
+ * @brief Internal function to output a value according to a format spec
+ * 
+ * @return 0, or -1 if the value couldn't be formatted.
+ */
+static int _render_spec(fstr_out *out, const fstr_value *val, const char *name, size_t name_len, const fstr_spec *spec)
+{
+    char body[SPEC_BUFFER_LEN], lead[4] = "", prefix[3] = "", tmpbuff[VALUE_BUFFER_LEN], *alloced = NULL;
+    const char *text = body;
+    size_t len, chars, pad, lead_len = 0, i;
+    int negative = 0, hex, copy = !_value_is_stable(val);
+    char align = spec->align;
+
+    if (val->type == fstr_vt_int || val->type == fstr_vt_long || val->type == fstr_vt_ulong || 
+            val->type == fstr_vt_float || val->type == fstr_vt_double) {
+        len = _fmt_spec_number(body, val, spec, &negative, prefix);
+        if (negative || spec->sign != '-') {
+            lead[lead_len++] = negative ? '-' : spec->sign;
+        }
+        for(i = 0; prefix[i]; i++) {
+            lead[lead_len++] = prefix[i];
+        }
+        if (align == 0) {
+            align = spec->zero ? '=' : '>';
+        }
+        if (spec->grouping) {
+            hex = spec->type == 'x' || spec->type == 'X';
+            len = _fmt_grouping(body, len, (hex || spec->type == 'b' || spec->type == 'o') ? 4 : 3, spec->grouping, hex,
+                    align == '=' && spec->fill[0] == '0' ? (int)(spec->width - lead_len) : 0);
+        }
+        chars = len + lead_len;
+    } else {
+        if (val->type == fstr_vt_wcb) {
+            text = _wcb_format(val, name, name_len, tmpbuff, sizeof(tmpbuff), &len, &alloced);
+        } else {
+            text = _value_format(val, name, name_len, tmpbuff, &len);
+        }
+        if (text == NULL) {
+            return -1;
+        }
+        if (spec->precision >= 0) {
+            /* Truncate to that many characters */
+            for(i = 0, chars = 0; i < len; i++) {
+                if ((text[i] & 0xC0) != 0x80 && chars++ == spec->precision) {
+                    break;
+                }
+            }
+            len = i;
+        }
+        chars = _utf8_chars(text, len);
+        if (align == 0 || align == '=') {
+            align = '<';
+        }
+    }
+    pad = spec->width > chars ? spec->width - chars : 0;
+    switch(align) {
+    case '<':
+        _out_write(out, lead, lead_len, 1);
+        _out_write(out, text, len, copy);
+        _out_fill(out, spec, pad);
+        break;
+    case '^':
+        _out_fill(out, spec, pad / 2);
+        _out_write(out, lead, lead_len, 1);
+        _out_write(out, text, len, copy);
+        _out_fill(out, spec, pad - pad / 2);
+        break;
+    case '=':
+        _out_write(out, lead, lead_len, 1);
+        _out_fill(out, spec, pad);
+        _out_write(out, text, len, copy);
+        break;
+    default:
+        _out_fill(out, spec, pad);
+        _out_write(out, lead, lead_len, 1);
+        _out_write(out, text, len, copy);
+    }
+    free(alloced);
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to output a write callback value without a format spec
+ * 
+ * The callback writes straight into whatever room is left in the output buffer, the
+ * sink's staging buffer or the iovec scratch space. If it needs more room than that,
+ * in a buffer the length is just counted, for a sink the staging buffer is flushed (or
+ * a builder's buffer is grown) and it's tried again, and otherwise it's written to a
+ * temporary buffer and copied.
+ * 
+ * @return 0, or -1 if there is no value.
+ */
+static int _render_wcb(fstr_out *out, const fstr_value *val, const char *name, size_t name_len)
+{
+    char *cb_name, namebuff[128], tmpbuff[VALUE_BUFFER_LEN], *alloced, *space = NULL;
+    const char *text;
+    size_t len, avail = 0;
+    int r = -1;
+
+    if (out->res == NULL) {
+        cb_name = _cb_name(name, name_len, namebuff, sizeof(namebuff));
+        if (cb_name == NULL) {
+            return -1;
+        }
+        if (out->pos < out->buffer_len) {
+            space = out->buffer + out->pos;
+            avail = out->buffer_len - out->pos;
+        }
+        STAT_CALLBACK(r = (val->value.wcb)(val->cb_data, cb_name, space, avail));
+        if (r >= 0 && (size_t)r >= avail && (out->grow ? _out_grow(out, r) == 0 : out->sink && (size_t)r < out->buffer_len)) {
+            if (out->sink) {
+                _out_flush(out);
+            }
+            space = out->buffer + out->pos;
+            avail = out->buffer_len - out->pos;
+            STAT_ADD(resizes, 1);
+            STAT_CALLBACK(r = (val->value.wcb)(val->cb_data, cb_name, space, avail));
+        }
+        _cb_name_free(cb_name, name, namebuff);
+        if (r < 0) {
+            return -1;
+        }
+        if ((size_t)r < avail || (!out->sink && !out->iov && !out->grow)) {
+            if (out->iov && r > 0) {
+                _iov_add(out, space, r, 0);
+            }
+            out->pos += r;
+            return 0;
+        }
+    }
+    text = _wcb_format(val, name, name_len, tmpbuff, sizeof(tmpbuff), &len, &alloced);
+    if (text == NULL) {
+        return -1;
+    }
+    _out_write(out, text, len, 1);
+    free(alloced);
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to output a value that has been looked up
+ * 
+ * @param[in] val       The value, or NULL if there is no such value
+ * @param[in] spec      The format spec, or NULL if there isn't one
+ * @param[in] missing   The text to use if there is no such value (ie the "{name}")
+ */
+static void _render_found(fstr_out *out, const fstr_value *val, const char *name, size_t name_len, 
+        const fstr_spec *spec, const char *missing, size_t missing_len)
+{
+    const char *text = NULL;
+    char tmpbuff[VALUE_BUFFER_LEN], *space = NULL;
+    size_t len;
+
+#ifdef FSTR_STATS
+    if (val != NULL) {
+        STAT_ADD(hits, 1);
+        if (val->name != NULL && val->name[0] == '*' && val->name[1] == 0) {
+            STAT_ADD(wildcards, 1);
+        }
+    }
+#endif
+    if (val != NULL && spec != NULL) {
+        if (_render_spec(out, val, name, name_len, spec) == 0) {
+            return;
+        }
+    } else if (val != NULL && val->type == fstr_vt_wcb) {
+        if (_render_wcb(out, val, name, name_len) == 0) {
+            return;
+        }
+    } else if (val != NULL) {
+        /* Numbers are formatted straight into the output when there's room */
+        space = _out_space(out, _value_max_len(val));
+        text = _value_format(val, name, name_len, space ? space : tmpbuff, &len);
+    }
+    if (text == NULL) {
+        STAT_ADD(misses, 1);
+        _out_write(out, missing, missing_len, 0);
+    } else if (text == space) {
+        out->pos += len;
+    } else {
+        _out_write(out, text, len, !_value_is_stable(val));
+    }
+}
+
+
+/**
+ * @brief Internal function to look up and output the value of a placeholder
+ * 
+ * @param[in] spec      The format spec, or NULL if there isn't one
+ * @param[in] missing   The text to use if there is no such value (ie the "{name}")
+ */
+static inline void _render_value(fstr_out *out, const char *name, size_t name_len, uint32_t hash, 
+        const fstr_spec *spec, const char *missing, size_t missing_len, fstr_value *values[])
+{
+    _render_found(out, _value_find(name, name_len, hash, values), name, name_len, spec, missing, missing_len);
+}
+
+
+/* The template cache, see the Template cache section */
+static struct fstr_cache *_cache;
+static int _cache_render(fstr_out *out, const char *format, fstr_value *values[]);
+
+
+/**
+ * @brief Internal function to render a format string without a template
+ * 
+ * This is a single pass over the format: each run of literal text is copied as a whole,
+ * and placeholder names are looked up straight from the format, so the cost is linear in
+ * the size of the format plus the size of the output.
+ * 
+ * @return 0 on success, -1 if there is an unterminated curly brace.
+ */
+static int _render_text(fstr_out *out, const char *format, fstr_value *values[])
+{
+    const char *sp = format, *start = format, *end;
+    fstr_spec spec;
+    size_t name_len;
+    int has_spec, hashed = _values_hashed(values);
+
+    while(*(sp = _find_brace(sp)) != 0) {
+        if (sp[1] == '{') {
+            // If it's a curly brace follow by another curlly brace, it's considered
+            // escaping, so "blah {{ blah" becomes "blah { blah"
+            _out_write(out, start, sp + 1 - start, 0);
+            sp += 2;
+            start = sp;
+            continue;
+        }
+        _out_write(out, start, sp - start, 0);
+        end = strchr(sp + 1, '}');
+        if (end == NULL) {
+            return -1;
+        }
+        name_len = _split_spec(sp + 1, end - sp - 1, &spec, &has_spec);
+        _render_value(out, sp + 1, name_len, hashed ? _name_hash(sp + 1, name_len) : 0, has_spec ? &spec : NULL, 
+                sp, end + 1 - sp, values);
+        sp = start = end + 1;
+    }
+    _out_write(out, start, sp - start, 0);
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to render a format string, or its template if the template cache is on
+ * 
+ * @return 0 on success, -1 if there is an unterminated curly brace.
+ */
+static int _render_format(fstr_out *out, const char *format, fstr_value *values[])
+{
+    int r = 0;
+    STATS_BEGIN(out);
+
+    if (_cache == NULL || _cache_render(out, format, values) < 0) {
+        r = _render_text(out, format, values);
+    }
+    STATS_END(out, format, 1);
+    return r;
+}
+
+
+/**
+ * @brief Internal function to copy the resolved output into a newly allocated string
+ */
+static char *_resolved_alloc(fstr_resolved *res, const fstr_allocator *allocator)
+{
+    char *buffer, *dp;
+    size_t i;
+
+    buffer = dp = allocator->alloc(allocator->data, res->total + 1);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocs, 1);
+    for(i = 0; i < res->npieces; i++) {
+        memcpy(dp, res->pieces[i].text ? res->pieces[i].text : res->scratch + res->pieces[i].offset, 
+                res->pieces[i].len);
+        dp += res->pieces[i].len;
+    }
+    *dp = 0;
+    return buffer;
+}
+
+
+char *fstring(const char *format, fstr_value *first, ...)
+{
+    char *r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, &_allocator, first, vl);    
+    va_end(vl);
+    r = list ? lafstring(&_allocator, format, list) : NULL;
+    _va_list_free(stack, &_allocator, list);
+    return r;
+}
+
+
+char *vfstring(const char *format, va_list vl)
+{
+    return vafstring(&_allocator, format, vl);
+}
+
+
+char *lfstring(const char *format, fstr_value **list)
+{
+    return lafstring(&_allocator, format, list);
+}
+
+
+char *afstring(const fstr_allocator *allocator, const char *format, fstr_value *first, ...)
+{
+    char *r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, allocator, first, vl);    
+    va_end(vl);
+    r = list ? lafstring(allocator, format, list) : NULL;
+    _va_list_free(stack, allocator, list);
+    return r;
+}
+
+
+char *vafstring(const fstr_allocator *allocator, const char *format, va_list vl)
+{
+    fstr_value *stack[VA_LIST_LEN], **list = _va_to_list(stack, allocator, va_arg(vl, fstr_value *), vl);    
+    char *r = list ? lafstring(allocator, format, list) : NULL;
+    _va_list_free(stack, allocator, list);
+    return r;
+}
+
+
+char *lafstring(const fstr_allocator *allocator, const char *format, fstr_value **list)
+{
+    fstr_resolved res;
+    fstr_out out = { .res = &res };
+    char *buffer = NULL;
+
+    _resolved_init(&res);
+    if (_render_format(&out, format, list) == 0 && !res.error) {
+        buffer = _resolved_alloc(&res, allocator);
+    }
+    _resolved_free(&res);
+    return buffer;
+}
+
+
+int fstr_measure(const char *format, fstr_value *values[])
+{
+    fstr_out out = { .buffer = NULL };
+
+    if (_render_format(&out, format, values) < 0) {
+        return -1;
+    }
+    return out.pos;
+}
+
+
+int fstr_format_value(char *buffer, size_t buffer_len, const fstr_value *value, const char *spec, size_t spec_len)
+{
+    fstr_out out = { .buffer = buffer, .buffer_len = buffer_len };
+    const char *name = value->name ? value->name : "";
+    fstr_spec parsed;
+
+    if (spec_len > 0 && _parse_spec(spec, spec_len, &parsed) < 0) {
+        return -1;
+    }
+    _render_found(&out, value, name, strlen(name), spec_len > 0 ? &parsed : NULL, "", 0);
+    _out_finish(&out);
+    return out.pos;
+}
+
+
+int bfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *first, ...)
+{
+    /* What's with the "first" arg? It's just to ensure that people don't call
+     * bfstring(buff, l, "blah", fstr_list )
+     * when the should have called
+     * lbfstring(buff, l, "blah", fstr_list )
+     */
+    int r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);    
+    va_end(vl);
+    r = lbfstring(buffer, buffer_len, format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+int vbfstring(char *buffer, size_t buffer_len, const char *format, va_list vl)
+{
+    int r;
+    fstr_value *stack[VA_LIST_LEN], **list = _va_to_list(stack, &_malloc_allocator, va_arg(vl, fstr_value *), vl);    
+    r = lbfstring(buffer, buffer_len, format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+int lbfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *values[])
+{
+    fstr_out out = { .buffer = buffer, .buffer_len = buffer_len };
+
+    if (_render_format(&out, format, values) < 0) {
+        return -1;
+    }
+    return _out_finish(&out);
+}
+
+
+int lifstring(struct iovec *iov, int iov_len, char *scratch, size_t scratch_len, const char *format, fstr_value *values[])
+{
+    fstr_out out = { .buffer = scratch, .buffer_len = scratch_len, .iov = iov, .iov_len = iov_len };
+
+    if (_render_format(&out, format, values) < 0) {
+        return -1;
+    }
+    return out.error ? -2 : out.iov_count;
+}
+
+
+/*
+ * Sinks.
+ */
+int fstr_sink_file_write(void *data, const char *buffer, size_t len)
+{
+    return fwrite(buffer, 1, len, (FILE *)data) == len ? 0 : -1;
+}
+
+
+int fstr_sink_fd_write(void *data, const char *buffer, size_t len)
+{
+    int fd = (int)(intptr_t)data;
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, buffer, len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += r;
+        len -= r;
+    }
+    return 0;
+}
+
+
+ssize_t lsfstring(fstr_sink *sink, const char *format, fstr_value *values[])
+{
+    char staging[SINK_BUFFER_LEN];
+    fstr_out out = { .buffer = staging, .buffer_len = sizeof(staging), .sink = sink };
+
+    if (_render_format(&out, format, values) < 0) {
+        /* Whatever was rendered before the error is still written */
+        _out_finish_sink(&out);
+        return -1;
+    }
+    return _out_finish_sink(&out);
+}
+
+
+ssize_t sfstring(fstr_sink *sink, const char *format, fstr_value *first, ...)
+{
+    ssize_t r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);
+    va_end(vl);
+    r = lsfstring(sink, format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+ssize_t vsfstring(fstr_sink *sink, const char *format, va_list vl)
+{
+    ssize_t r;
+    fstr_value *stack[VA_LIST_LEN], **list = _va_to_list(stack, &_malloc_allocator, va_arg(vl, fstr_value *), vl);
+    r = lsfstring(sink, format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+ssize_t ffstring(FILE *file, const char *format, fstr_value *first, ...)
+{
+    ssize_t r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);
+    va_end(vl);
+    r = lsfstring(fstr_file_sink(file), format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+ssize_t dfstring(int fd, const char *format, fstr_value *first, ...)
+{
+    ssize_t r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);
+    va_end(vl);
+    r = lsfstring(fstr_fd_sink(fd), format, list);
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+/*
+ * Compiled templates.
+ *
+ * A template is a single allocation laid out as:
+ *    struct fstr_template | segments[] | copy of the format | placeholder names
+ * Literal segments point into the copy of the format, placeholder segments point
+ * at the whole "{name}" in the copy (so it can be output when the lookup fails) and
+ * at a \0 terminated copy of the name. A template compiled from a file has no copy, its
+ * segments point into the file's mapping instead.
+ */
+typedef struct {
+    const char *text;       /* Literal text, or "{name}" for a placeholder */
+    size_t text_len;
+    const char *name;       /* NULL for literal text */
+    size_t name_len;
+    uint32_t name_hash;
+    int has_spec;
+    fstr_spec spec;
+} fstr_segment;
+
+struct fstr_template {
+    const char *format;     /* The format, or the template's copy of it */
+    size_t mapped;          /* If the format is a file mapped by fstr_compile_file(), the length of the mapping */
+    size_t nsegments;
+    fstr_segment *segments;
+};
+
+
+/**
+ * @brief Internal function that walks a format string, splitting it into segments.
+ * 
+ * If segments is NULL it just counts the segments and the space needed for the names.
+ * 
+ * @return The number of segments, or -1 for an unterminated curly brace.
+ */
+static long _parse_segments(const char *format, fstr_segment *segments, char *names, size_t *names_len)
+{
+    const char *sp = format, *start = format, *end;
+    long count = 0;
+    size_t nlen = 0, name_len;
+    fstr_spec spec;
+    int has_spec;
+
+    while(*(sp = _find_brace(sp)) != 0) {
+        /* Flush any literal text up to the brace. For "{{" the first brace is kept
+           as part of the literal and the second one skipped. */
+        if (sp[1] == '{') {
+            if (segments) {
+                segments[count].text = start;
+                segments[count].text_len = sp + 1 - start;
+                segments[count].name = NULL;
+            }
+            count++;
+            sp += 2;
+            start = sp;
+            continue;
+        }
+        if (sp != start) {
+            if (segments) {
+                segments[count].text = start;
+                segments[count].text_len = sp - start;
+                segments[count].name = NULL;
+            }
+            count++;
+        }
+        end = strchr(sp, '}');
+        if (end == NULL) {
+            return -1;
+        }
+        name_len = _split_spec(sp + 1, end - sp - 1, &spec, &has_spec);
+        if (segments) {
+            segments[count].text = sp;
+            segments[count].text_len = end + 1 - sp;
+            segments[count].name = names + nlen;
+            segments[count].name_len = name_len;
+            segments[count].name_hash = _name_hash(sp + 1, name_len);
+            segments[count].has_spec = has_spec;
+            segments[count].spec = spec;
+            memcpy(names + nlen, sp + 1, name_len);
+            names[nlen + name_len] = 0;
+        }
+        nlen += name_len + 1;
+        count++;
+        sp = end + 1;
+        start = sp;
+    }
+    if (sp != start) {
+        if (segments) {
+            segments[count].text = start;
+            segments[count].text_len = sp - start;
+            segments[count].name = NULL;
+        }
+        count++;
+    }
+    if (names_len) *names_len = nlen;
+    return count;
+}
+
+
+/**
+ * @brief Internal function to compile a format. 
+ * 
+ * If copy is not set the format is not copied, and the literal text of the template points
+ * into it, so the format must not change (or go away) while the template is in use.
+ */
+static fstr_template *_compile(const char *format, int copy)
+{
+    fstr_template *tpl;
+    long count;
+    size_t format_len = 0, names_len;
+    char *text;
+
+    count = _parse_segments(format, NULL, NULL, &names_len);
+    if (count < 0) {
+        return NULL;
+    }
+    if (copy) {
+        format_len = strlen(format) + 1;
+    }
+    tpl = malloc(sizeof(fstr_template) + sizeof(fstr_segment) * count + format_len + names_len);
+    if (tpl == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocs, 1);
+    tpl->mapped = 0;
+    tpl->nsegments = count;
+    tpl->segments = (fstr_segment *)(tpl + 1);
+    text = (char *)(tpl->segments + count);
+    if (copy) {
+        memcpy(text, format, format_len);
+        format = text;
+    }
+    tpl->format = format;
+    _parse_segments(format, tpl->segments, text + format_len, NULL);
+    return tpl;
+}
+
+
+fstr_template *fstr_compile(const char *format)
+{
+    return _compile(format, 1);
+}
+
+
+/**
+ * @brief Internal function to map a file, so that it's followed by at least one \0
+ *
+ * The mapping is an extra page longer than the file. The part of the last page of the file
+ * that is past the end is zero filled anyway, but when the file is a whole number of pages
+ * the extra page (which is anonymous, so reading it is fine) is where the \0 comes from.
+ *
+ * @return The mapping, or NULL.
+ */
+static char *_map_file(int fd, size_t size, size_t *mapped)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *map;
+
+    *mapped = (size / page + 1) * page;
+    map = mmap(NULL, *mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (size > 0 && mmap(map, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(map, *mapped);
+        return NULL;
+    }
+    return map;
+}
+
+
+fstr_template *fstr_compile_file(const char *path)
+{
+    fstr_template *tpl = NULL;
+    struct stat st;
+    size_t mapped;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && (uintmax_t)st.st_size < SIZE_MAX / 2 && 
+            (map = _map_file(fd, st.st_size, &mapped)) != NULL) {
+        tpl = _compile(map, 0);
+        if (tpl == NULL) {
+            munmap(map, mapped);
+        } else {
+            tpl->mapped = mapped;
+        }
+    }
+    close(fd);
+    return tpl;
+}
+
+
+void fstr_template_free(fstr_template *tpl)
+{
+    if (tpl != NULL && tpl->mapped > 0) {
+        munmap((void *)tpl->format, tpl->mapped);
+    }
+    free(tpl);
+}
+
+
+/**
+ * @brief Internal function to output the segments of a compiled template
+ */
+static void _render_segments(fstr_out *out, const fstr_template *tpl, fstr_value *values[])
+{
+    const fstr_segment *seg, *end = tpl->segments + tpl->nsegments;
+
+    for(seg = tpl->segments; seg < end; seg++) {
+        if (seg->name == NULL) {
+            _out_write(out, seg->text, seg->text_len, 0);
+        } else {
+            _render_value(out, seg->name, seg->name_len, seg->name_hash, seg->has_spec ? &seg->spec : NULL, 
+                    seg->text, seg->text_len, values);
+        }
+    }
+}
+
+
+/**
+ * @brief Internal function to render a compiled template
+ */
+static void _render_template(fstr_out *out, const fstr_template *tpl, fstr_value *values[])
+{
+    STATS_BEGIN(out);
+
+    _render_segments(out, tpl, values);
+    STATS_END(out, tpl->format, 1);
+}
+
+
+/*
+ * Batches.
+ *
+ * Each placeholder is bound once, to a column of the rows or to one of the shared values,
+ * and then every row is rendered with no lookups at all.
+ */
+typedef struct {
+    long column;                /* The column holding the value, or -1 to use value */
+    const fstr_value *value;    /* The value to use for every row, or NULL if there isn't one */
+} fstr_binding;
+
+/* Templates with up to this many segments bind on the stack */
+#define BATCH_BINDINGS      64
+
+
+/**
+ * @brief Internal function to render count rows of a batch from row first, recording where each one starts
+ * 
+ * @return 0, or -1 if out of memory.
+ */
+static int _render_batch(fstr_out *out, size_t *offsets, const fstr_template *tpl, const fstr_batch *batch, 
+        fstr_value *values[], size_t first, size_t count)
+{
+    fstr_binding stack_bindings[BATCH_BINDINGS], *bindings = stack_bindings, *b;
+    const fstr_segment *seg, *end = tpl->segments + tpl->nsegments;
+    const fstr_value *val;
+    size_t row, col, row_stride, col_stride;
+    STATS_BEGIN(out);
+
+    if (tpl->nsegments > BATCH_BINDINGS) {
+        bindings = malloc(sizeof(fstr_binding) * tpl->nsegments);
+        if (bindings == NULL) {
+            return -1;
+        }
+        STAT_ADD(allocs, 1);
+    }
+    row_stride = batch->column_major ? 1 : batch->columns;
+    col_stride = batch->column_major ? batch->rows : 1;
+
+    /* The first row gives the names (and order) of the columns */
+    for(seg = tpl->segments, b = bindings; seg < end; seg++, b++) {
+        if (seg->name == NULL) {
+            continue;
+        }
+        b->column = -1;
+        b->value = NULL;
+        for(col = 0; col < batch->columns && batch->rows > 0; col++) {
+            val = batch->values + col * col_stride;
+            if (val->type == fstr_vt_table) {
+                if ((b->value = _table_lookup(val->value.t, seg->name, seg->name_len, seg->name_hash)) != NULL) {
+                    break;
+                }
+            } else if (_name_equal(val->name, seg->name, seg->name_len) || (val->name[0] == '*' && val->name[1] == 0)) {
+                b->column = col;
+                break;
+            }
+        }
+        if (b->column < 0 && b->value == NULL) {
+            b->value = _value_find(seg->name, seg->name_len, seg->name_hash, values);
+        }
+    }
+
+    for(row = first; row < first + count; row++) {
+        if (offsets) {
+            offsets[row] = out->flushed + out->pos;
+        }
+        for(seg = tpl->segments, b = bindings; seg < end; seg++, b++) {
+            if (seg->name == NULL) {
+                _out_write(out, seg->text, seg->text_len, 0);
+                continue;
+            }
+            val = b->column < 0 ? b->value : batch->values + row * row_stride + b->column * col_stride;
+            _render_found(out, val, seg->name, seg->name_len, seg->has_spec ? &seg->spec : NULL, seg->text, seg->text_len);
+        }
+    }
+    if (bindings != stack_bindings) {
+        free(bindings);
+    }
+    STATS_END(out, tpl->format, count);
+    return 0;
+}
+
+
+int fstr_render_batch(char *buffer, size_t buffer_len, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[])
+{
+    fstr_out out = { .buffer = buffer, .buffer_len = buffer_len };
+
+    if (_render_batch(&out, offsets, tpl, batch, values, 0, batch->rows) < 0) {
+        return -1;
+    }
+    if (offsets) {
+        offsets[batch->rows] = out.pos;
+    }
+    return _out_finish(&out);
+}
+
+
+ssize_t fstr_render_batch_sink(fstr_sink *sink, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[])
+{
+    char staging[SINK_BUFFER_LEN];
+    fstr_out out = { .buffer = staging, .buffer_len = sizeof(staging), .sink = sink };
+
+    if (_render_batch(&out, offsets, tpl, batch, values, 0, batch->rows) < 0) {
+        _out_finish_sink(&out);
+        return -1;
+    }
+    if (offsets) {
+        offsets[batch->rows] = out.flushed + out.pos;
+    }
+    return _out_finish_sink(&out);
+}
+
+
+int fstr_render(char *buffer, size_t buffer_len, const fstr_template *tpl, fstr_value *values[])
+{
+    fstr_out out = { .buffer = buffer, .buffer_len = buffer_len };
+
+    _render_template(&out, tpl, values);
+    return _out_finish(&out);
+}
+
+
+char *fstr_render_alloc(const fstr_template *tpl, fstr_value *values[])
+{
+    return fstr_render_alloc_with(&_allocator, tpl, values);
+}
+
+
+char *fstr_render_alloc_with(const fstr_allocator *allocator, const fstr_template *tpl, fstr_value *values[])
+{
+    fstr_resolved res;
+    fstr_out out = { .res = &res };
+    char *buffer = NULL;
+
+    _resolved_init(&res);
+    _render_template(&out, tpl, values);
+    if (!res.error) {
+        buffer = _resolved_alloc(&res, allocator);
+    }
+    _resolved_free(&res);
+    return buffer;
+}
+
+
+ssize_t fstr_render_sink(fstr_sink *sink, const fstr_template *tpl, fstr_value *values[])
+{
+    char staging[SINK_BUFFER_LEN];
+    fstr_out out = { .buffer = staging, .buffer_len = sizeof(staging), .sink = sink };
+
+    _render_template(&out, tpl, values);
+    return _out_finish_sink(&out);
+}
+
+
+int fstr_render_iov(struct iovec *iov, int iov_len, char *scratch, size_t scratch_len, const fstr_template *tpl, fstr_value *values[])
+{
+    fstr_out out = { .buffer = scratch, .buffer_len = scratch_len, .iov = iov, .iov_len = iov_len };
+
+    _render_template(&out, tpl, values);
+    return out.error ? -2 : out.iov_count;
+}
+
+
+/*
+ * Builders.
+ *
+ * A fstr_buf is rendered into as a buffer that grows instead of running out, so each
+ * append is a single pass straight onto the end of the text.
+ */
+void fstr_buf_init(fstr_buf *buf, const fstr_allocator *allocator)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+    buf->allocator = allocator;
+}
+
+
+/**
+ * @brief Internal function to finish appending to a builder, \0 terminating the text
+ * 
+ * @param[in] r     The result of the render, -1 if it failed
+ * @return The length appended, or -1 if it failed, in which case the text is left as it was.
+ */
+static ssize_t _buf_finish(fstr_buf *buf, fstr_out *out, int r)
+{
+    ssize_t appended;
+
+    if (r < 0 || out->error || (out->pos >= out->buffer_len && _out_grow(out, 0) < 0)) {
+        if (buf->data != NULL) {
+            buf->data[buf->len] = 0;
+        }
+        return -1;
+    }
+    out->buffer[out->pos] = 0;
+    appended = out->pos - buf->len;
+    buf->len = out->pos;
+    return appended;
+}
+
+
+ssize_t fstr_buf_append(fstr_buf *buf, const char *format, fstr_value *first, ...)
+{
+    ssize_t r;
+    va_list vl;
+    fstr_value *stack[VA_LIST_LEN], **list;
+    va_start(vl, first);
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);    
+    va_end(vl);
+    r = list ? fstr_buf_lappend(buf, format, list) : -1;
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+ssize_t fstr_buf_vappend(fstr_buf *buf, const char *format, va_list vl)
+{
+    ssize_t r;
+    fstr_value *stack[VA_LIST_LEN], **list = _va_to_list(stack, &_malloc_allocator, va_arg(vl, fstr_value *), vl);    
+    r = list ? fstr_buf_lappend(buf, format, list) : -1;
+    _va_list_free(stack, &_malloc_allocator, list);
+    return r;
+}
+
+
+ssize_t fstr_buf_lappend(fstr_buf *buf, const char *format, fstr_value *values[])
+{
+    fstr_out out = { .buffer = buf->data, .buffer_len = buf->size, .pos = buf->len, .grow = buf };
+
+    return _buf_finish(buf, &out, _render_format(&out, format, values));
+}
+
+
+ssize_t fstr_buf_render(fstr_buf *buf, const fstr_template *tpl, fstr_value *values[])
+{
+    fstr_out out = { .buffer = buf->data, .buffer_len = buf->size, .pos = buf->len, .grow = buf };
+
+    _render_template(&out, tpl, values);
+    return _buf_finish(buf, &out, 0);
+}
+
+
+ssize_t fstr_buf_write(fstr_buf *buf, const char *text, size_t len)
+{
+    fstr_out out = { .buffer = buf->data, .buffer_len = buf->size, .pos = buf->len, .grow = buf };
+
+    _out_write(&out, text, len, 1);
+    return _buf_finish(buf, &out, 0);
+}
+
+
+int fstr_buf_reserve(fstr_buf *buf, size_t len)
+{
+    if (buf->len + len < buf->len || _buf_grow(buf, buf->len, buf->len + len + 1) < 0) {
+        return -1;
+    }
+    buf->data[buf->len] = 0;
+    return 0;
+}
+
+
+void fstr_buf_reset(fstr_buf *buf)
+{
+    buf->len = 0;
+    if (buf->data != NULL) {
+        buf->data[0] = 0;
+    }
+}
+
+
+void fstr_buf_free(fstr_buf *buf)
+{
+    const fstr_allocator *allocator = buf->allocator ? buf->allocator : &_malloc_allocator;
+
+    if (buf->data != NULL) {
+        allocator->free(allocator->data, buf->data);
+    }
+    fstr_buf_init(buf, buf->allocator);
+}
+
+
+/*
+ * Parallel batches.
+ *
+ * The rows are split into chunks and each thread starts with an equal share of them. A
+ * thread takes chunks from the front of its own share, and once that's empty steals them
+ * from the back of the others', so a thread that is slow (or gets slow rows) doesn't hold
+ * the rest up. Each chunk is rendered into a buffer of its own. The calling thread renders
+ * chunks too, and in between it passes on the finished chunks in order, so the output is
+ * the same whichever thread rendered what.
+ */
+
+/* The fewest rows in a chunk, and how many chunks each thread should get */
+#define PARALLEL_MIN_ROWS   64
+#define PARALLEL_CHUNKS     16
+
+typedef struct {
+    fstr_buf buf;
+    atomic_int done;
+    int error;
+} fstr_chunk;
+
+/* A thread's chunks, the next one in the top 32 bits and the end in the bottom, on a cache line of its own */
+typedef struct {
+    _Atomic(uint64_t) range;
+    char pad[64 - sizeof(uint64_t)];
+} fstr_share;
+
+typedef struct {
+    const fstr_template *tpl;
+    const fstr_batch *batch;
+    fstr_value **values;
+    size_t *offsets;
+    size_t chunk_rows;
+    size_t nchunks;
+    fstr_chunk *chunks;
+    fstr_share *shares;
+    int nshares;
+    atomic_int cancel;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} fstr_parallel;
+
+typedef struct {
+    fstr_parallel *p;
+    int share;
+    pthread_t thread;
+} fstr_worker;
+
+
+/**
+ * @brief Internal function to take a chunk from the front of a share, or steal one from the back
+ * 
+ * @return The chunk, or -1 if the share is empty.
+ */
+static long _share_take(fstr_share *share, int steal)
+{
+    uint64_t range = atomic_load(&share->range), next, end;
+
+    do {
+        next = range >> 32;
+        end = range & 0xffffffff;
+        if (next >= end) {
+            return -1;
+        }
+    } while(!atomic_compare_exchange_weak(&share->range, &range, steal ? next << 32 | (end - 1) : (next + 1) << 32 | end));
+    return steal ? (long)end - 1 : (long)next;
+}
+
+
+/**
+ * @brief Internal function to get the next chunk for a thread to render
+ * 
+ * @return The chunk, or -1 if there are none left (or the render has failed).
+ */
+static long _parallel_next(fstr_parallel *p, int share)
+{
+    long c;
+    int i;
+
+    if (atomic_load_explicit(&p->cancel, memory_order_relaxed)) {
+        return -1;
+    }
+    if ((c = _share_take(&p->shares[share], 0)) >= 0) {
+        return c;
+    }
+    for(i = 1; i < p->nshares; i++) {
+        if ((c = _share_take(&p->shares[(share + i) % p->nshares], 1)) >= 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+
+static void _parallel_render(fstr_parallel *p, size_t c)
+{
+    fstr_chunk *chunk = &p->chunks[c];
+    fstr_out out = { .grow = &chunk->buf };
+    size_t first = c * p->chunk_rows;
+    int r;
+
+    r = _render_batch(&out, p->offsets, p->tpl, p->batch, p->values, first, 
+            p->chunk_rows < p->batch->rows - first ? p->chunk_rows : p->batch->rows - first);
+    chunk->error = _buf_finish(&chunk->buf, &out, r) < 0;
+    pthread_mutex_lock(&p->lock);
+    atomic_store_explicit(&chunk->done, 1, memory_order_release);
+    pthread_cond_broadcast(&p->done);
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+static void *_parallel_worker(void *arg)
+{
+    fstr_worker *w = arg;
+    long c;
+
+    while((c = _parallel_next(w->p, w->share)) >= 0) {
+        _parallel_render(w->p, c);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Internal function to pass a finished chunk to the sink, making its offsets relative to the whole output
+ * 
+ * @return 0, or -1 if the chunk failed or the sink returned an error.
+ */
+static int _parallel_emit(fstr_parallel *p, size_t c, fstr_sink *sink, size_t *total)
+{
+    fstr_chunk *chunk = &p->chunks[c];
+    size_t row, end = (c + 1) * p->chunk_rows < p->batch->rows ? (c + 1) * p->chunk_rows : p->batch->rows;
+    int r = 0;
+
+    if (chunk->error || (chunk->buf.len > 0 && sink->write(sink->data, chunk->buf.data, chunk->buf.len) < 0)) {
+        atomic_store(&p->cancel, 1);
+        r = -1;
+    } else {
+        for(row = c * p->chunk_rows; p->offsets && row < end; row++) {
+            p->offsets[row] += *total;
+        }
+        *total += chunk->buf.len;
+    }
+    fstr_buf_free(&chunk->buf);
+    return r;
+}
+
+
+/**
+ * @brief Internal function to render a batch with a number of threads, passing the output to a sink in order
+ * 
+ * @return The length of the output, or -1 on error.
+ */
+static ssize_t _render_parallel(fstr_sink *sink, size_t *offsets, const fstr_template *tpl, const fstr_batch *batch, 
+        fstr_value *values[], int threads)
+{
+    fstr_parallel p = { .tpl = tpl, .batch = batch, .values = values, .offsets = offsets };
+    fstr_worker *workers = NULL;
+    size_t emitted = 0, total = 0, i;
+    int error = 0;
+    long c;
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    p.chunk_rows = batch->rows / ((size_t)threads * PARALLEL_CHUNKS);
+    if (p.chunk_rows < PARALLEL_MIN_ROWS || batch->rows / p.chunk_rows > UINT32_MAX) {
+        p.chunk_rows = p.chunk_rows < PARALLEL_MIN_ROWS ? PARALLEL_MIN_ROWS : batch->rows / UINT32_MAX + 1;
+    }
+    p.nchunks = (batch->rows + p.chunk_rows - 1) / p.chunk_rows;
+    p.nshares = p.nchunks < (size_t)threads ? (p.nchunks > 0 ? p.nchunks : 1) : threads;
+    p.chunks = calloc(p.nchunks + 1, sizeof(fstr_chunk));
+    workers = calloc(p.nshares, sizeof(fstr_worker));
+    if (p.chunks == NULL || workers == NULL || posix_memalign((void **)&p.shares, 64, sizeof(fstr_share) * p.nshares) != 0) {
+        free(p.chunks);
+        free(workers);
+        return -1;
+    }
+    STAT_ADD(allocs, 3);
+    for(i = 0; i < (size_t)p.nshares; i++) {
+        atomic_init(&p.shares[i].range, (uint64_t)(p.nchunks * i / p.nshares) << 32 | p.nchunks * (i + 1) / p.nshares);
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.done, NULL);
+
+    /* If a thread can't be started, its share will be stolen by the others */
+    for(i = 1; i < (size_t)p.nshares; i++) {
+        workers[i].p = &p;
+        workers[i].share = i;
+        if (pthread_create(&workers[i].thread, NULL, _parallel_worker, &workers[i]) != 0) {
+            workers[i].p = NULL;
+        }
+    }
+    while((c = _parallel_next(&p, 0)) >= 0) {
+        _parallel_render(&p, c);
+        while(!error && emitted < p.nchunks && atomic_load_explicit(&p.chunks[emitted].done, memory_order_acquire)) {
+            error = _parallel_emit(&p, emitted++, sink, &total) < 0;
+        }
+    }
+    while(!error && emitted < p.nchunks) {
+        pthread_mutex_lock(&p.lock);
+        while(!atomic_load_explicit(&p.chunks[emitted].done, memory_order_acquire)) {
+            pthread_cond_wait(&p.done, &p.lock);
+        }
+        pthread_mutex_unlock(&p.lock);
+        error = _parallel_emit(&p, emitted++, sink, &total) < 0;
+    }
+
+    for(i = 1; i < (size_t)p.nshares; i++) {
+        if (workers[i].p != NULL) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    for(i = emitted; i < p.nchunks; i++) {
+        fstr_buf_free(&p.chunks[i].buf);
+    }
+    if (offsets && !error) {
+        offsets[batch->rows] = total;
+    }
+    pthread_cond_destroy(&p.done);
+    pthread_mutex_destroy(&p.lock);
+    free(p.shares);
+    free(p.chunks);
+    free(workers);
+    return error ? -1 : (ssize_t)total;
+}
+
+
+static int _buf_sink_write(void *data, const char *buffer, size_t len)
+{
+    return fstr_buf_write(data, buffer, len) < 0 ? -1 : 0;
+}
+
+
+ssize_t fstr_render_batch_parallel(fstr_buf *buf, size_t *offsets, const fstr_template *tpl, const fstr_batch *batch, 
+        fstr_value *values[], int threads)
+{
+    fstr_sink sink = { _buf_sink_write, buf };
+    size_t len = buf->len;
+    ssize_t r = _render_parallel(&sink, offsets, tpl, batch, values, threads);
+
+    if (r < 0 && buf->data != NULL) {
+        buf->len = len;
+        buf->data[len] = 0;
+    }
+    return r;
+}
+
+
+ssize_t fstr_render_batch_parallel_sink(fstr_sink *sink, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[], int threads)
+{
+    return _render_parallel(sink, offsets, tpl, batch, values, threads);
+}
+
+
+/*
+ * Views.
+ *
+ * A view keeps the text of its last render and where each segment is in it. When values
+ * change only their placeholders are rendered again, into scratch, and then spliced in: in
+ * place if each came out the same length as before, otherwise by copying the whole text
+ * into the spare buffer and swapping the two.
+ */
+typedef struct {
+    const fstr_value *value;    /* What the placeholder is bound to, NULL for literal text or no value */
+    fstr_value copy;            /* A value given by fstr_view_set() */
+    size_t offset;              /* Where the segment is in the text */
+    size_t len;
+    size_t scratch;             /* Where the segment's new text is in scratch */
+    size_t scratch_len;
+    int dirty;
+} fstr_view_segment;
+
+struct fstr_view {
+    const fstr_template *tpl;
+    fstr_value **values;
+    fstr_buf text;
+    fstr_buf spare;             /* The text is rebuilt in here when something changes length */
+    fstr_buf scratch;
+    fstr_view_segment *segments;
+};
+
+
+/**
+ * @brief Internal function to look up the values of all a view's placeholders, and mark them
+ *
+ * @return The number of placeholders.
+ */
+static int _view_bind(fstr_view *view)
+{
+    const fstr_segment *seg;
+    size_t i;
+    int n = 0;
+
+    for(i = 0; i < view->tpl->nsegments; i++) {
+        seg = &view->tpl->segments[i];
+        if (seg->name != NULL) {
+            view->segments[i].value = _value_find(seg->name, seg->name_len, seg->name_hash, view->values);
+            view->segments[i].dirty = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/**
+ * @brief Internal function to render segment i of a view
+ */
+static void _view_segment(fstr_out *out, const fstr_view *view, size_t i)
+{
+    const fstr_segment *seg = &view->tpl->segments[i];
+
+    if (seg->name == NULL) {
+        _out_write(out, seg->text, seg->text_len, 0);
+    } else {
+        _render_found(out, view->segments[i].value, seg->name, seg->name_len, seg->has_spec ? &seg->spec : NULL,
+                seg->text, seg->text_len);
+    }
+}
+
+
+/**
+ * @brief Internal function to add a changed range, joining it to the last one if they touch
+ *
+ * When there's no room for another range the last one is stretched to cover it.
+ */
+static void _view_range(fstr_range *ranges, int max_ranges, int *count, size_t offset, size_t len)
+{
+    fstr_range *last = *count > 0 ? &ranges[*count - 1] : NULL;
+
+    if (len == 0 || ranges == NULL || max_ranges <= 0) {
+        return;
+    }
+    if (last != NULL && (offset <= last->offset + last->len || *count == max_ranges)) {
+        last->len = offset + len - last->offset;
+        return;
+    }
+    ranges[*count].offset = offset;
+    ranges[*count].len = len;
+    (*count)++;
+}
+
+
+fstr_view *fstr_view_new(const fstr_template *tpl, fstr_value *values[])
+{
+    fstr_view *view;
+    fstr_out out = { 0 };
+    size_t i;
+
+    view = calloc(1, sizeof(fstr_view) + sizeof(fstr_view_segment) * tpl->nsegments);
+    if (view == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocs, 1);
+    view->tpl = tpl;
+    view->values = values;
+    view->segments = (fstr_view_segment *)(view + 1);
+    _view_bind(view);
+
+    out.grow = &view->text;
+    STATS_BEGIN(&out);
+    for(i = 0; i < tpl->nsegments; i++) {
+        view->segments[i].offset = out.pos;
+        _view_segment(&out, view, i);
+        view->segments[i].len = out.pos - view->segments[i].offset;
+        view->segments[i].dirty = 0;
+    }
+    STATS_END(&out, tpl->format, 1);
+    if (_buf_finish(&view->text, &out, 0) < 0) {
+        fstr_view_free(view);
+        return NULL;
+    }
+    return view;
+}
+
+
+int fstr_view_set(fstr_view *view, const fstr_value *value)
+{
+    const fstr_segment *seg;
+    size_t i;
+    int n = 0;
+
+    for(i = 0; i < view->tpl->nsegments && value->name != NULL; i++) {
+        seg = &view->tpl->segments[i];
+        if (seg->name != NULL && _name_equal(value->name, seg->name, seg->name_len)) {
+            memcpy(&view->segments[i].copy, value, sizeof(fstr_value));
+            view->segments[i].value = &view->segments[i].copy;
+            view->segments[i].dirty = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+int fstr_view_mark(fstr_view *view, const fstr_value *value)
+{
+    size_t i;
+    int n = 0;
+
+    if (value == NULL) {
+        return _view_bind(view);
+    }
+    for(i = 0; i < view->tpl->nsegments; i++) {
+        if (view->segments[i].value == value) {
+            view->segments[i].dirty = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+int fstr_view_render(fstr_view *view, fstr_range *ranges, int max_ranges)
+{
+    fstr_out out = { .buffer = view->scratch.data, .buffer_len = view->scratch.size, .grow = &view->scratch };
+    fstr_view_segment *vs, *end = view->segments + view->tpl->nsegments;
+    size_t len = 0, pos, n, first, last;
+    const char *src, *old;
+    char *dst;
+    fstr_buf swap;
+    int count = 0, dirty = 0, resized = 0;
+    STATS_BEGIN(&out);
+
+    /* Render what changed, and work out how long the text will be */
+    for(vs = view->segments; vs < end; vs++) {
+        if (vs->dirty) {
+            vs->scratch = out.pos;
+            _view_segment(&out, view, vs - view->segments);
+            vs->scratch_len = out.pos - vs->scratch;
+            resized |= vs->scratch_len != vs->len;
+            dirty = 1;
+        }
+        len += vs->dirty ? vs->scratch_len : vs->len;
+    }
+    if (!dirty) {
+        return 0;
+    }
+    STATS_END(&out, view->tpl->format, 1);
+    view->scratch.len = 0;
+    if (_buf_finish(&view->scratch, &out, 0) < 0) {
+        return -1;
+    }
+    dst = view->text.data;
+    if (resized) {
+        fstr_buf_reset(&view->spare);
+        if (fstr_buf_reserve(&view->spare, len) < 0) {
+            return -1;
+        }
+        dst = view->spare.data;
+    }
+
+    /* A segment that has moved or changed length is all different, otherwise only the
+       bytes from the first that differs to the last are */
+    for(vs = view->segments, pos = 0; vs < end; vs++) {
+        old = view->text.data + vs->offset;
+        src = vs->dirty ? view->scratch.data + vs->scratch : old;
+        n = vs->dirty ? vs->scratch_len : vs->len;
+        if (pos != vs->offset || n != vs->len) {
+            _view_range(ranges, max_ranges, &count, pos, n);
+        } else if (vs->dirty) {
+            for(first = 0; first < n && src[first] == old[first]; first++);
+            for(last = n; last > first && src[last - 1] == old[last - 1]; last--);
+            _view_range(ranges, max_ranges, &count, pos + first, last - first);
+        }
+        if (resized || vs->dirty) {
+            memcpy(dst + pos, src, n);
+        }
+        vs->offset = pos;
+        vs->len = n;
+        vs->dirty = 0;
+        pos += n;
+    }
+    dst[len] = 0;
+    if (resized) {
+        swap = view->text;
+        view->text = view->spare;
+        view->spare = swap;
+        view->text.len = len;
+    }
+    return count;
+}
+
+
+const char *fstr_view_text(const fstr_view *view, size_t *len)
+{
+    if (len) *len = view->text.len;
+    return view->text.data;
+}
+
+
+void fstr_view_free(fstr_view *view)
+{
+    if (view == NULL) {
+        return;
+    }
+    fstr_buf_free(&view->text);
+    fstr_buf_free(&view->spare);
+    fstr_buf_free(&view->scratch);
+    free(view);
+}
+
+
+/*
+ * Logging.
+ *
+ * Each thread that logs gets a ring of its own, which only it writes to (moving head) and
+ * only the logger's thread reads from (moving tail), so neither takes a lock. A line is a
+ * record of the template and copies of the values, followed by the names and text they
+ * point to, so nothing of the caller's needs to stay around. A record is never split
+ * across the end of the ring: when it won't fit, a record with a len of 0 says to carry
+ * on from the start.
+ *
+ * The logger's thread goes round the rings rendering into a builder, and writes it out at
+ * the end of each round. When there's nothing to do it sleeps, with sleeping set so that
+ * a thread that logs knows to wake it.
+ */
+
+/* The size of a thread's ring if none is given, and the smallest */
+#define LOG_RING_LEN        65536
+#define LOG_RING_MIN        4096
+
+/* Write rendered lines out once there are this many bytes, even in the middle of a round */
+#define LOG_BATCH_LEN       65536
+
+/* How long the logger's thread sleeps for when idle (it's woken when there's work), and a blocked thread waits */
+#define LOG_SLEEP_MS        100
+#define LOG_BLOCK_MS        1
+
+/* Lines with up to this many values are copied without allocating */
+#define LOG_VALUES          32
+
+typedef struct {
+    size_t len;                 /* Length of the whole record, or 0 to carry on at the start of the ring */
+    const fstr_template *tpl;
+    size_t nvalues;             /* The values follow, and then the names and text */
+} fstr_log_record;
+
+/* The thread's end of the ring and the logger's are on cache lines of their own */
+typedef struct fstr_log_ring {
+    _Atomic size_t head;        /* Bytes written by the thread */
+    atomic_ulong dropped;
+    char pad[64 - sizeof(size_t) - sizeof(unsigned long)];
+    _Atomic size_t tail;        /* Bytes the logger's thread has finished with */
+    atomic_int closed;          /* The thread has exited */
+    size_t size;                /* How big data is, a power of 2 */
+    char *data;
+    struct fstr_log_ring *next;
+} fstr_log_ring;
+
+/* How a value is copied into a record */
+#define LOG_VALUE       0       /* As it is */
+#define LOG_TEXT        1       /* As a fstr_vt_strn of text */
+#define LOG_WRITE       2       /* As a fstr_vt_strn of what the write callback writes */
+#define LOG_MISSING     3       /* The callback had no value */
+
+typedef struct {
+    fstr_value *val;
+    const char *text;
+    size_t len;
+    uint32_t name_len;
+    uint32_t name_hash;
+    int copy;
+} fstr_log_item;
+
+struct fstr_logger {
+    fstr_sink sink;
+    size_t ring_size;
+    int policy;
+    pthread_key_t key;          /* Each thread's ring */
+    pthread_t thread;
+    pthread_mutex_t lock;       /* Guards the list of rings, and the waits */
+    pthread_cond_t wake;        /* Wakes the logger's thread */
+    pthread_cond_t space;       /* Wakes threads blocked for room */
+    pthread_cond_t flushed_cond;
+    fstr_log_ring *rings;
+    atomic_int sleeping;
+    atomic_int waiting;
+    atomic_int stop;
+    atomic_int error;
+    atomic_ulong flush_requested;
+    unsigned long flushed;
+    unsigned long dropped;      /* By threads whose rings have been freed */
+    unsigned long reported;     /* Drops that have been written about */
+    fstr_buf out;
+    fstr_value **list;          /* Points at a record's values to render them */
+    size_t list_len;
+};
+
+
+/**
+ * @brief Internal function to get the time ms milliseconds from now, for a timed wait
+ */
+static void _log_deadline(struct timespec *ts, long ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ms * 1000000;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+
+/**
+ * @brief Internal function called when a thread that has logged exits. Its ring is freed once it's empty.
+ */
+static void _log_ring_release(void *ring)
+{
+    atomic_store_explicit(&((fstr_log_ring *)ring)->closed, 1, memory_order_release);
+}
+
+
+/**
+ * @brief Internal function to get the calling thread's ring, making it if it hasn't got one
+ */
+static fstr_log_ring *_log_ring(fstr_logger *logger)
+{
+    fstr_log_ring *ring = pthread_getspecific(logger->key);
+
+    if (ring != NULL) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(fstr_log_ring) + logger->ring_size);
+    if (ring == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocs, 1);
+    ring->size = logger->ring_size;
+    ring->data = (char *)(ring + 1);
+    if (pthread_setspecific(logger->key, ring) != 0) {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&logger->lock);
+    ring->next = logger->rings;
+    logger->rings = ring;
+    pthread_mutex_unlock(&logger->lock);
+    return ring;
+}
+
+
+/* The text of a callback with no value, which leaves the placeholder as it is */
+static const char *_log_missing(void *data, const char *name)
+{
+    return NULL;
+}
+
+
+/**
+ * @brief Internal function to work out how to copy a value, calling it if it's a callback
+ *
+ * @return The space it needs in the record, besides the value itself.
+ */
+static size_t _log_item(fstr_log_item *item, fstr_value *val)
+{
+    int r;
+
+    item->val = val;
+    item->name_hash = _value_name_hash(val, &item->name_len);
+    item->copy = LOG_TEXT;
+    item->len = 0;
+    switch(val->type) {
+    case fstr_vt_str:
+        item->text = val->value.s;
+        item->len = strlen(val->value.s);
+        break;
+    case fstr_vt_strn:
+        item->text = val->value.sn.s;
+        item->len = val->value.sn.len;
+        break;
+    case fstr_vt_cb:
+        STAT_CALLBACK(item->text = (val->value.cb)(val->cb_data, val->name));
+        if (item->text == NULL) {
+            item->copy = LOG_MISSING;
+        } else {
+            item->len = strlen(item->text);
+        }
+        break;
+    case fstr_vt_wcb:
+        /* Just the length for now, it writes itself into the record */
+        STAT_CALLBACK(r = (val->value.wcb)(val->cb_data, val->name, NULL, 0));
+        item->copy = r < 0 ? LOG_MISSING : LOG_WRITE;
+        item->len = r < 0 ? 0 : (size_t)r + 1;
+        break;
+    default:
+        item->copy = LOG_VALUE;
+        break;
+    }
+    return item->name_len + 1 + item->len;
+}
+
+
+/**
+ * @brief Internal function to copy a line into a record
+ */
+static void _log_fill(char *data, size_t len, const fstr_template *tpl, const fstr_log_item *items, size_t count)
+{
+    fstr_log_record *rec = (fstr_log_record *)data;
+    fstr_value *v = (fstr_value *)(rec + 1);
+    char *text = (char *)(v + count), *name;
+    const fstr_log_item *item;
+    size_t i, n;
+    int r;
+
+    rec->len = len;
+    rec->tpl = tpl;
+    rec->nvalues = count;
+    for(i = 0; i < count; i++, v++) {
+        item = &items[i];
+        name = memcpy(text, item->val->name, item->name_len + 1);
+        text += item->name_len + 1;
+        n = item->len;
+        if (item->copy == LOG_WRITE) {
+            STAT_CALLBACK(r = (item->val->value.wcb)(item->val->cb_data, item->val->name, text, item->len));
+            n = r < 0 ? 0 : ((size_t)r < item->len ? (size_t)r : item->len - 1);
+        } else if (item->copy == LOG_TEXT) {
+            memcpy(text, item->text, n);
+        }
+        if (item->copy == LOG_VALUE) {
+            memcpy(v, item->val, sizeof(fstr_value));
+        } else if (item->copy == LOG_MISSING) {
+            memcpy(v, &(fstr_value){ .type = fstr_vt_cb, .value.cb = _log_missing }, sizeof(fstr_value));
+        } else {
+            memcpy(v, &(fstr_value){ .type = fstr_vt_strn, .value.sn = { text, n } }, sizeof(fstr_value));
+        }
+        v->name = name;
+        v->name_hashed = 1;
+        v->name_hash = item->name_hash;
+        v->name_len = item->name_len;
+        text += item->len;
+    }
+}
 
 
 /**
- * @brief Internal function used to lookup the value for the given name from the values list
- * 
- * Will call the callback function if provided.
- * 
- * @return Returns the value for that name, or NULL if not found.
+ * @brief Internal function to wait a little while for the logger's thread to make room
  */
-const char *_value_lookup(const char *name, fstr_value *values[])
+static void _log_wait(fstr_logger *logger)
 {
-    int i;
-    static char tmpbuff[128];
-    fstr_value *val;
-    
-    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
-        val = values[i];
+    struct timespec ts;
 
-        if (strcasecmp(name, val->name) == 0 || (val->name[0] == '*' && val->name[1] == 0)) {
-            switch(val->type) {
-            case fstr_vt_str: 
-                return val->value.s; 
-            case fstr_vt_int:
-                snprintf(tmpbuff, sizeof(tmpbuff), "%d", val->value.i);
-                return tmpbuff;
-            case fstr_vt_long:
-                snprintf(tmpbuff, sizeof(tmpbuff), "%ld", val->value.l);
-                return tmpbuff;
-            case fstr_vt_float:
-                snprintf(tmpbuff, sizeof(tmpbuff), "%f", val->value.f);
-                return tmpbuff;
-            case fstr_vt_double:
-                snprintf(tmpbuff, sizeof(tmpbuff), "%lf", val->value.d);
-                return tmpbuff;
-            case fstr_vt_cb:
-                return (val->value.cb)(val->cb_data, name);
-            default:
-                fprintf(stderr, "Unknown value type\n");
-                return NULL;
-            }
-        }
-    }
-    return NULL;
+    _log_deadline(&ts, LOG_BLOCK_MS);
+    pthread_mutex_lock(&logger->lock);
+    atomic_fetch_add(&logger->waiting, 1);
+    pthread_cond_signal(&logger->wake);
+    pthread_cond_timedwait(&logger->space, &logger->lock, &ts);
+    atomic_fetch_sub(&logger->waiting, 1);
+    pthread_mutex_unlock(&logger->lock);
 }
 
 
 /**
- * @brief Internal debug function, prints the contents of a value list
- * 
+ * @brief Internal function to find room in a ring for a record of len bytes
+ *
+ * @param[out] next     Set to what head will be once the record is written.
+ * @return Where to write the record, or NULL if the line is dropped.
  */
-void _debug_dump_values(fstr_value *values[])
+static char *_log_reserve(fstr_logger *logger, fstr_log_ring *ring, size_t len, size_t *next)
 {
-    int i;
-    static char tmpbuff[128];
-    const char *str;
-    fstr_value *val;
-    printf("Dumping values list\n");
-    for(i = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
-        val = values[i];
-        switch(val->type) {
-            case fstr_vt_str: 
-                str = val->value.s; 
-                break;
-            case fstr_vt_int:
-                //ntoa is not standard
-                snprintf(tmpbuff, sizeof(tmpbuff), "%d", val->value.i);
-                str = tmpbuff;
-                break;
-            case fstr_vt_cb:
-                str = (val->value.cb)(val->cb_data, val->name);
-                break;
-            default:
-                snprintf(tmpbuff, sizeof(tmpbuff), "INVALID TYPE %d", val->type);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed), pos = head & (ring->size - 1);
+    size_t skip = len > ring->size - pos ? ring->size - pos : 0;
+
+    /* At most half the ring, so that it always fits once the ring is empty */
+    while(len > ring->size / 2 ||
+            ring->size - (head - atomic_load_explicit(&ring->tail, memory_order_acquire)) < skip + len) {
+        if (logger->policy != FSTR_LOG_BLOCK || len > ring->size / 2) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return NULL;
         }
-        printf("#%d: %s type %d: val: %s\n", i, val->name, val->type, str);
+        _log_wait(logger);
     }
-    printf("End of list\n");
+    if (skip > 0) {
+        ((fstr_log_record *)(ring->data + pos))->len = 0;
+        pos = 0;
+    }
+    *next = head + skip + len;
+    return ring->data + pos;
 }
 
 
-fstr_value **_va_to_list(fstr_value *first, va_list vl)
+int fstr_llog(fstr_logger *logger, const fstr_template *tpl, fstr_value *values[])
 {
-    int list_size = 10, l_count = 0;
-    fstr_value *val;
-    fstr_value **list = calloc(sizeof(fstr_value *),list_size+1);
+    fstr_log_item stack_items[LOG_VALUES], *items = stack_items;
+    fstr_log_ring *ring = _log_ring(logger);
+    size_t i, j, count = _table_count(values), len, next;
+    const fstr_table *table;
+    char *data;
+    int r = -1;
 
-    if (first) list[l_count++] = first;
-    do {
-        if (l_count == list_size) {
-            list_size *= 2;
-            list = realloc(list, sizeof(fstr_value *) * (list_size + 1));
+    if (ring == NULL) {
+        return -1;
+    }
+    if (count > LOG_VALUES) {
+        items = malloc(sizeof(fstr_log_item) * count);
+        if (items == NULL) {
+            return -1;
         }
-        val = va_arg(vl, fstr_value *);
-        list[l_count] = val;
-        l_count++;
-    } while(val != NULL);
-    //_debug_dump_values(list);
-    return list;
+        STAT_ADD(allocs, 1);
+    }
+    len = sizeof(fstr_log_record) + sizeof(fstr_value) * count;
+    for(i = 0, count = 0; values && values[i] != NULL && values[i]->name != NULL; i++) {
+        if (values[i]->type == fstr_vt_table) {
+            table = values[i]->value.t;
+            for(j = 0; j < table->count; j++) {
+                len += _log_item(&items[count++], &table->entries[j]);
+            }
+        } else {
+            len += _log_item(&items[count++], values[i]);
+        }
+    }
+    len = (len + 7) & ~(size_t)7;
+
+    if ((data = _log_reserve(logger, ring, len, &next)) != NULL) {
+        _log_fill(data, len, tpl, items, count);
+        /* In the same order as sleeping is set and head checked by the logger's thread */
+        atomic_store(&ring->head, next);
+        if (atomic_load(&logger->sleeping)) {
+            pthread_mutex_lock(&logger->lock);
+            pthread_cond_signal(&logger->wake);
+            pthread_mutex_unlock(&logger->lock);
+        }
+        r = 0;
+    }
+    if (items != stack_items) {
+        free(items);
+    }
+    return r;
 }
 
 
-char *fstring(const char *format, fstr_value *first, ...)
+int fstr_log(fstr_logger *logger, const fstr_template *tpl, fstr_value *first, ...)
 {
-    char *r;
+    int r;
     va_list vl;
-    fstr_value **list;
+    fstr_value *stack[VA_LIST_LEN], **list;
     va_start(vl, first);
-    list = _va_to_list(first, vl);    
+    list = _va_to_list(stack, &_malloc_allocator, first, vl);
     va_end(vl);
-    r = lfstring(format, list);
-    free(list);
+    r = list ? fstr_llog(logger, tpl, list) : -1;
+    _va_list_free(stack, &_malloc_allocator, list);
     return r;
 }
 
 
-char *vfstring(const char *format, va_list vl)
+/**
+ * @brief Internal function to pass what has been rendered to the sink
+ */
+static void _log_write(fstr_logger *logger)
 {
-    fstr_value **list = _va_to_list(NULL, vl);    
-    char *r = lfstring(format, list);
-    free(list);
-    return r;
+    if (logger->out.len > 0 && !atomic_load(&logger->error) &&
+            logger->sink.write(logger->sink.data, logger->out.data, logger->out.len) < 0) {
+        atomic_store(&logger->error, 1);
+    }
+    fstr_buf_reset(&logger->out);
 }
 
 
-char *lfstring(const char *format, fstr_value **list)
+/**
+ * @brief Internal function to render the lines waiting in a ring
+ *
+ * @return The number of lines.
+ */
+static size_t _log_drain(fstr_logger *logger, fstr_log_ring *ring)
 {
-    int r;
-    size_t buffer_len = strlen(format) + 20; // Ensure we always have a little room.
-    char *buffer = NULL;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed), head, i, n = 0;
+    fstr_log_record *rec;
+    fstr_value *values, **list;
+
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while(tail != head) {
+        rec = (fstr_log_record *)(ring->data + (tail & (ring->size - 1)));
+        if (rec->len == 0) {
+            tail += ring->size - (tail & (ring->size - 1));
+            continue;
+        }
+        if (rec->nvalues + 1 > logger->list_len &&
+                (list = realloc(logger->list, sizeof(fstr_value *) * (rec->nvalues + 1))) != NULL) {
+            logger->list = list;
+            logger->list_len = rec->nvalues + 1;
+        }
+        /* Out of memory loses the line */
+        if (rec->nvalues + 1 <= logger->list_len) {
+            values = (fstr_value *)(rec + 1);
+            for(i = 0; i < rec->nvalues; i++) {
+                logger->list[i] = &values[i];
+            }
+            logger->list[i] = NULL;
+            fstr_buf_render(&logger->out, rec->tpl, logger->list);
+        }
+        tail += rec->len;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        n++;
+        if (logger->out.len >= LOG_BATCH_LEN) {
+            _log_write(logger);
+        }
+    }
+    return n;
+}
 
-    if (*format == 0) return strdup("");
 
-    while(buffer_len < MAX_BUFFER_LEN) {
-        buffer = (char *)malloc(sizeof(char) * buffer_len);
-    
-        r = lbfstring(buffer, buffer_len, format, list);
-    
-        if (r > 0) {
-            return buffer;
-        } else if (r == 0 || r == -1) {
-            // Both of these results indicate an error condition.
-            return NULL;
-        } else if (r < 0) {
-            /* Need to resize. We coud realloc, but that copys the buffer, which we don't need. */
-            free(buffer);
-            r *= -1; /* Make positive number */
-            if (r < buffer_len) {
-                /* Weird, we were asked to supply a smaller buffer. */
-                fprintf(stderr, "Asked to supply a smaller buffer. Gave %lu got %d?!\n", buffer_len, r);
-                buffer_len *= 2;
-            } else {
-                buffer_len = r * 2;
+/**
+ * @brief Internal function to add up the lines dropped. Must hold the lock.
+ */
+static unsigned long _log_dropped(fstr_logger *logger)
+{
+    fstr_log_ring *ring;
+    unsigned long n = logger->dropped;
+
+    for(ring = logger->rings; ring != NULL; ring = ring->next) {
+        n += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return n;
+}
+
+
+/**
+ * @brief Internal function to check whether any ring has lines waiting. Must hold the lock.
+ */
+static int _log_pending(fstr_logger *logger)
+{
+    fstr_log_ring *ring;
+
+    for(ring = logger->rings; ring != NULL; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Internal function to render and write out everything in the rings, freeing the rings of threads that have gone
+ *
+ * @return The number of lines.
+ */
+static size_t _log_round(fstr_logger *logger)
+{
+    fstr_log_ring **link = &logger->rings, *ring;
+    unsigned long dropped;
+    size_t n = 0;
+
+    pthread_mutex_lock(&logger->lock);
+    while((ring = *link) != NULL) {
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+                atomic_load(&ring->head) == atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            *link = ring->next;
+            logger->dropped += atomic_load(&ring->dropped);
+            free(ring);
+            continue;
+        }
+        pthread_mutex_unlock(&logger->lock);
+        n += _log_drain(logger, ring);
+        pthread_mutex_lock(&logger->lock);
+        link = &ring->next;
+    }
+    if (logger->policy == FSTR_LOG_COUNT && (dropped = _log_dropped(logger)) != logger->reported) {
+        fstr_buf_append(&logger->out, "fstr_log: {n} lines dropped\n", fstr_nlong("n", dropped - logger->reported), fstr_end);
+        logger->reported = dropped;
+    }
+    if (atomic_load(&logger->waiting) > 0) {
+        pthread_cond_broadcast(&logger->space);
+    }
+    pthread_mutex_unlock(&logger->lock);
+    _log_write(logger);
+    return n;
+}
+
+
+static void *_log_thread(void *arg)
+{
+    fstr_logger *logger = arg;
+    unsigned long flush;
+    struct timespec ts;
+    int stop;
+    size_t n;
+
+    for(;;) {
+        flush = atomic_load(&logger->flush_requested);
+        stop = atomic_load(&logger->stop);
+        n = _log_round(logger);
+
+        pthread_mutex_lock(&logger->lock);
+        if (logger->flushed != flush) {
+            logger->flushed = flush;
+            pthread_cond_broadcast(&logger->flushed_cond);
+        }
+        if (n == 0 && stop) {
+            pthread_mutex_unlock(&logger->lock);
+            break;
+        }
+        if (n == 0 && flush == atomic_load(&logger->flush_requested) && !atomic_load(&logger->stop)) {
+            atomic_store(&logger->sleeping, 1);
+            if (!_log_pending(logger)) {
+                _log_deadline(&ts, LOG_SLEEP_MS);
+                pthread_cond_timedwait(&logger->wake, &logger->lock, &ts);
             }
+            atomic_store(&logger->sleeping, 0);
         }
+        pthread_mutex_unlock(&logger->lock);
     }
-    fprintf(stderr, "fstring.c: Maximum buffer exceeded: %lu\n", buffer_len);
     return NULL;
 }
 
 
-int bfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *first, ...)
+fstr_logger *fstr_logger_new(fstr_sink *sink, size_t ring_size, int policy)
 {
-    /* What's with the "first" arg? It's just to ensure that people don't call
-     * bfstring(buff, l, "blah", fstr_list )
-     * when the should have called
-     * lbfstring(buff, l, "blah", fstr_list )
-     */
-    int r;
-    va_list vl;
-    fstr_value **list;
-    va_start(vl, first);
-    
-    list = _va_to_list(first, vl);    
-    va_end(vl);
-    r = lbfstring(buffer, buffer_len, format, list);
-    free(list);
-    return r;
+    fstr_logger *logger;
+    size_t size = LOG_RING_MIN;
+
+    logger = calloc(1, sizeof(fstr_logger));
+    if (logger == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocs, 1);
+    while(size < (ring_size ? ring_size : LOG_RING_LEN) && size <= SIZE_MAX / 4) {
+        size *= 2;
+    }
+    logger->sink = *sink;
+    logger->ring_size = size;
+    logger->policy = policy;
+    pthread_mutex_init(&logger->lock, NULL);
+    pthread_cond_init(&logger->wake, NULL);
+    pthread_cond_init(&logger->space, NULL);
+    pthread_cond_init(&logger->flushed_cond, NULL);
+    if (pthread_key_create(&logger->key, _log_ring_release) != 0) {
+        free(logger);
+        return NULL;
+    }
+    if (pthread_create(&logger->thread, NULL, _log_thread, logger) != 0) {
+        pthread_key_delete(logger->key);
+        free(logger);
+        return NULL;
+    }
+    return logger;
 }
 
 
-int vbfstring(char *buffer, size_t buffer_len, const char *format, va_list vl)
+int fstr_logger_flush(fstr_logger *logger)
 {
-    int r;
-    fstr_value **list = _va_to_list(NULL, vl);    
-    r = lbfstring(buffer, buffer_len, format, list);
-    free(list);
-    return r;
+    unsigned long ticket;
+
+    pthread_mutex_lock(&logger->lock);
+    ticket = atomic_fetch_add(&logger->flush_requested, 1) + 1;
+    pthread_cond_signal(&logger->wake);
+    while(logger->flushed < ticket) {
+        pthread_cond_wait(&logger->flushed_cond, &logger->lock);
+    }
+    pthread_mutex_unlock(&logger->lock);
+    return atomic_load(&logger->error) ? -1 : 0;
 }
 
 
-int lbfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *values[])
+unsigned long fstr_logger_dropped(fstr_logger *logger)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&logger->lock);
+    n = _log_dropped(logger);
+    pthread_mutex_unlock(&logger->lock);
+    return n;
+}
+
+
+void fstr_logger_free(fstr_logger *logger)
 {
-    const char *sp;
-    char *dp, *name;
-    const char *value;
-    size_t buffer_remaining;
-    size_t remaining_len, value_len, name_len;
+    fstr_log_ring *ring;
 
-    if (buffer_len == 0) {
-        return 0 - strlen(format) - 1;
+    if (logger == NULL) {
+        return;
     }
-    if (*format == 0) {
-        *buffer = 0;
-        return 0;
+    pthread_mutex_lock(&logger->lock);
+    atomic_store(&logger->stop, 1);
+    pthread_cond_signal(&logger->wake);
+    pthread_mutex_unlock(&logger->lock);
+    pthread_join(logger->thread, NULL);
+
+    while((ring = logger->rings) != NULL) {
+        logger->rings = ring->next;
+        free(ring);
     }
-    buffer_remaining = buffer_len;
-    /* 
-     sp is the source pointer, when we are copying the bytes from the format
-     to the buffer, this is where we are up to. sp will be ahead of dp when
-     an escaped curly brace is found
-
-     dp is the destination pointer, typically it is the same as sp, but it will
-     temporarily be in a different position when encountering an escaped curly 
-     brace or a variable
-    */
-
-    sp = format;
-    dp = buffer;
-    while(*sp != 0 && buffer_remaining > 0) {
-        if (*sp == '{' && *(sp+1) == '{') {
-            // If it's a curly brace follow by another curlly brace, it's considered
-            // escaping, so "blah {{ blah" becomes "blah { blah"
-            sp+=2;
-            *dp++ = '{';
-            buffer_remaining--;
-        } else if (*sp == '{') {
-            // We are at the beginning of a named variable. 
-            // We will copy the {name} over to the dest buffer because we need
-            // to null terminate it to read the actual name, as well as if the name
-            // doesn't exist it needs to be there. 
-            name = dp+1;
-            name_len = 0;
-            // Copy the name to the dest buffer, so we can null terminate it.
-            // We are copying the entire {blah}
-            while(*sp != 0 && *sp != '}' && --buffer_remaining > 0) {
-                *dp++ = *sp++;
-            }
-            name_len = (dp - name) + 1;
-            if (*sp == 0) {
-                // Unfished curlybrace.
-                //fprintf(stderr, "Unfinished curly brace\n");
-                return -1;
-            } else if (buffer_remaining == 0) {
-                // Ran out of room storing the name
-                //fprintf(stderr,"Ran out of memory storing the name\n");
-                return 0 - buffer_len - strlen(sp);
-            }
-            
-            *dp = 0; // Terminate the string so we have a name.
-            // Dest now looks like xxxxxx{blah\0
-            value = _value_lookup(name, values);
-            if (value == NULL) {
-                // Lookup failed, not there, we will simply output
-                // the name {NAME} (so restore that closing brace)
-                *dp++ = '}';
-                sp++;
-                buffer_remaining--;
-            } else {
-                value_len = strlen(value);
-                remaining_len = strlen(sp+1);
-                // Where are we?
-                // sp is at the closing curly brace.
-                // name is one past the opening curly brace
-                // dp at the the end of the name(where the closing brace would be, and is currently \0).
-                //
-                // We've already written out the {blah}, and we will be replacing it with THEVALUE,
-                // We need to fit THEVALUE and <whatever remains>
-                // Move dp back to the beginning, where we overwrite the {name}
-                dp = name - 1; // name was at the start of {name} (just passed the curly brace)
-                sp++; // sp is now just past the curly brace in the source, so at the "remaining"
-                // We decremented the buffer remaining whilst we were copying {name} to the
-                // destination, now we are about to replace with THEVALUE, so reset buffer_remaining
-                buffer_remaining += name_len ;
-
-                if (buffer_remaining < value_len + remaining_len) {
-                    // We can't fit the value and the remaining text
-                    return 0 - (value_len + remaining_len);
-                }
-                // Copy THEVALUE to the dest
-                memcpy(dp, value, value_len);
-                dp += value_len;
-                buffer_remaining -= value_len;
-            }
+    pthread_key_delete(logger->key);
+    fstr_buf_free(&logger->out);
+    free(logger->list);
+    pthread_mutex_destroy(&logger->lock);
+    pthread_cond_destroy(&logger->wake);
+    pthread_cond_destroy(&logger->space);
+    pthread_cond_destroy(&logger->flushed_cond);
+    free(logger);
+}
+
+
+/*
+ * Template cache.
+ *
+ * A direct mapped table of compiled templates, indexed by the format pointer. As the
+ * memory at a pointer can be reused for a different format, an entry only matches if the
+ * format is also still the same as the copy in the entry. (Comparing is exact, and as
+ * fast as hashing the format would be.) A new format replaces whatever was in its slot.
+ *
+ * Lookups take no locks. A reader publishes the entry it is using in its hazard pointer,
+ * and entries that are replaced are only freed once no hazard pointer refers to them.
+ * Inserting (a miss) takes a mutex. Each thread has a hazard record, which also holds its
+ * hit and miss counts so the counters don't bounce a cache line between threads.
+ */
+typedef struct {
+    const char *format;         /* The address of the format */
+    fstr_template *tpl;
+    char text[];                /* A copy of the format, to check it hasn't changed */
+} fstr_cache_entry;
+
+typedef struct fstr_hazard {
+    _Atomic(fstr_cache_entry *) entry;      /* The entry this thread is using */
+    atomic_int active;                      /* Owned by a thread */
+    atomic_ulong hits, misses;
+    struct fstr_hazard *next;
+} fstr_hazard;
+
+struct fstr_cache {
+    size_t mask;
+    _Atomic(fstr_cache_entry *) *slots;
+};
+
+/* Free replaced entries once there are this many (plus one per thread) */
+#define CACHE_RETIRE_LEN    32
+
+static _Atomic(fstr_hazard *) _hazards;
+static __thread fstr_hazard *_thread_hazard;
+static pthread_key_t _hazard_key;
+static pthread_once_t _hazard_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static fstr_cache_entry **_retired;
+static size_t _retired_count, _retired_max;
+static atomic_ulong _cache_evictions, _cache_entries;
+
+
+static void _hazard_release(void *hazard)
+{
+    fstr_hazard *hp = hazard;
+
+    atomic_store(&hp->entry, NULL);
+    atomic_store(&hp->active, 0);
+}
+
+
+static void _hazard_init(void)
+{
+    pthread_key_create(&_hazard_key, _hazard_release);
+}
+
+
+/**
+ * @brief Internal function to get the calling thread's hazard record, reusing one from a finished thread if there is one
+ */
+static fstr_hazard *_hazard_get(void)
+{
+    fstr_hazard *hp;
+    int inactive;
+
+    if (_thread_hazard != NULL) {
+        return _thread_hazard;
+    }
+    pthread_once(&_hazard_once, _hazard_init);
+    for(hp = atomic_load(&_hazards); hp != NULL; hp = hp->next) {
+        inactive = 0;
+        if (atomic_compare_exchange_strong(&hp->active, &inactive, 1)) {
+            break;
+        }
+    }
+    if (hp == NULL) {
+        hp = calloc(1, sizeof(fstr_hazard));
+        if (hp == NULL) {
+            return NULL;
+        }
+        atomic_store(&hp->active, 1);
+        hp->next = atomic_load(&_hazards);
+        while(!atomic_compare_exchange_weak(&_hazards, &hp->next, hp)) {
+        }
+    }
+    pthread_setspecific(_hazard_key, hp);
+    _thread_hazard = hp;
+    return hp;
+}
+
+
+static void _cache_entry_free(fstr_cache_entry *entry)
+{
+    fstr_template_free(entry->tpl);
+    free(entry);
+}
+
+
+/**
+ * @brief Internal function to free the replaced entries that no thread is using. Must hold _cache_lock.
+ */
+static void _cache_reclaim(void)
+{
+    fstr_hazard *hp;
+    size_t i, kept = 0;
+    int used;
+
+    for(i = 0; i < _retired_count; i++) {
+        used = 0;
+        for(hp = atomic_load(&_hazards); hp != NULL && !used; hp = hp->next) {
+            used = atomic_load(&hp->entry) == _retired[i];
+        }
+        if (used) {
+            _retired[kept++] = _retired[i];
         } else {
-            *dp++ = *sp++;
-            buffer_remaining--;
+            _cache_entry_free(_retired[i]);
+        }
+    }
+    _retired_count = kept;
+}
+
+
+/**
+ * @brief Internal function to put an entry in the cache, retiring the one it replaces. Must hold _cache_lock.
+ */
+static void _cache_store(_Atomic(fstr_cache_entry *) *slot, fstr_cache_entry *entry)
+{
+    fstr_cache_entry *old = atomic_exchange(slot, entry), **bigger;
+
+    if (old == NULL) {
+        atomic_fetch_add(&_cache_entries, 1);
+        return;
+    }
+    atomic_fetch_add(&_cache_evictions, 1);
+    if (_retired_count == _retired_max) {
+        bigger = realloc(_retired, sizeof(fstr_cache_entry *) * (_retired_max + CACHE_RETIRE_LEN));
+        if (bigger == NULL) {
+            /* Leak it rather than free something another thread might be using */
+            return;
         }
+        _retired = bigger;
+        _retired_max += CACHE_RETIRE_LEN;
     }
-    if (buffer_remaining == 0) {
-        // We need all the space we had, plus the remainder of text, at least.
-        return 0 - buffer_len - (strlen(sp) + 1);
+    _retired[_retired_count++] = old;
+    if (_retired_count >= CACHE_RETIRE_LEN) {
+        _cache_reclaim();
     }
-    *dp = 0;
-    return buffer_len - buffer_remaining;
+}
+
+
+/**
+ * @brief Internal function to render a format with its cached template, compiling it on a miss.
+ * 
+ * @return 0 if it was rendered, or -1 if it should be rendered normally.
+ */
+static int _cache_render(fstr_out *out, const char *format, fstr_value *values[])
+{
+    fstr_hazard *hp = _hazard_get();
+    fstr_cache_entry *entry, *created;
+    _Atomic(fstr_cache_entry *) *slot;
+    size_t len;
+
+    if (hp == NULL) {
+        return -1;
+    }
+    slot = &_cache->slots[(((uintptr_t)format >> 3) * 0x9e3779b97f4a7c15ull >> 32) & _cache->mask];
+
+    /* Publish the entry, then check it's still there, so it can't be freed while in use */
+    do {
+        entry = atomic_load(slot);
+        atomic_store(&hp->entry, entry);
+    } while(entry != atomic_load(slot));
+
+    if (entry == NULL || entry->format != format || strcmp(entry->text, format) != 0) {
+        atomic_fetch_add_explicit(&hp->misses, 1, memory_order_relaxed);
+        len = strlen(format);
+        created = malloc(sizeof(fstr_cache_entry) + len + 1);
+        /* The template's text points at the format, as it's checked to be the same each time */
+        if (created == NULL || (created->tpl = _compile(format, 0)) == NULL) {
+            free(created);
+            atomic_store(&hp->entry, NULL);
+            return -1;
+        }
+        STAT_ADD(allocs, 1);
+        created->format = format;
+        memcpy(created->text, format, len + 1);
+        atomic_store(&hp->entry, created);
+        pthread_mutex_lock(&_cache_lock);
+        _cache_store(slot, created);
+        pthread_mutex_unlock(&_cache_lock);
+        entry = created;
+    } else {
+        atomic_fetch_add_explicit(&hp->hits, 1, memory_order_relaxed);
+    }
+    _render_segments(out, entry->tpl, values);
+    atomic_store(&hp->entry, NULL);
+    return 0;
+}
+
+
+int fstr_cache_enable(size_t max_entries)
+{
+    struct fstr_cache *cache = NULL;
+    size_t size = 1, i;
+
+    if (max_entries > 0) {
+        while(size < max_entries) {
+            size <<= 1;
+        }
+        cache = malloc(sizeof(struct fstr_cache));
+        if (cache == NULL || (cache->slots = calloc(size, sizeof(*cache->slots))) == NULL) {
+            free(cache);
+            return -1;
+        }
+        cache->mask = size - 1;
+    }
+
+    pthread_mutex_lock(&_cache_lock);
+    if (_cache != NULL) {
+        for(i = 0; i <= _cache->mask; i++) {
+            if (atomic_load(&_cache->slots[i]) != NULL) {
+                _cache_entry_free(atomic_load(&_cache->slots[i]));
+            }
+        }
+        free(_cache->slots);
+        free(_cache);
+    }
+    for(i = 0; i < _retired_count; i++) {
+        _cache_entry_free(_retired[i]);
+    }
+    _retired_count = 0;
+    atomic_store(&_cache_entries, 0);
+    _cache = cache;
+    pthread_mutex_unlock(&_cache_lock);
+    return 0;
+}
+
+
+void fstr_cache_stats(fstr_cache_info *info)
+{
+    fstr_hazard *hp;
+
+    memset(info, 0, sizeof(*info));
+    for(hp = atomic_load(&_hazards); hp != NULL; hp = hp->next) {
+        info->hits += atomic_load_explicit(&hp->hits, memory_order_relaxed);
+        info->misses += atomic_load_explicit(&hp->misses, memory_order_relaxed);
+    }
+    pthread_mutex_lock(&_cache_lock);
+    info->evictions = atomic_load(&_cache_evictions);
+    info->entries = atomic_load(&_cache_entries);
+    info->size = _cache ? _cache->mask + 1 : 0;
+    pthread_mutex_unlock(&_cache_lock);
 }
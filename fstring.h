@@ -25,13 +25,39 @@
 #ifndef include_fstring_h
 #define include_fstring_h
 
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
  * @brief The callback type for dynamic values. 
  */
 typedef const char *(*fstring_callback_t)(void *data, const char *name);
 
+/**
+ * @brief The callback type for dynamic values that write themselves into the output.
+ * 
+ * @details
+ * Works like snprintf(): write the value into buffer, which has room for buffer_len
+ * characters (buffer may be NULL if buffer_len is 0), and return the length of the whole
+ * value, whether it fit or not. If the return is buffer_len or more the callback may be
+ * called again with a bigger buffer, so it must give the same value each time. Return -1
+ * if there is no value, and the placeholder is left as it is. The buffer is usually the
+ * output itself, so the value doesn't need a buffer of its own and isn't copied. Writing
+ * a \0 after the value is allowed (if there is room) but not needed.
+ */
+typedef int (*fstring_write_callback_t)(void *data, const char *name, char *buffer, size_t buffer_len);
+
+/**
+ * @brief A hash indexed set of values. See fstr_table_new().
+ */
+typedef struct fstr_table fstr_table;
+
 #define fstr_vt_null    0
 #define fstr_vt_str     1
 #define fstr_vt_int     2
@@ -39,6 +65,16 @@ typedef const char *(*fstring_callback_t)(void *data, const char *name);
 #define fstr_vt_float   4
 #define fstr_vt_double  5
 #define fstr_vt_cb      6
+#define fstr_vt_table   7
+#define fstr_vt_wcb     8
+#define fstr_vt_strn    9
+#define fstr_vt_ulong   10
+
+/**
+ * @brief How float and double values are formatted. See fstr_float_mode().
+ */
+#define FSTR_FLOAT_SHORTEST     0
+#define FSTR_FLOAT_FIXED        1
 
 /**
  * @brief Values to pass to fstring's values list
@@ -47,17 +83,45 @@ typedef const char *(*fstring_callback_t)(void *data, const char *name);
 typedef struct {
     const char *name;
     char type;
+    char name_hashed;       /* Set if name_hash is fstr_name_hash() of name */
     const union {
         const char *s;
         int i;
         long l;
+        unsigned long ul;
         float f;
         double d;
         fstring_callback_t cb;
+        const fstr_table *t;
+        fstring_write_callback_t wcb;
+        struct {
+            const char *s;
+            size_t len;
+        } sn;
     } value;
     void *cb_data;
+    uint32_t name_hash;     /* fstr_name_hash() of name, if name_hashed is set */
+    uint32_t name_len;      /* Length of name, or 0 if it isn't known */
 } fstr_value;
 
+/**
+ * @brief Hash a name, the way placeholders are matched to values.
+ * 
+ * @details
+ * Placeholders are matched to values by name. When a value has name_len set, names of another
+ * length are passed over without being compared, and the macros that take the name from the
+ * variable (fstr_int(x) and so on) set it. A value that is used over and over can also have its
+ * name_hash set (and name_hashed), in which case names are only compared when the hashes match
+ * too. fstring.hpp sets both when the program is compiled.
+ * 
+ * The hash is FNV-1a, of the name in lower case.
+ * 
+ * @param[in] name      The name
+ * @param[in] name_len  Its length
+ * @return The hash
+ */
+extern uint32_t fstr_name_hash(const char *name, size_t name_len);
+
 /**
  * @brief A convienence define for passing lists to lfstring and lbfstring
  * 
@@ -105,33 +169,86 @@ typedef struct {
  * There are a few different built-in variables, each of these has the fstr_<type> and fstr_n<type>:
  * 
  *      fstr_str    - A string (char *)
+ *      fstr_strn   - A string with a length, which doesn't need to be \0 terminated (char *, size_t)
  *      fstr_int    - An integer (int)
  *      fstr_long   - A long int (long int)
+ *      fstr_ulong  - An unsigned long int (unsigned long int)
  *      fstr_float  - A floating point number (float)
  *      fstr_double - A double float (double)
  * 
  * There is also callbacks, called fstr_cb and fstr_ncb. See the lbnfstring() for more information
  * on those.
  * 
+ * fstr_wcb and fstr_nwcb are callbacks that write the value into the output themselves,
+ * see fstring_write_callback_t.
+ * 
  */
 #define fstr_nstr(N, V)     &((fstr_value){.name=N, .type=fstr_vt_str, .value.s=V})
+#define fstr_nstrn(N, V, L) &((fstr_value){.name=N, .type=fstr_vt_strn, .value.sn={V, L}})
 #define fstr_nint(N, V)     &((fstr_value){.name=N, .type=fstr_vt_int, .value.i=V})
 #define fstr_nlong(N, V)    &((fstr_value){.name=N, .type=fstr_vt_long, .value.l=V})
+#define fstr_nulong(N, V)   &((fstr_value){.name=N, .type=fstr_vt_ulong, .value.ul=V})
 #define fstr_nfloat(N, V)   &((fstr_value){.name=N, .type=fstr_vt_float, .value.f=V})
 #define fstr_ndouble(N, V)  &((fstr_value){.name=N, .type=fstr_vt_double, .value.d=V})
 
-#define fstr_str(X)         &((fstr_value){.name=#X, .type=fstr_vt_str, .value.s=X})
-#define fstr_int(X)         &((fstr_value){.name=#X, .type=fstr_vt_int, .value.i=X})
-#define fstr_long(X)        &((fstr_value){.name=#X, .type=fstr_vt_long, .value.l=X})
-#define fstr_float(X)       &((fstr_value){.name=#X, .type=fstr_vt_float, .value.f=X})
-#define fstr_double(X)      &((fstr_value){.name=#X, .type=fstr_vt_double, .value.d=X})
+#define fstr_str(X)         &((fstr_value){.name=#X, .type=fstr_vt_str, .value.s=X, .name_len=sizeof(#X) - 1})
+#define fstr_strn(X, L)     &((fstr_value){.name=#X, .type=fstr_vt_strn, .value.sn={X, L}, .name_len=sizeof(#X) - 1})
+#define fstr_int(X)         &((fstr_value){.name=#X, .type=fstr_vt_int, .value.i=X, .name_len=sizeof(#X) - 1})
+#define fstr_long(X)        &((fstr_value){.name=#X, .type=fstr_vt_long, .value.l=X, .name_len=sizeof(#X) - 1})
+#define fstr_ulong(X)       &((fstr_value){.name=#X, .type=fstr_vt_ulong, .value.ul=X, .name_len=sizeof(#X) - 1})
+#define fstr_float(X)       &((fstr_value){.name=#X, .type=fstr_vt_float, .value.f=X, .name_len=sizeof(#X) - 1})
+#define fstr_double(X)      &((fstr_value){.name=#X, .type=fstr_vt_double, .value.d=X, .name_len=sizeof(#X) - 1})
 
 #define fstr_ncb(N, CB, DATA)   &((fstr_value){.name=N, .type=fstr_vt_cb, .value.cb=CB, .cb_data=DATA})
-#define fstr_cb(CB, DATA)      &((fstr_value){.name=#CB, .type=fstr_vt_cb, .value.cb=CB, .cb_data=DATA})
+#define fstr_cb(CB, DATA)      &((fstr_value){.name=#CB, .type=fstr_vt_cb, .value.cb=CB, .cb_data=DATA, .name_len=sizeof(#CB) - 1})
+#define fstr_nwcb(N, CB, DATA)  &((fstr_value){.name=N, .type=fstr_vt_wcb, .value.wcb=CB, .cb_data=DATA})
+#define fstr_wcb(CB, DATA)      &((fstr_value){.name=#CB, .type=fstr_vt_wcb, .value.wcb=CB, .cb_data=DATA, .name_len=sizeof(#CB) - 1})
+
+/**
+ * @brief Pass a fstr_table in a values list. See fstr_table_new().
+ */
+#define fstr_tbl(T)     &((fstr_value){.name="", .type=fstr_vt_table, .value.t=T})
 
 #define fstr_end        NULL
 
 
+/**
+ * @brief Build a hash indexed table from a values list.
+ * 
+ * @details
+ * Looking up a name in a values list compares it against every entry in turn, which is fine for
+ * a handful of values but slow for large lists. A table indexes the values by name so each lookup
+ * costs the same no matter how many values there are. The lookup rules are unchanged: names are
+ * case insensitive, the first matching entry wins, and a "*" entry matches any name not found
+ * before it in the list.
+ * 
+ * The table can be passed to any of the fstring functions with fstr_tbl(), either on its own or
+ * along with other values (which are searched in order, as usual).
+ * 
+ * @code
+ *  fstr_table *ctx = fstr_table_new(request_values);
+ *  bfstring(buffer, sizeof(buffer), "{method} {path} from {remote_addr}", fstr_tbl(ctx), fstr_end);
+ *  lbfstring(buffer, sizeof(buffer), "{user} {status}", fstr_values_cast {
+ *      fstr_int(status), fstr_tbl(ctx), fstr_end
+ *  });
+ *  fstr_table_free(ctx);
+ * @endcode
+ * 
+ * The fstr_value entries are copied, but the names and string values they point to are not, so
+ * those must remain valid for the life of the table.
+ * 
+ * @param[in] values A NULL terminated values list. Any fstr_tbl() entries are merged in.
+ * 
+ * @return The table, which must be released with fstr_table_free(), or NULL if out of memory.
+ */
+extern fstr_table *fstr_table_new(fstr_value *values[]);
+
+/**
+ * @brief Release a table returned by fstr_table_new().
+ */
+extern void fstr_table_free(fstr_table *table);
+
+
 /** int lbfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *values[]);
  * @brief Formatted string using supplied variables (similar to Python's fstrings)
  * 
@@ -165,16 +282,39 @@ typedef struct {
  *                   0 or a negative number then the contents of buffer is unspecified.
  * 
  *                   If the buffer is not large enough to fit the contents of the formatted
- *                   input string and variables, then the minimum size is returned as a negative
- *                   number. NOTE: This is what the function has calculated so far, and it may
- *                   need to be much bigger. Eg if you supply a 10 character buffer, and a 
- *                   format string that has many substitutions that expand to a much larger
- *                   space, then this function will probably return a number too small to begin
- *                   with.
+ *                   input string and variables, then the size needed (including the \0) is
+ *                   returned as a negative number, much like snprintf does. Allocating a
+ *                   buffer of that size and calling again will succeed. -1 is returned if the
+ *                   format string is invalid (an unterminated curly brace).
  * 
  *                   If you want a function that will always return a large enough buffer, look
  *                   a fstring, vstring or lstring, which return a malloc()'d buffer of sufficient
  *                   size.
+ * 
+ *  ## Format specs
+ * 
+ *  A placeholder can be followed by a colon and a Python style format spec, which controls how
+ *  the value is laid out:
+ * 
+ *      {name:[[fill]align][sign][#][0][width][grouping][.precision][type]}
+ * 
+ *  - align is < (left), > (right), ^ (centre) or = (padding after the sign), and fill is the
+ *    character to pad with (default space).
+ *  - sign is + (always show a sign), - (only for negative numbers, the default) or a space.
+ *  - # adds 0b, 0o or 0x for those types, and keeps the decimal point for floats.
+ *  - 0 pads numbers with zeros after the sign.
+ *  - grouping is , or _ to separate thousands (or groups of four hex digits with _).
+ *  - precision is the number of decimal places for f, e and %, the number of significant
+ *    digits for g, or the maximum number of characters for strings.
+ *  - type is d, b, o, x or X for integers, f, F, e, E, g, G or % for numbers, or s.
+ * 
+ *  Eg {pi:.3f} gives 3.142, {id:08x} gives 000000ff, {total:>12,} gives "   1,234,567".
+ *  If the text after the colon isn't a valid spec, the whole thing is treated as the name.
+ *  Compiled templates (fstr_compile) parse the specs once, when they are compiled.
+ * 
+ *  All of the fstring functions are reentrant and keep no shared state, so they can be called
+ *  from many threads at once without locking. Callbacks are called on the rendering thread, so
+ *  they need to be thread safe themselves if they are shared between threads.
  *                   
  *  There is a lot of syntactic sugar around these functions to make it easy to use. To the point
  *  where it is best not to worry about how it works underneath and just accept the world as it
@@ -258,9 +398,807 @@ extern int bfstring(char *buffer, size_t buffer_len, const char *format, fstr_va
 extern int vbfstring(char *buffer, size_t buffer_len, const char *format, va_list vl);
 
 
+/**
+ * @brief Versions of bfstring, vbfstring and lbfstring that return a malloc()'d string, which the caller must free().
+ *                  (Or if fstr_set_allocator() has been called, a string from that allocator.)
+ * 
+ * @details         The values are resolved once (so callbacks are only called once), the exact
+ *                  size of the result is worked out, and then the result is allocated and copied.
+ * 
+ * @return          The string, or NULL if the format is invalid or out of memory. There is no
+ *                  limit on the size, but to avoid holding very large output in memory at all,
+ *                  stream it with lsfstring().
+ */
 extern char *fstring(const char *format, fstr_value *, ...);
 extern char *vfstring(const char *format, va_list vl);
 extern char *lfstring(const char *format, fstr_value *values[]);
 
+/**
+ * @brief Where fstring() and friends get memory from. See fstr_set_allocator().
+ * 
+ * @details alloc returns size bytes (suitably aligned for any type) or NULL, free releases
+ *          memory from alloc (and may be given NULL). data is passed to both.
+ */
+typedef struct {
+    void *(*alloc)(void *data, size_t size);
+    void (*free)(void *data, void *ptr);
+    void *data;
+} fstr_allocator;
+
+/**
+ * @brief Set the allocator used by fstring, vfstring, lfstring and fstr_render_alloc.
+ * 
+ * @details The allocator is copied. Pass NULL to go back to malloc()/free(). Like
+ *          fstr_float_mode() this is a global setting, set it before rendering starts.
+ *          Strings from these functions can then be released with fstr_free().
+ */
+extern void fstr_set_allocator(const fstr_allocator *allocator);
+
+/**
+ * @brief Release a string returned by fstring() and friends, using the global allocator.
+ */
+extern void fstr_free(void *ptr);
+
+/**
+ * @brief Versions of fstring, vfstring and lfstring that allocate the result (and any temporary
+ *        memory) with the given allocator, instead of the global one.
+ */
+extern char *afstring(const fstr_allocator *allocator, const char *format, fstr_value *, ...);
+extern char *vafstring(const fstr_allocator *allocator, const char *format, va_list vl);
+extern char *lafstring(const fstr_allocator *allocator, const char *format, fstr_value *values[]);
+
+/**
+ * @brief A bump allocator, for lots of short lived strings that are all released together.
+ * 
+ * @details
+ * Memory is handed out from large chunks, and is only given back when the arena is reset,
+ * at which point everything allocated from it is released at once. fstr_free() does nothing.
+ * An arena must only be used by one thread at a time.
+ * 
+ * Each thread also has an arena of its own, which fstr_arena_allocator(NULL) allocates from.
+ * Setting that as the global allocator gives every thread its own arena without any locking:
+ * 
+ * @code
+ *  fstr_set_allocator(fstr_arena_allocator(NULL));
+ *  ...
+ *  void handle_request(request *req) 
+ *  {
+ *      char *line = fstring("{method} {path}", fstr_str(method), fstr_str(path), fstr_end);
+ *      ...
+ *      fstr_arena_reset(NULL); // Releases all of this thread's strings
+ *  }
+ * @endcode
+ */
+typedef struct fstr_arena fstr_arena;
+
+/**
+ * @brief Create an arena. chunk_size is how much is allocated at a time, 0 for the default (64KiB).
+ * 
+ * @return The arena, or NULL if out of memory.
+ */
+extern fstr_arena *fstr_arena_new(size_t chunk_size);
+
+/**
+ * @brief Release everything allocated from the arena (NULL for this thread's arena), keeping one chunk for reuse.
+ */
+extern void fstr_arena_reset(fstr_arena *arena);
+
+/**
+ * @brief Release an arena and everything allocated from it.
+ */
+extern void fstr_arena_free(fstr_arena *arena);
+
+/**
+ * @brief The calling thread's own arena, which is created when first used and released when the thread exits.
+ */
+extern fstr_arena *fstr_thread_arena(void);
+
+/**
+ * @brief An allocator that uses the arena, or if arena is NULL, the calling thread's arena.
+ * 
+ * @return The allocator, which is valid for as long as the arena is.
+ */
+extern const fstr_allocator *fstr_arena_allocator(fstr_arena *arena);
+
+/**
+ * @brief Choose how float and double values are formatted.
+ * 
+ * @details
+ * By default (FSTR_FLOAT_SHORTEST) numbers are printed the way Python prints them: with the
+ * fewest digits that still read back as exactly the same number, switching to exponent form
+ * for very large and small numbers. Eg 3.14159, 0.1, 2.0, 1e+16, 1e-05.
+ * 
+ * FSTR_FLOAT_FIXED gives exactly the same output as printf's "%f", ie always 6 decimal places
+ * (3.141590, 0.100000). Use this if you need output identical to older versions.
+ * 
+ * Neither depends on the locale (the decimal point is always a '.'). This is a global setting,
+ * so set it before rendering starts rather than while other threads are rendering.
+ * 
+ * @return The previous mode.
+ */
+extern int fstr_float_mode(int mode);
+
+/**
+ * @brief How format strings are scanned for placeholders. See fstr_scan_mode().
+ */
+#define FSTR_SCAN_AUTO          0
+#define FSTR_SCAN_SCALAR        1
+#define FSTR_SCAN_SSE2          2
+#define FSTR_SCAN_AVX2          3
+
+/**
+ * @brief Choose how format strings are scanned for placeholders.
+ * 
+ * @details
+ * Literal text is searched for the next '{' 16 (SSE2) or 32 (AVX2) bytes at a time, using the
+ * best the CPU supports, which is chosen automatically when the library is loaded. This is
+ * only needed for testing and benchmarking. If the CPU doesn't support the mode asked for,
+ * the next best one is used. Like fstr_float_mode(), this is a global setting.
+ * 
+ * @return The mode now in use.
+ */
+extern int fstr_scan_mode(int mode);
+
+/**
+ * @brief Work out the length of the string lbfstring would produce.
+ * 
+ * @return The length (excluding the \0), or -1 if the format is invalid.
+ */
+extern int fstr_measure(const char *format, fstr_value *values[]);
+
+/**
+ * @brief Format a single value, the way a placeholder with the given spec (the part after
+ *        the colon, eg ">10.3f") would show it. spec_len is 0 for no spec.
+ * 
+ * @details Like snprintf() the whole length is returned even if it doesn't fit, however the
+ *          value is only written (and \0 terminated) if it does.
+ * 
+ * @return The length of the formatted value, or -1 if the spec is invalid.
+ */
+extern int fstr_format_value(char *buffer, size_t buffer_len, const fstr_value *value, const char *spec, size_t spec_len);
+
+
+/**
+ * @brief The write function of a sink. Must write all len bytes of buffer.
+ * 
+ * @return 0 on success, or -1 on error.
+ */
+typedef int (*fstr_sink_write_t)(void *data, const char *buffer, size_t len);
+
+/**
+ * @brief Somewhere to stream output to, see lsfstring().
+ */
+typedef struct {
+    fstr_sink_write_t write;
+    void *data;
+} fstr_sink;
+
+/**
+ * @brief The write functions behind fstr_file_sink() and fstr_fd_sink().
+ */
+extern int fstr_sink_file_write(void *file, const char *buffer, size_t len);
+extern int fstr_sink_fd_write(void *fd, const char *buffer, size_t len);
+
+/**
+ * @brief Macros to make a sink that writes to a FILE *, a file descriptor, or a callback.
+ */
+#define fstr_file_sink(F)       &((fstr_sink){ .write = fstr_sink_file_write, .data = (F) })
+#define fstr_fd_sink(FD)        &((fstr_sink){ .write = fstr_sink_fd_write, .data = (void *)(intptr_t)(FD) })
+#define fstr_cb_sink(CB, D)     &((fstr_sink){ .write = (CB), .data = (D) })
+
+/**
+ * @brief Versions of lbfstring, bfstring and vbfstring that stream the output to a sink.
+ * 
+ * @details         The output is built up in a small fixed size staging buffer, which is passed
+ *                  to the sink's write function each time it fills up, and once more at the end.
+ *                  Values too large for the staging buffer are passed to the sink directly. So
+ *                  no matter how large the output is, memory use stays the same, and there is
+ *                  no limit on the size of the output.
+ * 
+ *                  No \0 is written.
+ * 
+ * @code
+ *  ffstring(stderr, "{prog}: cannot open {file}\n", fstr_str(prog), fstr_str(file), fstr_end);
+ *  dfstring(fd, "{count} records\n", fstr_int(count), fstr_end);
+ *  lsfstring(fstr_cb_sink(my_write, my_data), "{report}", values);
+ * @endcode
+ * 
+ * @return          The number of bytes written, or -1 if the format is invalid or the sink
+ *                  returned an error. Output rendered before an error may already have been
+ *                  written, and once the sink fails it is not called again.
+ */
+extern ssize_t lsfstring(fstr_sink *sink, const char *format, fstr_value *values[]);
+extern ssize_t sfstring(fstr_sink *sink, const char *format, fstr_value *, ...);
+extern ssize_t vsfstring(fstr_sink *sink, const char *format, va_list vl);
+
+/**
+ * @brief Versions of sfstring that write to a FILE * or a file descriptor, like fprintf and dprintf.
+ */
+extern ssize_t ffstring(FILE *file, const char *format, fstr_value *, ...);
+extern ssize_t dfstring(int fd, const char *format, fstr_value *, ...);
+
+
+/**
+ * @brief Render into an array of iovecs, ready for writev() or sendmsg(), without copying the strings.
+ * 
+ * @details         The iovec entries point straight at the literal text in the format and at
+ *                  string values, so large strings are never copied. Only numbers, callback
+ *                  results, padding and the like are written, into the scratch space. Adjacent
+ *                  pieces are joined into a single entry. No \0 is added.
+ * 
+ *                  The entries are only valid while the format, the string values and the
+ *                  scratch space are.
+ * 
+ * @code
+ *  struct iovec iov[16];
+ *  char scratch[256];
+ *  int n = lifstring(iov, 16, scratch, sizeof(scratch), "HTTP/1.1 200 OK\r\nContent-Length: {len}\r\n\r\n{body}", 
+ *                    fstr_values_cast { fstr_int(len), fstr_str(body), fstr_end });
+ *  if (n > 0) {
+ *      writev(fd, iov, n);
+ *  }
+ * @endcode
+ * 
+ * @param[out] iov          The iovec array to fill in.
+ * @param[in] iov_len       The number of entries in iov.
+ * @param[out] scratch      Space for text that has to be formatted (numbers, callbacks etc).
+ * @param[in] scratch_len   The size of scratch.
+ * 
+ * @return          The number of iovec entries used, -1 if the format is invalid, or -2 if there
+ *                  are not enough iovec entries or not enough scratch space.
+ */
+extern int lifstring(struct iovec *iov, int iov_len, char *scratch, size_t scratch_len, const char *format, fstr_value *values[]);
+
+
+/**
+ * @brief A pre-parsed format string. See fstr_compile().
+ */
+typedef struct fstr_template fstr_template;
+
+/**
+ * @brief Parse a format string once so it can be rendered many times.
+ * 
+ * @details
+ * lbfstring() and friends scan the format string every time they are called. When the same
+ * format is used over and over (log lines, metrics, etc) the format can instead be compiled
+ * once into its literal text and its {name} placeholders, and then rendered with fstr_render()
+ * or fstr_render_alloc(). The escaping and lookup rules are identical to lbfstring().
+ * 
+ * The format string is copied, so it does not need to outlive the template.
+ * 
+ * @code
+ *  fstr_template *tpl = fstr_compile("{host} {method} {path} took {ms}ms");
+ *  ...
+ *  fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast {
+ *      fstr_str(host), fstr_str(method), fstr_str(path), fstr_int(ms), fstr_end
+ *  });
+ *  ...
+ *  fstr_template_free(tpl);
+ * @endcode
+ * 
+ * @param[in] format The format string, as for lbfstring().
+ * 
+ * @return A template that must be released with fstr_template_free(), or NULL if the format
+ *         has an unterminated curly brace or memory could not be allocated.
+ */
+extern fstr_template *fstr_compile(const char *format);
+
+/**
+ * @brief Compile a template from a file, which is mapped into memory rather than read.
+ *
+ * @details
+ * For large templates (reports, pages etc) that live in files. The file is mmap()'d and only
+ * the placeholders are indexed, so the literal text is never copied: it stays in the page
+ * cache, is shared by every process using the same file, and is only read in as it is
+ * rendered. There is no limit on the size of the file, and the output can be streamed with
+ * fstr_render_sink() (or built with fstr_buf_render()) so it needn't fit anywhere either.
+ *
+ * The file must not be changed while the template is in use. The text ends at the first \0
+ * in the file, if it has one.
+ *
+ * @return A template that must be released with fstr_template_free(), or NULL if the file can't
+ *         be opened or mapped, it has an unterminated curly brace, or out of memory.
+ */
+extern fstr_template *fstr_compile_file(const char *path);
+
+/**
+ * @brief Release a template returned by fstr_compile() or fstr_compile_file().
+ */
+extern void fstr_template_free(fstr_template *tpl);
+
+/**
+ * @brief Render a compiled template into a buffer.
+ * 
+ * @return Identical to lbfstring(), except that when the buffer is too small the negative
+ *         number returned is always the full size required (including the \0).
+ */
+extern int fstr_render(char *buffer, size_t buffer_len, const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Render a compiled template into a malloc()'d string, which the caller must free().
+ * 
+ * @return The string, or NULL on error.
+ */
+extern char *fstr_render_alloc(const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Render a compiled template into a string from the given allocator.
+ */
+extern char *fstr_render_alloc_with(const fstr_allocator *allocator, const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Render a compiled template to a sink. See lsfstring().
+ * 
+ * @return The number of bytes written, or -1 if the sink returned an error.
+ */
+extern ssize_t fstr_render_sink(fstr_sink *sink, const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief A set of rows of values for fstr_render_batch().
+ * 
+ * @details values holds rows * columns values. Stored row by row (row major) the value for
+ *          a row and column is values[row * columns + column]. Stored column by column
+ *          (column_major set) it is values[column * rows + row]. The names of the columns
+ *          are taken from the first row, the names in the other rows are not looked at.
+ */
+typedef struct {
+    const fstr_value *values;
+    size_t rows;
+    size_t columns;
+    int column_major;
+} fstr_batch;
+
+/**
+ * @brief Render a compiled template once for every row of a batch, one after the other.
+ * 
+ * @details
+ * This is for rendering lots of records (CSV rows, log lines etc) with the same format. Each
+ * placeholder is matched to a column once, instead of searching for it in every row. A
+ * placeholder that isn't one of the columns is looked up in values, and is the same for
+ * every row (values can be NULL).
+ * 
+ * @code
+ *  fstr_value rows[][2] = {
+ *      { { .name = "host", .type = fstr_vt_str, .value.s = "alpha" }, { .name = "status", .type = fstr_vt_int, .value.i = 200 } },
+ *      { { .type = fstr_vt_str, .value.s = "beta" }, { .type = fstr_vt_int, .value.i = 404 } },
+ *  };
+ *  size_t offsets[3];
+ *  fstr_batch batch = { &rows[0][0], 2, 2, 0 };
+ *  fstr_template *tpl = fstr_compile("{host},{status},{when}\n");
+ *  len = fstr_render_batch(buffer, sizeof(buffer), offsets, tpl, &batch, fstr_values_cast { fstr_str(when), fstr_end });
+ *  // Gives "alpha,200,<when>\nbeta,404,<when>\n", and row i is buffer + offsets[i], offsets[i + 1] - offsets[i] long
+ * @endcode
+ * 
+ * @param[out] offsets  If not NULL, set to where each row starts in the output, plus one more
+ *                      entry for the end of the last row, so it needs rows + 1 entries.
+ * 
+ * @return As for fstr_render(), or -1 if out of memory.
+ */
+extern int fstr_render_batch(char *buffer, size_t buffer_len, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[]);
+
+/**
+ * @brief Render a batch to a sink, see fstr_render_batch() and lsfstring().
+ * 
+ * @return The number of bytes written, or -1 if out of memory or the sink returned an error.
+ */
+extern ssize_t fstr_render_batch_sink(fstr_sink *sink, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[]);
+
+/**
+ * @brief Render a compiled template into an array of iovecs. See lifstring().
+ * 
+ * @return The number of iovec entries used, or -2 if there are not enough entries or scratch space.
+ */
+extern int fstr_render_iov(struct iovec *iov, int iov_len, char *scratch, size_t scratch_len, const fstr_template *tpl, fstr_value *values[]);
+
+
+/**
+ * @brief A string builder, that renders are appended to.
+ * 
+ * @details
+ * Each append renders straight onto the end of the text, and when it runs out of room the
+ * buffer is made (at least) twice as big, so there is no limit on the size and no retrying.
+ * fstr_buf_reset() empties it but keeps the buffer, so a long lived worker can build every
+ * response in the same one:
+ * 
+ * @code
+ *  fstr_buf buf = FSTR_BUF_INIT;
+ *  
+ *  fstr_buf_append(&buf, "HTTP/1.1 {status} {reason}\r\n", fstr_int(status), fstr_str(reason), fstr_end);
+ *  for(i = 0; i < nheaders; i++) {
+ *      fstr_buf_render(&buf, header_tpl, headers[i]);
+ *  }
+ *  fstr_buf_write(&buf, "\r\n", 2);
+ *  write(fd, buf.data, buf.len);
+ *  fstr_buf_reset(&buf);
+ *  ...
+ *  fstr_buf_free(&buf);
+ * @endcode
+ * 
+ * A builder must only be used by one thread at a time.
+ */
+typedef struct {
+    char *data;                         /* The text, \0 terminated, or NULL if nothing has been added yet */
+    size_t len;                         /* The length of the text */
+    size_t size;                        /* How big data is */
+    const fstr_allocator *allocator;    /* What data is allocated with, NULL for malloc() */
+} fstr_buf;
+
+#define FSTR_BUF_INIT   { NULL, 0, 0, NULL }
+
+/**
+ * @brief Set up an empty builder, that allocates with allocator (NULL for malloc()).
+ */
+extern void fstr_buf_init(fstr_buf *buf, const fstr_allocator *allocator);
+
+/**
+ * @brief Append a render to the builder, as for bfstring(), vbfstring() and lbfstring().
+ * 
+ * @return The length appended, or -1 if the format is invalid or out of memory, in which case
+ *         the text is left as it was.
+ */
+extern ssize_t fstr_buf_append(fstr_buf *buf, const char *format, fstr_value *, ...);
+extern ssize_t fstr_buf_vappend(fstr_buf *buf, const char *format, va_list vl);
+extern ssize_t fstr_buf_lappend(fstr_buf *buf, const char *format, fstr_value *values[]);
+
+/**
+ * @brief Append a render of a compiled template to the builder. See fstr_buf_append().
+ */
+extern ssize_t fstr_buf_render(fstr_buf *buf, const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Append len characters of text to the builder. See fstr_buf_append().
+ */
+extern ssize_t fstr_buf_write(fstr_buf *buf, const char *text, size_t len);
+
+/**
+ * @brief Make sure there is room to append len more characters without growing.
+ * 
+ * @return 0, or -1 if out of memory.
+ */
+extern int fstr_buf_reserve(fstr_buf *buf, size_t len);
+
+/**
+ * @brief Empty the builder, keeping its buffer to reuse.
+ */
+extern void fstr_buf_reset(fstr_buf *buf);
+
+/**
+ * @brief Release the builder's buffer, leaving it empty.
+ */
+extern void fstr_buf_free(fstr_buf *buf);
+
+/**
+ * @brief Render a batch (see fstr_render_batch()) on several threads, appending it to a fstr_buf.
+ * 
+ * @details
+ * The rows are split into chunks which are shared out between the threads, and a thread that
+ * runs out of chunks takes some of another's. Each chunk is rendered into a buffer of its own
+ * and they are appended in order, so the output is the same as fstr_render_batch() gives.
+ * The calling thread is one of the threads. Callbacks in the values must be thread safe.
+ * 
+ * @param[out] offsets  As for fstr_render_batch(), but relative to where the batch starts in buf.
+ * @param threads       How many threads to use, or 0 for one per CPU.
+ * 
+ * @return The length appended, or -1 if out of memory (in which case buf is left as it was).
+ */
+extern ssize_t fstr_render_batch_parallel(fstr_buf *buf, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[], int threads);
+
+/**
+ * @brief Render a batch on several threads to a sink, see fstr_render_batch_parallel().
+ * 
+ * @details The sink is only called by the calling thread, and gets the rows in order.
+ * 
+ * @return The number of bytes written, or -1 if out of memory or the sink returned an error.
+ */
+extern ssize_t fstr_render_batch_parallel_sink(fstr_sink *sink, size_t *offsets, const fstr_template *tpl, 
+        const fstr_batch *batch, fstr_value *values[], int threads);
+
+/**
+ * @brief A compiled template bound to its values, that keeps its text and re-renders only what changed.
+ * See fstr_view_new().
+ */
+typedef struct fstr_view fstr_view;
+
+/**
+ * @brief A run of bytes in a view's text that changed, see fstr_view_render().
+ */
+typedef struct {
+    size_t offset;
+    size_t len;
+} fstr_range;
+
+/**
+ * @brief Render a template once and keep the text, so it can be brought up to date cheaply.
+ *
+ * @details
+ * This is for status lines, dashboards and the like, which are rendered over and over when
+ * only a counter or a timestamp has changed. Each placeholder is looked up in values once.
+ * Give the view new values with fstr_view_set(), or if a value's data has changed behind it
+ * (a string buffer, or what a callback returns) say so with fstr_view_mark().
+ * fstr_view_render() then renders just the placeholders using those values, splices them
+ * into the text and says which bytes are different:
+ *
+ * @code
+ *  fstr_view *view = fstr_view_new(tpl, fstr_values_cast { fstr_int(done), fstr_str(eta), fstr_end });
+ *  fstr_range ranges[4];
+ *  ...
+ *  fstr_view_set(view, fstr_int(done));
+ *  n = fstr_view_render(view, ranges, 4);
+ *  text = fstr_view_text(view, &len);
+ *  for(i = 0; i < n; i++) {
+ *      redraw(ranges[i].offset, text + ranges[i].offset, ranges[i].len);
+ *  }
+ * @endcode
+ *
+ * The template, and the values (apart from ones given to fstr_view_set(), which are copied)
+ * must stay around until the view is freed. Callbacks are only called again when their value
+ * is marked. A view must only be used by one thread at a time.
+ *
+ * @return The view, which must be released with fstr_view_free(), or NULL if out of memory.
+ */
+extern fstr_view *fstr_view_new(const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Give a view a new value, for every placeholder with the value's name.
+ *
+ * @details The value is copied, but not what it points to, so a string must stay around until
+ *          the view is given another value for it (or freed).
+ *
+ * @return The number of placeholders using the value, which are rendered again by the next
+ *         fstr_view_render().
+ */
+extern int fstr_view_set(fstr_view *view, const fstr_value *value);
+
+/**
+ * @brief Say that a value has changed, so the placeholders using it are rendered again.
+ *
+ * @param[in] value     A value from the list the view was made with (or from a table in it), or
+ *                      NULL to look every placeholder up again and render all of them.
+ *
+ * @return The number of placeholders marked.
+ */
+extern int fstr_view_mark(fstr_view *view, const fstr_value *value);
+
+/**
+ * @brief Re-render the placeholders whose values were marked, and find which bytes of the text changed.
+ *
+ * @details
+ * A placeholder that comes out the same length only reports the bytes that are different. One
+ * that changes length moves everything after it, so the range runs on until the text lines up
+ * again (often the end). Ranges are in order, don't touch, and are within the new text; if it
+ * got shorter the bytes from the new length to the old one are gone as well.
+ *
+ * @param[out] ranges       Set to the ranges that changed, can be NULL.
+ * @param[in] max_ranges    How many ranges fit. If there are more, the last one is stretched
+ *                          to cover the rest.
+ *
+ * @return The number of ranges, or -1 if out of memory, in which case the text is left as
+ *         it was and the values are still marked.
+ */
+extern int fstr_view_render(fstr_view *view, fstr_range *ranges, int max_ranges);
+
+/**
+ * @brief Get a view's text, which is \0 terminated and stays valid until the next fstr_view_render().
+ *
+ * @param[out] len      If not NULL, set to the length of the text.
+ */
+extern const char *fstr_view_text(const fstr_view *view, size_t *len);
+
+/**
+ * @brief Release a view returned by fstr_view_new().
+ */
+extern void fstr_view_free(fstr_view *view);
+
+/**
+ * @brief What fstr_log() does when the logger has fallen behind and a thread's ring is full.
+ *
+ * FSTR_LOG_BLOCK waits for room, FSTR_LOG_DROP drops the line, and FSTR_LOG_COUNT drops it
+ * and then writes a line saying how many were dropped once there is room again.
+ */
+#define FSTR_LOG_BLOCK      0
+#define FSTR_LOG_DROP       1
+#define FSTR_LOG_COUNT      2
+
+/**
+ * @brief A logger that renders on a thread of its own. See fstr_logger_new().
+ */
+typedef struct fstr_logger fstr_logger;
+
+/**
+ * @brief Start a logger, whose thread renders lines passed to fstr_log() and writes them to a sink.
+ *
+ * @details
+ * fstr_log() doesn't render anything. It copies the template pointer and the values into
+ * a ring buffer that belongs to the calling thread, which only that thread writes to and
+ * only the logger's thread reads from, so there are no locks. Strings are copied, and
+ * callbacks are called straight away (with the value's name, so a "*" callback gets "*").
+ * The logger's thread renders whatever it finds in the rings, and passes everything it
+ * rendered to the sink in one write.
+ *
+ * @code
+ *  fstr_logger *log = fstr_logger_new(fstr_fd_sink(fd), 0, FSTR_LOG_BLOCK);
+ *  fstr_template *request = fstr_compile("{method} {path} {status} {ms:.3f}ms\n");
+ *  ...
+ *  fstr_log(log, request, fstr_str(method), fstr_str(path), fstr_int(status), fstr_double(ms), fstr_end);
+ *  ...
+ *  fstr_logger_free(log);
+ * @endcode
+ *
+ * Templates must stay around until the lines using them have been written, see
+ * fstr_logger_flush(). The sink is only called from the logger's thread.
+ *
+ * @param[in] sink          Where to write to, which is copied.
+ * @param[in] ring_size     How many bytes of lines each thread can have waiting (rounded up to a
+ *                          power of 2), or 0 for 64KB.
+ * @param[in] policy        FSTR_LOG_BLOCK, FSTR_LOG_DROP or FSTR_LOG_COUNT.
+ *
+ * @return The logger, which must be released with fstr_logger_free(), or NULL if out of memory
+ *         or the thread couldn't be started.
+ */
+extern fstr_logger *fstr_logger_new(fstr_sink *sink, size_t ring_size, int policy);
+
+/**
+ * @brief Log a line, to be rendered with a template by the logger's thread.
+ *
+ * @return 0, or -1 if the line was dropped (the ring was full, or the line is more than half
+ *         the size of the ring) or out of memory.
+ */
+extern int fstr_log(fstr_logger *logger, const fstr_template *tpl, fstr_value *, ...);
+extern int fstr_llog(fstr_logger *logger, const fstr_template *tpl, fstr_value *values[]);
+
+/**
+ * @brief Wait until everything logged before the call has been written.
+ *
+ * @return 0, or -1 if the sink has returned an error.
+ */
+extern int fstr_logger_flush(fstr_logger *logger);
+
+/**
+ * @brief How many lines have been dropped, by every thread.
+ */
+extern unsigned long fstr_logger_dropped(fstr_logger *logger);
+
+/**
+ * @brief Write everything that has been logged, stop the logger's thread and release it.
+ *
+ * @details No thread may log to it during or after this.
+ */
+extern void fstr_logger_free(fstr_logger *logger);
+
+/**
+ * @brief Turn on (or off) caching of compiled templates for lbfstring(), fstring() and friends.
+ * 
+ * @details
+ * With the cache on, the first time a format string is used it is compiled (see
+ * fstr_compile()) and the template is kept, so later calls with the same format skip
+ * parsing it. Formats are looked up by their address, so this suits formats that are
+ * string literals. So that a buffer that is reused for a different format is still rendered
+ * correctly, the format is also compared byte for byte with the copy kept in the cache, which
+ * costs about as much as copying the format's text into the result once more.
+ * 
+ * The cache holds at most max_entries templates (rounded up to a power of 2). Each format
+ * has one place it can go, and a new format replaces what was there. Lookups don't take a
+ * lock, so it can be used from many threads at once, however turning it on, off or
+ * resizing it must happen while no other threads are rendering.
+ * 
+ * @param max_entries   The size of the cache, or 0 to turn it off (and free it).
+ * 
+ * @return 0, or -1 if out of memory.
+ */
+extern int fstr_cache_enable(size_t max_entries);
+
+/**
+ * @brief Template cache counters, see fstr_cache_stats().
+ */
+typedef struct {
+    unsigned long hits;         /* Renders that used a cached template */
+    unsigned long misses;       /* Renders that had to compile the format */
+    unsigned long evictions;    /* Templates replaced by another format */
+    unsigned long entries;      /* Templates in the cache now */
+    unsigned long size;         /* The number of places in the cache */
+} fstr_cache_info;
+
+/**
+ * @brief Get the template cache counters. hits, misses and evictions count from when the program started.
+ * 
+ * @details
+ * This takes the same lock as fstr_cache_enable(), so it can be called while the cache is
+ * turned on, off or resized. The counters are read without stopping other threads, so they
+ * may be a few counts behind.
+ */
+extern void fstr_cache_stats(fstr_cache_info *info);
+
+/**
+ * @brief Library counters, see fstr_stats().
+ */
+typedef struct {
+    unsigned long renders;      /* Formats and templates rendered (each row of a batch is one) */
+    unsigned long bytes;        /* Output produced, including any that didn't fit */
+    unsigned long hits;         /* Placeholders that had a value */
+    unsigned long misses;       /* Placeholders output as "{name}", as there was no value (or it failed) */
+    unsigned long wildcards;    /* Hits that were a "*" value */
+    unsigned long resizes;      /* Times the output had to be made bigger, or a write callback called again */
+    unsigned long allocs;       /* Memory allocated by the library */
+    unsigned long callbacks;    /* Callbacks and write callbacks called */
+    unsigned long callback_ns;  /* Time spent in callbacks, in nanoseconds */
+} fstr_stats_info;
+
+/**
+ * @brief Counters for one format, see fstr_stats_top().
+ */
+typedef struct {
+    const char *format;         /* A copy of the format, or NULL for the formats that didn't fit in the table */
+    unsigned long renders;
+    unsigned long bytes;
+    unsigned long ns;           /* Time spent rendering it */
+} fstr_format_stats;
+
+/**
+ * @brief A function called after each render, see fstr_stats_hook().
+ * 
+ * @param format    The format, or the format a template was compiled from
+ * @param len       The length of the output (including any that didn't fit)
+ * @param ns        How long it took, in nanoseconds
+ */
+typedef void (*fstr_stats_hook_t)(void *data, const char *format, size_t len, unsigned long ns);
+
+/**
+ * @brief Get the library's counters, added up over all threads.
+ * 
+ * @details
+ * Counting is only built in if the library is compiled with -DFSTR_STATS (eg make STATS=1),
+ * otherwise none of it costs anything. Each thread has its own counters, which only it
+ * writes, so counting needs no locked instructions; this just adds them up, so a snapshot
+ * taken while other threads are rendering may be a few counts behind.
+ * 
+ * @return 0, or -1 if the library wasn't built with FSTR_STATS (and info is all 0).
+ */
+extern int fstr_stats(fstr_stats_info *info);
+
+/**
+ * @brief Start the counters (and per-format counters) again from 0.
+ */
+extern void fstr_stats_reset(void);
+
+/**
+ * @brief Turn on (or off) counting by format, for fstr_stats_top().
+ * 
+ * @details
+ * Formats are told apart by their address, and templates by the address of the format they
+ * were compiled from (so a cached format and its template are the same). The first
+ * max_formats formats seen are counted separately, and any more are counted together.
+ * Unlike the other counters these are shared by all threads, and each render is also timed,
+ * so this costs more. As with fstr_cache_enable(), it must be turned on, off or resized
+ * while no other threads are rendering.
+ * 
+ * @param max_formats   How many formats to count, or 0 to turn it off.
+ * 
+ * @return 0, -1 if out of memory or the library wasn't built with FSTR_STATS.
+ */
+extern int fstr_stats_formats(size_t max_formats);
+
+/**
+ * @brief Get the most rendered formats, most rendered first.
+ * 
+ * @details The format text stays valid until counting by format is turned off or resized.
+ * 
+ * @return How many were put in formats.
+ */
+extern size_t fstr_stats_top(fstr_format_stats *formats, size_t max);
+
+/**
+ * @brief Set a function to be called after every render (with FSTR_STATS), or NULL for none.
+ * 
+ * @details The hook is called by the thread that rendered, so it must be thread safe, and it
+ *          should be set while no other threads are rendering.
+ */
+extern void fstr_stats_hook(fstr_stats_hook_t hook, void *data);
+
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,648 @@
+/*
+ * Copyright Nick Clifford, 2021
+ *
+ * Nick Clifford (nick@crypto.geek.nz)
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#ifndef include_fstring_hpp
+#define include_fstring_hpp
+
+/**
+ * @brief C++20 interface to fstring.
+ *
+ * @details
+ * The format is a template argument and the values are named arguments, so the format is
+ * parsed by the compiler, and each placeholder is bound to its argument (by name, case
+ * insensitively, as in C) when the program is compiled. A placeholder with no argument (which
+ * includes one with a bad format spec, as C takes that to be part of the name), two arguments
+ * with the same name or an unterminated '{' is a compile error.
+ * Each call gets its own render function: literal text is copied, strings and integers are
+ * written directly and everything else (and anything with a format spec) is formatted by
+ * fstr_format_value(), so the output is exactly the same as the C functions give.
+ *
+ * @code
+ *  using namespace fstr::literals;
+ *
+ *  std::string s = fstr::format<"{method} {path} took {ms:.3f}ms">("method"_a = method, "path"_a = path, "ms"_a = ms);
+ *  size_t len = fstr::format_to<"{n:>8}">(buffer, sizeof(buffer), "n"_a = 42);
+ *  fstr::append<"{k}={v}\n">(buf, "k"_a = key, "v"_a = value);     // Onto a fstr_buf
+ *
+ *  // And the other way, a fstr_value list for the C functions
+ *  auto list = fstr::values("method"_a = method, "status"_a = 200);
+ *  lbfstring(buffer, sizeof(buffer), "{method} {status}", list);
+ * @endcode
+ *
+ * Arguments can be strings (const char *, std::string, std::string_view), integers, floats,
+ * doubles, or a fstr_value (or pointer to one) for anything else the C library supports, such
+ * as callbacks. Class type arguments are referred to rather than copied, so they must outlive
+ * the call (or the list from fstr::values()).
+ */
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "fstring.h"
+
+namespace fstr {
+
+/**
+ * @brief A string literal that can be used as a template argument, for formats and names.
+ */
+template <size_t N>
+struct fixed_string {
+    char data[N] = {};
+
+    consteval fixed_string(const char (&s)[N])
+    {
+        for(size_t i = 0; i < N; i++) {
+            data[i] = s[i];
+        }
+    }
+
+    constexpr std::string_view view() const
+    {
+        return std::string_view(data, N - 1);
+    }
+};
+
+/**
+ * @brief A named argument, made with "name"_a = value or fstr::arg<"name"> = value.
+ */
+template <fixed_string Name, class T>
+struct named {
+    static constexpr auto name = Name;
+    using type = T;
+
+    std::conditional_t<std::is_class_v<T>, const T &, T> value;
+};
+
+template <fixed_string Name>
+struct arg_t {
+    template <class T>
+    constexpr named<Name, std::decay_t<const T>> operator=(const T &value) const
+    {
+        return named<Name, std::decay_t<const T>>{ value };
+    }
+};
+
+template <fixed_string Name>
+inline constexpr arg_t<Name> arg{};
+
+inline namespace literals {
+template <fixed_string Name>
+constexpr arg_t<Name> operator""_a()
+{
+    return {};
+}
+}
+
+
+namespace detail {
+
+/*
+ * These are never defined. Calling one while parsing a format stops the compile, with
+ * the reason in the error.
+ */
+void unknown_placeholder();
+void duplicate_argument_name();
+void unterminated_placeholder();
+
+template <class T>
+struct is_named : std::false_type {};
+
+template <fixed_string Name, class T>
+struct is_named<named<Name, T>> : std::true_type {};
+
+constexpr char fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+constexpr bool name_equal(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for(size_t i = 0; i < a.size(); i++) {
+        if (fold(a[i]) != fold(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The same as fstr_name_hash() */
+constexpr uint32_t name_hash(std::string_view name)
+{
+    uint32_t h = 2166136261u;
+
+    for(char c : name) {
+        h = (h ^ (uint32_t)(unsigned char)fold(c)) * 16777619u;
+    }
+    return h;
+}
+
+constexpr size_t utf8_len(unsigned char c)
+{
+    return (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+}
+
+constexpr bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * @brief Check a format spec the same way fstring.c's _parse_spec() does, getting its width.
+ */
+constexpr bool parse_spec(std::string_view sp, int &width)
+{
+    constexpr std::string_view aligns = "<>^=", types = "sbdoxXeEfFgG%";
+    size_t i = 0, n = sp.size(), cl;
+    int precision = 0;
+
+    width = 0;
+    if (n > 0) {
+        cl = utf8_len(sp[0]);
+        if (cl < n && sp[cl] != 0 && aligns.find(sp[cl]) != std::string_view::npos) {
+            i = cl + 1;
+        } else if (aligns.find(sp[0]) != std::string_view::npos) {
+            i = 1;
+        }
+    }
+    if (i < n && (sp[i] == '+' || sp[i] == '-' || sp[i] == ' ')) {
+        i++;
+    }
+    if (i < n && sp[i] == '#') {
+        i++;
+    }
+    if (i < n && sp[i] == '0') {
+        i++;
+    }
+    while(i < n && is_digit(sp[i])) {
+        width = width * 10 + sp[i++] - '0';
+        if (width > 9999) {
+            return false;
+        }
+    }
+    if (i < n && (sp[i] == ',' || sp[i] == '_')) {
+        i++;
+    }
+    if (i < n && sp[i] == '.') {
+        if (++i == n || !is_digit(sp[i])) {
+            return false;
+        }
+        while(i < n && is_digit(sp[i])) {
+            precision = precision * 10 + sp[i++] - '0';
+            if (precision > 100) {
+                return false;
+            }
+        }
+    }
+    if (i < n && sp[i] != 0 && types.find(sp[i]) != std::string_view::npos) {
+        i++;
+    }
+    return i == n;
+}
+
+/**
+ * @brief A piece of a parsed format.
+ */
+struct segment {
+    size_t text_pos;        /* Literal text, or the spec of a placeholder */
+    size_t text_len;
+    int arg;                /* The argument for a placeholder, or -1 for literal text */
+    int width;              /* The width from the spec */
+    bool has_spec;
+};
+
+/**
+ * @brief Split a format into segments, the same way fstring.c does, binding each placeholder to an argument
+ *
+ * @param segments  Where to put the segments, or nullptr to just count them
+ * @return The number of segments.
+ */
+template <size_t N>
+consteval size_t parse(std::string_view fmt, const std::array<std::string_view, N> &names, segment *segments)
+{
+    size_t count = 0, pos = 0, start = 0, end, colon, arg;
+    std::string_view inner, name;
+    int width = 0;
+    bool has_spec;
+
+    for(size_t i = 0; i < N; i++) {
+        for(size_t j = i + 1; j < N; j++) {
+            if (name_equal(names[i], names[j])) {
+                duplicate_argument_name();
+            }
+        }
+    }
+    auto literal = [&](size_t from, size_t to) {
+        if (segments) {
+            segments[count] = segment{ from, to - from, -1, 0, false };
+        }
+        count++;
+    };
+    while(pos < fmt.size()) {
+        if (fmt[pos] != '{') {
+            pos++;
+            continue;
+        }
+        if (pos + 1 < fmt.size() && fmt[pos + 1] == '{') {
+            literal(start, pos + 1);
+            pos += 2;
+            start = pos;
+            continue;
+        }
+        if (pos != start) {
+            literal(start, pos);
+        }
+        end = fmt.find('}', pos + 1);
+        if (end == std::string_view::npos) {
+            unterminated_placeholder();
+        }
+        inner = fmt.substr(pos + 1, end - pos - 1);
+        colon = inner.find(':');
+        has_spec = colon != std::string_view::npos && parse_spec(inner.substr(colon + 1), width);
+        name = has_spec ? inner.substr(0, colon) : inner;
+        for(arg = 0; arg < N && !name_equal(names[arg], name) && names[arg] != "*"; arg++) {
+        }
+        if (arg == N) {
+            unknown_placeholder();
+        }
+        if (segments) {
+            segments[count] = has_spec ? segment{ pos + 2 + colon, end - pos - 2 - colon, (int)arg, width, true }
+                                       : segment{ 0, 0, (int)arg, 0, false };
+        }
+        count++;
+        pos = start = end + 1;
+    }
+    if (start != pos) {
+        literal(start, pos);
+    }
+    return count;
+}
+
+/**
+ * @brief A format parsed for a particular set of argument names.
+ */
+template <fixed_string Fmt, fixed_string... Names>
+struct compiled {
+    static constexpr const char *text = Fmt.data;
+    static constexpr std::array<std::string_view, sizeof...(Names)> names = { Names.view()... };
+    static constexpr size_t count = parse(Fmt.view(), names, nullptr);
+    static constexpr std::array<segment, count> segments = []() consteval {
+        std::array<segment, count> s{};
+        parse(Fmt.view(), names, s.data());
+        return s;
+    }();
+};
+
+/* The kinds of argument */
+template <class T>
+inline constexpr bool is_cstr = std::is_same_v<T, const char *> || std::is_same_v<T, char *>;
+
+template <class T>
+inline constexpr bool is_sv = std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>;
+
+template <class T>
+inline constexpr bool is_int = std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>;
+
+template <class T>
+inline constexpr bool is_cvalue = std::is_same_v<T, fstr_value> || std::is_same_v<T, fstr_value *> ||
+                                  std::is_same_v<T, const fstr_value *>;
+
+/**
+ * @brief Make the C value for an argument.
+ */
+template <fixed_string Name, class T>
+fstr_value make_value(const T &v)
+{
+    constexpr uint32_t hash = name_hash(Name.view()), len = Name.view().size();
+
+    static_assert(is_cstr<T> || is_sv<T> || is_int<T> || std::is_floating_point_v<T> || is_cvalue<T>,
+                  "fstr: arguments must be strings, integers, floating point or a fstr_value");
+    if constexpr (is_cvalue<T>) {
+        /* The value goes by the argument's name, not its own */
+        fstr_value val = [&]() -> const fstr_value & {
+            if constexpr (std::is_pointer_v<T>) {
+                return *v;
+            } else {
+                return v;
+            }
+        }();
+        val.name = Name.data;
+        val.name_hashed = 1;
+        val.name_hash = hash;
+        val.name_len = len;
+        return val;
+    } else if constexpr (is_cstr<T>) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_str, .name_hashed = 1, .value = { .s = v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else if constexpr (is_sv<T>) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_strn, .name_hashed = 1, .value = { .sn = { v.data(), v.size() } },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else if constexpr (std::is_same_v<T, float>) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_float, .name_hashed = 1, .value = { .f = v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_double, .name_hashed = 1, .value = { .d = (double)v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else if constexpr (sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && std::is_signed_v<T>)) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_int, .name_hashed = 1, .value = { .i = (int)v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else if constexpr (std::is_unsigned_v<T> && sizeof(T) >= sizeof(long)) {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_ulong, .name_hashed = 1, .value = { .ul = (unsigned long)v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    } else {
+        return fstr_value{ .name = Name.data, .type = fstr_vt_long, .name_hashed = 1, .value = { .l = (long)v },
+                           .cb_data = nullptr, .name_hash = hash, .name_len = len };
+    }
+}
+
+/**
+ * @brief Where the output goes. Like a buffer in fstring.c, the length keeps being counted when it runs out.
+ *
+ * Once a piece doesn't fit (with room for a \0 after it) nothing more is written, so the output
+ * is everything up to written.
+ */
+struct output {
+    char *buffer;
+    size_t buffer_len;
+    size_t pos;
+    size_t written;
+
+    void put(const char *text, size_t len)
+    {
+        if (pos == written && pos + len < buffer_len) {
+            memcpy(buffer + pos, text, len);
+            written += len;
+        }
+        pos += len;
+    }
+
+    void value(const fstr_value &val, const char *spec, size_t spec_len)
+    {
+        int r;
+
+        if (pos == written && pos < buffer_len) {
+            r = fstr_format_value(buffer + pos, buffer_len - pos, &val, spec, spec_len);
+            if (r > 0 && pos + r < buffer_len) {
+                written += r;
+            }
+        } else {
+            r = fstr_format_value(nullptr, 0, &val, spec, spec_len);
+        }
+        pos += r > 0 ? r : 0;
+    }
+};
+
+/**
+ * @brief Output one argument. A value is only written if there's room for it and a \0.
+ */
+template <class A>
+inline void put_arg(output &out, const A &a, const segment &seg, const char *text)
+{
+    using T = typename A::type;
+
+    if (seg.has_spec) {
+        out.value(make_value<A::name>(a.value), text + seg.text_pos, seg.text_len);
+    } else if constexpr (is_cstr<T>) {
+        out.put(a.value, strlen(a.value));
+    } else if constexpr (is_sv<T>) {
+        out.put(a.value.data(), a.value.size());
+    } else if constexpr (is_int<T>) {
+        char tmp[24];
+        out.put(tmp, std::to_chars(tmp, tmp + sizeof(tmp), a.value).ptr - tmp);
+    } else {
+        out.value(make_value<A::name>(a.value), nullptr, 0);
+    }
+}
+
+/**
+ * @brief A guess at how long an argument will be, which is exact for strings without a spec.
+ */
+template <class A>
+inline size_t arg_len(const A &a, const segment &seg)
+{
+    using T = typename A::type;
+    size_t len;
+
+    if constexpr (is_cstr<T>) {
+        len = strlen(a.value);
+    } else if constexpr (is_sv<T>) {
+        len = a.value.size();
+    } else {
+        len = 24;
+    }
+    return std::max(len, (size_t)seg.width);
+}
+
+template <class C, size_t I, class Tuple>
+inline void render_segment(output &out, const Tuple &args)
+{
+    constexpr segment seg = C::segments[I];
+
+    if constexpr (seg.arg < 0) {
+        out.put(C::text + seg.text_pos, seg.text_len);
+    } else {
+        put_arg(out, std::get<C::segments[I].arg>(args), seg, C::text);
+    }
+}
+
+template <class C, size_t I, class Tuple>
+inline size_t segment_len(const Tuple &args)
+{
+    constexpr segment seg = C::segments[I];
+
+    if constexpr (seg.arg < 0) {
+        return seg.text_len;
+    } else {
+        return arg_len(std::get<C::segments[I].arg>(args), seg);
+    }
+}
+
+template <class C, class Tuple, size_t... I>
+inline void render(output &out, const Tuple &args, std::index_sequence<I...>)
+{
+    (render_segment<C, I>(out, args), ...);
+}
+
+template <class C, class Tuple, size_t... I>
+inline size_t guess_len(const Tuple &args, std::index_sequence<I...>)
+{
+    return (0 + ... + segment_len<C, I>(args));
+}
+
+/**
+ * @brief Render into buffer, and if it doesn't fit make it bigger and render again.
+ *
+ * @param grow  Called with the size needed to get a new buffer, or nullptr if out of memory
+ * @return The length of the output.
+ */
+template <class C, class Tuple, class Grow>
+inline size_t render_grow(char *buffer, size_t buffer_len, const Tuple &args, Grow grow)
+{
+    output out{ buffer, buffer_len, 0, 0 };
+
+    render<C>(out, args, std::make_index_sequence<C::count>());
+    if (out.pos >= buffer_len && (buffer = grow(out.pos + 1)) != nullptr) {
+        out = output{ buffer, out.pos + 1, 0, 0 };
+        render<C>(out, args, std::make_index_sequence<C::count>());
+    }
+    return out.pos;
+}
+
+} // namespace detail
+
+
+/**
+ * @brief Render into a buffer, like snprintf(), with the output \0 terminated.
+ *
+ * @return The length of the output, which if it's buffer_len or more means it didn't fit (in
+ *         which case the output stops before the first piece that didn't fit, rather than
+ *         cutting it short).
+ */
+template <fixed_string Fmt, class... Args>
+size_t format_to(char *buffer, size_t buffer_len, const Args &... args)
+{
+    using C = detail::compiled<Fmt, Args::name...>;
+    static_assert((detail::is_named<Args>::value && ...), "fstr: arguments must be named, eg \"name\"_a = value");
+    detail::output out{ buffer, buffer_len, 0, 0 };
+
+    detail::render<C>(out, std::tie(args...), std::make_index_sequence<C::count>());
+    if (buffer_len > 0) {
+        buffer[out.written] = 0;
+    }
+    return out.pos;
+}
+
+/**
+ * @brief Work out the length of the output, without rendering it anywhere.
+ */
+template <fixed_string Fmt, class... Args>
+size_t formatted_size(const Args &... args)
+{
+    return format_to<Fmt>(nullptr, 0, args...);
+}
+
+/**
+ * @brief Render to a std::string, sized from the arguments so it is normally rendered once.
+ */
+template <fixed_string Fmt, class... Args>
+std::string format(const Args &... args)
+{
+    using C = detail::compiled<Fmt, Args::name...>;
+    static_assert((detail::is_named<Args>::value && ...), "fstr: arguments must be named, eg \"name\"_a = value");
+    auto tied = std::tie(args...);
+    std::string s(detail::guess_len<C>(tied, std::make_index_sequence<C::count>()) + 1, '\0');
+    size_t len;
+
+    len = detail::render_grow<C>(s.data(), s.size(), tied, [&](size_t size) {
+        s.resize(size);
+        return s.data();
+    });
+    s.resize(len);
+    return s;
+}
+
+/**
+ * @brief Append a render to a fstr_buf (see fstr_buf_append()).
+ *
+ * @return The length appended, or -1 if out of memory.
+ */
+template <fixed_string Fmt, class... Args>
+ssize_t append(fstr_buf &buf, const Args &... args)
+{
+    using C = detail::compiled<Fmt, Args::name...>;
+    static_assert((detail::is_named<Args>::value && ...), "fstr: arguments must be named, eg \"name\"_a = value");
+    auto tied = std::tie(args...);
+    bool failed = false;
+    size_t len;
+
+    if (fstr_buf_reserve(&buf, detail::guess_len<C>(tied, std::make_index_sequence<C::count>())) < 0) {
+        return -1;
+    }
+    len = detail::render_grow<C>(buf.data + buf.len, buf.size - buf.len, tied, [&](size_t size) -> char * {
+        failed = fstr_buf_reserve(&buf, size) < 0;
+        return failed ? nullptr : buf.data + buf.len;
+    });
+    if (failed) {
+        buf.data[buf.len] = 0;
+        return -1;
+    }
+    buf.len += len;
+    buf.data[buf.len] = 0;
+    return len;
+}
+
+/**
+ * @brief A fstr_value list made from named arguments, to pass to the C functions. See fstr::values().
+ */
+template <size_t N>
+class value_list {
+public:
+    template <class... Args>
+    explicit value_list(const Args &... args) : values_{ detail::make_value<Args::name>(args.value)... }
+    {
+        for(size_t i = 0; i < N; i++) {
+            list_[i] = &values_[i];
+        }
+        list_[N] = fstr_end;
+    }
+
+    value_list(const value_list &) = delete;
+    value_list &operator=(const value_list &) = delete;
+
+    fstr_value **list()
+    {
+        return list_.data();
+    }
+
+    operator fstr_value **()
+    {
+        return list_.data();
+    }
+
+private:
+    std::array<fstr_value, N> values_;
+    std::array<fstr_value *, N + 1> list_;
+};
+
+/**
+ * @brief Make a fstr_value list from named arguments, for lbfstring(), fstr_render() and the rest.
+ */
+template <class... Args>
+value_list<sizeof...(Args)> values(const Args &... args)
+{
+    static_assert((detail::is_named<Args>::value && ...), "fstr: arguments must be named, eg \"name\"_a = value");
+    return value_list<sizeof...(Args)>(args...);
+}
+
+} // namespace fstr
+
+#endif
@@ -22,9 +22,17 @@
  * 
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "fstring.h"
 
@@ -64,126 +72,2092 @@ const char *test_callback1(void *data, const char *name)
                     } } while(0)
 
 
+/* Count calls to malloc, so tests can check nothing is allocated behind their back */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define COUNT_MALLOC
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static int malloc_calls = 0;
+
+void *malloc(size_t size) { malloc_calls++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { malloc_calls++; return __libc_calloc(n, size); }
+void *realloc(void *ptr, size_t size) { malloc_calls++; return __libc_realloc(ptr, size); }
+#endif
+
+
 #define PERF_TEST_COUNT     50000000L
 
-void performance_test()
+static void perf_report(const char *what, long count, struct timeval *tv_start, struct timeval *tv_end)
+{
+    u_int64_t usec;
+
+    usec = (1000000 * (tv_end->tv_sec - tv_start->tv_sec)) + (tv_end->tv_usec - tv_start->tv_usec);
+    printf("%s: %ld interations. Elapsed time: %lu us (%lu.%06lu seconds)\n", what, count, 
+            (unsigned long) usec,
+            (unsigned long) usec / 1000000, 
+            (unsigned long) usec % 1000000);
+}
+
+/* Mostly literal text, like an HTML page with a few values in it */
+static char *literal_format()
+{
+    static char format[4096];
+    int i;
+
+    strcpy(format, "<html><head><title>{title}</title></head><body>\n");
+    for(i = 0; strlen(format) < 3800; i++) {
+        strcat(format, "<p class=\"text\">Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod.</p>\n");
+        if (i == 20) {
+            strcat(format, "<p>{user} has {count} messages</p>\n");
+        }
+    }
+    strcat(format, "</body></html>\n");
+    return format;
+}
+
+void scan_performance_test()
+{
+    static char buffer[8192];
+    static const int modes[] = { FSTR_SCAN_SCALAR, FSTR_SCAN_SSE2, FSTR_SCAN_AVX2 };
+    static const char *names[] = { "scalar", "SSE2", "AVX2" };
+    const char *placeholder_format = "{a}{b}:{c} {a}/{b} {{{c}}} {a}{b}{c} {a} {b} {c} [{a}] [{b}] [{c}]";
+    char what[100];
+    const char *literal = literal_format();
+    long count = PERF_TEST_COUNT / 100;
+    int i, m;
+    struct timeval tv_start, tv_end;
+    fstr_value **values = fstr_values_cast {
+        fstr_nstr("title", "Inbox"), fstr_nstr("user", "nick"), fstr_nint("count", 12),
+        fstr_nstr("a", "x"), fstr_nint("b", 42), fstr_nstr("c", "zz"), fstr_end
+    };
+
+    for(m = 0; m < 3; m++) {
+        if (fstr_scan_mode(modes[m]) != modes[m]) {
+            continue;
+        }
+        gettimeofday(&tv_start, NULL);
+        for(i = count; --i > 0;) {
+            lbfstring(buffer, sizeof(buffer), literal, values);
+        }
+        gettimeofday(&tv_end, NULL);
+        sprintf(what, "lbfstring %lu byte literal format, %s", (unsigned long)strlen(literal), names[m]);
+        perf_report(what, count, &tv_start, &tv_end);
+
+        gettimeofday(&tv_start, NULL);
+        for(i = count * 10; --i > 0;) {
+            lbfstring(buffer, sizeof(buffer), placeholder_format, values);
+        }
+        gettimeofday(&tv_end, NULL);
+        sprintf(what, "lbfstring placeholder format, %s", names[m]);
+        perf_report(what, count * 10, &tv_start, &tv_end);
+    }
+    fstr_scan_mode(FSTR_SCAN_AUTO);
+}
+
+void performance_test()
+{
+    static char buffer[1024];
+    char *strings[32];
+    int i, j;
+    struct timeval tv_start, tv_end;
+    const char *format = "test {blah} thing {BLAH} {thing} testing one two three";
+    fstr_template *tpl;
+
+    printf("Starting perf test\n");
+    gettimeofday(&tv_start, NULL);
+    for(i = PERF_TEST_COUNT; --i > 0;) {
+       lbfstring(buffer, sizeof(buffer), format, fstr_values_cast {
+            fstr_nstr("blah", "TEST"),
+            fstr_end
+        });
+    }
+    gettimeofday(&tv_end, NULL);
+    perf_report("lbfstring", PERF_TEST_COUNT, &tv_start, &tv_end);
+
+    tpl = fstr_compile(format);
+    gettimeofday(&tv_start, NULL);
+    for(i = PERF_TEST_COUNT; --i > 0;) {
+       fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast {
+            fstr_nstr("blah", "TEST"),
+            fstr_end
+        });
+    }
+    gettimeofday(&tv_end, NULL);
+    perf_report("fstr_render", PERF_TEST_COUNT, &tv_start, &tv_end);
+    fstr_template_free(tpl);
+
+    /* Requests that make 32 strings and release them all at the end */
+    gettimeofday(&tv_start, NULL);
+    for(i = PERF_TEST_COUNT / 32; --i > 0;) {
+        for(j = 0; j < 32; j++) {
+            strings[j] = fstring(format, fstr_nstr("blah", "TEST"), fstr_int(j), fstr_end);
+        }
+        for(j = 0; j < 32; j++) {
+            free(strings[j]);
+        }
+    }
+    gettimeofday(&tv_end, NULL);
+    perf_report("fstring with malloc", PERF_TEST_COUNT, &tv_start, &tv_end);
+
+    fstr_set_allocator(fstr_arena_allocator(NULL));
+    gettimeofday(&tv_start, NULL);
+    for(i = PERF_TEST_COUNT / 32; --i > 0;) {
+        for(j = 0; j < 32; j++) {
+            strings[j] = fstring(format, fstr_nstr("blah", "TEST"), fstr_int(j), fstr_end);
+        }
+        fstr_arena_reset(NULL);
+    }
+    gettimeofday(&tv_end, NULL);
+    fstr_set_allocator(NULL);
+    perf_report("fstring with an arena", PERF_TEST_COUNT, &tv_start, &tv_end);
+
+    scan_performance_test();
+    return;
+}
+
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    long iterations;
+    int check;
+    long errors;
+} thread_arg;
+
+static void *thread_worker(void *ptr)
+{
+    thread_arg *arg = ptr;
+    char buffer[256], compare[256];
+    long i;
+    int x, y;
+
+    for(i = 0; i < arg->iterations; i++) {
+        x = arg->id * 1000 + (int)(i % 1000);
+        y = (int)i;
+        lbfstring(buffer, sizeof(buffer), "thread {id} rendered {x} and {y}", fstr_values_cast {
+            fstr_nint("id", arg->id),
+            fstr_int(x),
+            fstr_int(y),
+            fstr_end
+        });
+        /* Checking would just benchmark snprintf when measuring throughput */
+        if (arg->check) {
+            snprintf(compare, sizeof(compare), "thread %d rendered %d and %d", arg->id, x, y);
+            if (strcmp(buffer, compare) != 0) {
+                arg->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Renders from n threads at once, returning the number of corrupted renders seen (if check is set).
+ */
+static long thread_run(int n, long iterations, int check)
+{
+    thread_arg args[n];
+    long errors = 0;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        args[i].id = i;
+        args[i].iterations = iterations;
+        args[i].check = check;
+        args[i].errors = 0;
+        pthread_create(&args[i].thread, NULL, thread_worker, &args[i]);
+    }
+    for(i = 0; i < n; i++) {
+        pthread_join(args[i].thread, NULL);
+        errors += args[i].errors;
+    }
+    return errors;
+}
+
+int thread_test()
+{
+    TEST_DECLARE();
+
+    TEST_NAME("Renders from 1 thread");
+    TEST_ASSERT(thread_run(1, 20000, 1) == 0);
+
+    TEST_NAME("Renders from 2 threads at once");
+    TEST_ASSERT(thread_run(2, 20000, 1) == 0);
+
+    TEST_NAME("Renders from 4 threads at once");
+    TEST_ASSERT(thread_run(4, 20000, 1) == 0);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+/**
+ * Renders from 1 up to max_threads threads at once, reporting the throughput for each
+ * thread count.
+ */
+void thread_performance_test(int max_threads, long iterations)
+{
+    struct timeval tv_start, tv_end;
+    u_int64_t usec;
+    int n;
+
+    for(n = 1; n <= max_threads; n++) {
+        gettimeofday(&tv_start, NULL);
+        thread_run(n, iterations, 0);
+        gettimeofday(&tv_end, NULL);
+        usec = (1000000 * (tv_end.tv_sec - tv_start.tv_sec)) + (tv_end.tv_usec - tv_start.tv_usec);
+        if (usec == 0) usec = 1;
+        printf("%2d threads: %ld renders in %lu us, %.0f renders/sec (%.0f per thread)\n", n, iterations * n,
+            (unsigned long)usec, 1e6 * iterations * n / usec, 1e6 * iterations / usec);
+    }
+}
+
+
+int calling_test1(char *vl_match, char *str, ...);
+int calling_test2(char *vl_match, char *testing, va_list vl);
+
+
+/* Called with fstr_val_str("boo", "arg"), fstr_val_int("agent", 99), fstr_val_end */
+int calling_test() {
+    return calling_test1(
+        "boom arg 99",
+        "boom {boo} {agent}", 
+        fstr_nstr("boo", "arg"), fstr_nint("agent", 99), fstr_end);
+}
+int calling_test1(char *vl_match, char *str, ...)
+{
+    va_list vl;
+    int r;
+    va_start(vl, str);
+    r = calling_test2(vl_match, str, vl);
+    va_end(vl);
+    return r;
+}
+
+int calling_test2(char *vl_match, char *testing, va_list vl)
+{
+    /* There are many ways to call fstring, lets try them all! 
+
+extern char *fstring(const char *format, fstr_value *, ...);
+extern char *vfstring(const char *format, va_list vl);
+extern char *lfstring(const char *format, fstr_value *values[]);
+
+extern int bfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *, ...);
+extern int vbfstring(char *buffer, size_t buffer_len, const char *format, va_list vl);
+extern int lbfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *values[]);
+
+     */
+
+    char *str1 = "Testing";
+    char *str2 = "Blah";
+    int x = 10;
+    int y = 12;
+    float f = 3.1415;
+    double d = 3.333333;
+    int r;
+    va_list vl_test1, vl_test2;
+    fstr_value *variables[] = {
+        fstr_int(x),
+        fstr_str(str2),
+        fstr_str(str1),
+        fstr_ndouble("blah", 1.123456),
+        fstr_end
+    };
+    static char buffer[1024];
+    TEST_DECLARE();
+
+    char *result;
+
+
+    TEST_NAME("fstring()");
+    result = fstring("Testing {str1}", fstr_str(str1), fstr_str(str2), fstr_end);
+    TEST_ASSERT(result != NULL);
+    TEST_ASSERT(strcmp(result, "Testing Testing") == 0);
+
+    TEST_NAME("vfstring()");
+    va_copy(vl_test1, vl);
+    result = vfstring(testing, vl_test1);
+    TEST_ASSERT(result != NULL);
+    TEST_ASSERT(strcmp(result, vl_match) == 0);
+
+    TEST_NAME("lfstring()");
+    result = lfstring("Another {f} test {y}", fstr_values_cast {
+        fstr_str(str2), fstr_float(f), fstr_int(y), fstr_double(d), fstr_end
+    });
+    TEST_ASSERT(result != NULL);
+    TEST_ASSERT(strcmp(result, "Another 3.1415 test 12") == 0);
+
+    TEST_NAME("bfstring()");
+    r = bfstring(buffer, sizeof(buffer), "Testing {x} {str2}", fstr_str(str2), fstr_int(x), fstr_end);
+    TEST_ASSERT(r > 0);
+    TEST_ASSERT(strcmp(result, "Testing 12 str2"));
+
+    TEST_NAME("vbfstring()");
+    va_copy(vl_test2, vl);
+    r = vbfstring(buffer, sizeof(buffer), testing, vl_test2);
+    TEST_ASSERT(r > 0);
+    TEST_ASSERT(strcmp(result, vl_match));
+
+    TEST_NAME("lbfstring()");
+    r = lbfstring(buffer, sizeof(buffer), "Testing {blah} {str2} {str1} {x} {missing}", variables);
+    TEST_ASSERT(r > 0);
+    TEST_ASSERT(strcmp(result, "Testing 1.123456 Testing Blah 12 "));
+
+    TEST_RESULTS();
+
+    return fail;
+}
+
+
+static int counter_calls;
+
+const char *counter_callback(void *data, const char *name)
+{
+    static char buffer[32];
+
+    snprintf(buffer, sizeof(buffer), "call%d", ++counter_calls);
+    return buffer;
+}
+
+int measure_test()
+{
+    static char buffer[64], big[3000];
+    char *result;
+    int r;
+    TEST_DECLARE();
+
+    TEST_NAME("fstr_measure()");
+    r = fstr_measure("{a} and {b} {{ {missing}", fstr_values_cast {
+        fstr_nstr("a", "12345"), fstr_nint("b", 42), fstr_end
+    });
+    TEST_ASSERT(r == 24);
+
+    TEST_NAME("fstr_measure() invalid format");
+    TEST_ASSERT(fstr_measure("{a", NULL) == -1);
+
+    TEST_NAME("bfstring() returns the full size needed");
+    memset(big, 'x', sizeof(big) - 1);
+    r = bfstring(buffer, sizeof(buffer), "{big}{big}", fstr_str(big), fstr_end);
+    TEST_ASSERT(r == -(2 * (int)(sizeof(big) - 1) + 1));
+
+    TEST_NAME("lfstring() calls callbacks once");
+    counter_calls = 0;
+    result = lfstring("{big} {counter} {counter} {big}", fstr_values_cast {
+        fstr_str(big), fstr_ncb("counter", counter_callback, NULL), fstr_end
+    });
+    TEST_ASSERT(counter_calls == 2);
+    TEST_ASSERT(result != NULL && strlen(result) == 2 * (sizeof(big) - 1) + 13);
+    TEST_ASSERT(result != NULL && strncmp(result + sizeof(big), "call1 call2 ", 12) == 0);
+    free(result);
+
+    TEST_NAME("lbfstring() with a long format");
+    {
+        static char format[60000], expect[60000], output[60000];
+        char *fp = format, *ep = expect;
+        int i;
+
+        for(i = 0; i < 2000; i++) {
+            fp += sprintf(fp, "<td>{a}</td><td>{{b}}</td>");
+            ep += sprintf(ep, "<td>1</td><td>{b}}</td>");
+        }
+        counter_calls = 0;
+        r = lbfstring(output, sizeof(output), format, fstr_values_cast {
+            fstr_ncb("a", counter_callback, NULL), fstr_end
+        });
+        TEST_ASSERT(counter_calls == 2000);
+        r = lbfstring(output, sizeof(output), format, fstr_values_cast {
+            fstr_nint("a", 1), fstr_end
+        });
+        TEST_ASSERT(r == strlen(expect) && strcmp(output, expect) == 0);
+    }
+
+    TEST_NAME("fstring() with an empty result");
+    result = fstring("{empty}", fstr_nstr("empty", ""), fstr_end);
+    TEST_ASSERT(result != NULL && result[0] == 0);
+    free(result);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+
+static unsigned long long rand_state = 88172645463325252ULL;
+
+static unsigned long long rand64()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+int number_test()
+{
+    static char buffer[1024], compare[1024];
+    struct {
+        double d;
+        char *match;
+    } doubles[] = {
+        { 0.1, "0.1" },
+        { 2.0, "2.0" },
+        { -0.0, "-0.0" },
+        { 123456.789, "123456.789" },
+        { 1e15, "1000000000000000.0" },
+        { 1e16, "1e+16" },
+        { 0.0001, "0.0001" },
+        { 1e-05, "1e-05" },
+        { 5e-324, "5e-324" },
+        { 1.7976931348623157e308, "1.7976931348623157e+308" },
+        { 1.0/0.0, "inf" },
+        { -1.0/0.0, "-inf" },
+        { 0 / 0.0 * 0, NULL },
+    };
+    double d;
+    float f;
+    int i, ok, r;
+    unsigned long long bits;
+    TEST_DECLARE();
+
+    TEST_NAME("Integers");
+    r = bfstring(buffer, sizeof(buffer), "{a} {b} {c} {d} {e}", fstr_nint("a", 0), fstr_nint("b", INT_MIN), 
+        fstr_nint("c", 99), fstr_nlong("d", LONG_MIN), fstr_nlong("e", 1234567890123456789L), fstr_end);
+    snprintf(compare, sizeof(compare), "0 %d 99 %ld 1234567890123456789", INT_MIN, LONG_MIN);
+    TEST_ASSERT(r > 0 && strcmp(buffer, compare) == 0);
+    r = bfstring(buffer, sizeof(buffer), "{a} {b}", fstr_nulong("a", 0), fstr_nulong("b", ULONG_MAX), fstr_end);
+    snprintf(compare, sizeof(compare), "0 %lu", ULONG_MAX);
+    TEST_ASSERT(r > 0 && strcmp(buffer, compare) == 0);
+
+    TEST_NAME("Shortest doubles");
+    for(i = 0, ok = 1; doubles[i].match != NULL; i++) {
+        bfstring(buffer, sizeof(buffer), "{d}", fstr_ndouble("d", doubles[i].d), fstr_end);
+        if (strcmp(buffer, doubles[i].match) != 0) {
+            printf("    %s should have been %s\n", buffer, doubles[i].match);
+            ok = 0;
+        }
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("Shortest floats");
+    f = 3.1415f;
+    bfstring(buffer, sizeof(buffer), "{f} {g}", fstr_float(f), fstr_nfloat("g", 0.1f), fstr_end);
+    TEST_ASSERT(strcmp(buffer, "3.1415 0.1") == 0);
+
+    TEST_NAME("Doubles read back the same");
+    for(i = 0, ok = 1; i < 200000; i++) {
+        bits = rand64();
+        memcpy(&d, &bits, sizeof(d));
+        if (!isfinite(d)) continue;
+        bfstring(buffer, sizeof(buffer), "{d}", fstr_double(d), fstr_end);
+        if (strtod(buffer, NULL) != d) {
+            printf("    %s didn't read back as %.17g\n", buffer, d);
+            ok = 0;
+            break;
+        }
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("Floats read back the same");
+    for(i = 0, ok = 1; i < 200000; i++) {
+        unsigned int fbits = rand64();
+        memcpy(&f, &fbits, sizeof(f));
+        if (!isfinite(f)) continue;
+        bfstring(buffer, sizeof(buffer), "{f}", fstr_float(f), fstr_end);
+        if (strtof(buffer, NULL) != f) {
+            printf("    %s didn't read back as %.9g\n", buffer, f);
+            ok = 0;
+            break;
+        }
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("FSTR_FLOAT_FIXED matches %f");
+    fstr_float_mode(FSTR_FLOAT_FIXED);
+    for(i = 0, ok = 1; i < 200000; i++) {
+        bits = rand64();
+        /* Mostly everyday sized numbers, with some from across the whole range */
+        if (i % 4) {
+            bits = (bits & 0x800FFFFFFFFFFFFFULL) | ((0x3C0ULL + (bits >> 52) % 0x80) << 52);
+        }
+        memcpy(&d, &bits, sizeof(d));
+        bfstring(buffer, sizeof(buffer), "{d}", fstr_double(d), fstr_end);
+        snprintf(compare, sizeof(compare), "%f", d);
+        if (strcmp(buffer, compare) != 0) {
+            printf("    %s should have been %s\n", buffer, compare);
+            ok = 0;
+            break;
+        }
+    }
+    r = bfstring(buffer, sizeof(buffer), "{a} {b} {c} {d}", fstr_nfloat("a", 3.1415f), fstr_ndouble("b", 0.5), 
+        fstr_ndouble("c", 2.5e-7), fstr_ndouble("d", 999999.9999996), fstr_end);
+    TEST_ASSERT(ok && strcmp(buffer, "3.141500 0.500000 0.000000 1000000.000000") == 0);
+    fstr_float_mode(FSTR_FLOAT_SHORTEST);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+
+int spec_test()
+{
+    static char buffer[1024];
+    struct {
+        char *format;
+        fstr_value *value;
+        char *match;
+    } tests[] = {
+        { "{v:.3f}", fstr_ndouble("v", 3.14159265), "3.142" },
+        { "{v:08x}", fstr_nlong("v", 255L), "000000ff" },
+        { "{v:<05}", fstr_nint("v", 5), "50000" },
+        { "{v:^06}", fstr_nint("v", 5), "005000" },
+        { "{v:>05}", fstr_nint("v", -5), "000-5" },
+        { "{v:*<05}", fstr_nint("v", 5), "5****" },
+        { "{v: <05}", fstr_nint("v", 5), "5    " },
+        { "{v:<05}", fstr_nstr("v", "ab"), "ab000" },
+        { "{v:,}", fstr_nlong("v", 1234567L), "1,234,567" },
+        { "{v:_}", fstr_nlong("v", 1234567L), "1_234_567" },
+        { "{v:010,}", fstr_nlong("v", 1234L), "00,001,234" },
+        { "{v:+d}", fstr_nlong("v", 5L), "+5" },
+        { "{v: d}", fstr_nlong("v", 5L), " 5" },
+        { "{v:#x}", fstr_nlong("v", 255L), "0xff" },
+        { "{v:#X}", fstr_nlong("v", 255L), "0XFF" },
+        { "{v:#b}", fstr_nlong("v", 5L), "0b101" },
+        { "{v:d}", fstr_nulong("v", 18446744073709551615UL), "18446744073709551615" },
+        { "{v:,}", fstr_nulong("v", 18446744073709551615UL), "18,446,744,073,709,551,615" },
+        { "{v:#x}", fstr_nulong("v", 18446744073709551615UL), "0xffffffffffffffff" },
+        { "{v:+}", fstr_nulong("v", 18446744073709551615UL), "+18446744073709551615" },
+        { "{v:#o}", fstr_nlong("v", 8L), "0o10" },
+        { "{v:_x}", fstr_nlong("v", 3735928559L), "dead_beef" },
+        { "{v:>10}", fstr_nstr("v", "abc"), "       abc" },
+        { "{v:^9}", fstr_nstr("v", "abc"), "   abc   " },
+        { "{v:*<6}", fstr_nstr("v", "ab"), "ab****" },
+        { "{v:.2}", fstr_nstr("v", "abcdef"), "ab" },
+        { "{v:e}", fstr_ndouble("v", 12345.678), "1.234568e+04" },
+        { "{v:.2E}", fstr_ndouble("v", 0.000123), "1.23E-04" },
+        { "{v:g}", fstr_ndouble("v", 1234567.0), "1.23457e+06" },
+        { "{v:g}", fstr_ndouble("v", 0.0001), "0.0001" },
+        { "{v:g}", fstr_ndouble("v", 100.0), "100" },
+        { "{v:g}", fstr_ndouble("v", 120000.0), "120000" },
+        { "{v:.5}", fstr_ndouble("v", 1200.0), "1200.0" },
+        { "{v:.3}", fstr_ndouble("v", 100.0), "1e+02" },
+        { "{v:.3}", fstr_ndouble("v", 10.0), "10.0" },
+        { "{v:%}", fstr_ndouble("v", 0.256), "25.600000%" },
+        { "{v:.1%}", fstr_ndouble("v", 0.256), "25.6%" },
+        { "{v:=+12,.2f}", fstr_ndouble("v", -1234567.891), "-1,234,567.89" },
+        { "{v:012.3f}", fstr_ndouble("v", -3.14159), "-0000003.142" },
+        { "{v:f}", fstr_nlong("v", 7L), "7.000000" },
+        { "{v:}", fstr_ndouble("v", 2.5), "2.5" },
+        { "{v:>8}", fstr_ndouble("v", 2.5), "     2.5" },
+        { "{v:x}", fstr_nlong("v", -255L), "-ff" },
+        { "{v:.0f}", fstr_ndouble("v", 2.5), "2" },
+        { "{v:#.0f}", fstr_ndouble("v", 2.5), "2." },
+        { "{v:.3g}", fstr_ndouble("v", 1.234e-05), "1.23e-05" },
+        { "{v:G}", fstr_ndouble("v", 1e+20), "1E+20" },
+        { "{v:é^7}", fstr_nstr("v", "ab"), "ééabééé" },
+        { "{v:.10f}", fstr_ndouble("v", 0.1), "0.1000000000" },
+        { "{v:.20e}", fstr_ndouble("v", 0.3333333333333333), "3.33333333333333314830e-01" },
+        { "{v:not a spec}", fstr_nstr("v", "x"), "{v:not a spec}" },
+        { "{v:>5}", fstr_nstr("nope", "x"), "{v:>5}" },
+        { NULL, NULL, NULL }
+    };
+    fstr_template *tpl;
+    int i, ok, r;
+    TEST_DECLARE();
+
+    TEST_NAME("Format specs");
+    for(i = 0, ok = 1; tests[i].format != NULL; i++) {
+        r = lbfstring(buffer, sizeof(buffer), tests[i].format, fstr_values_cast { tests[i].value, fstr_end });
+        if (r != strlen(tests[i].match) || strcmp(buffer, tests[i].match) != 0) {
+            printf("    %s gave '%s' should have been '%s'\n", tests[i].format, buffer, tests[i].match);
+            ok = 0;
+        }
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("Compiled format specs");
+    for(i = 0, ok = 1; tests[i].format != NULL; i++) {
+        tpl = fstr_compile(tests[i].format);
+        r = fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast { tests[i].value, fstr_end });
+        fstr_template_free(tpl);
+        if (r != strlen(tests[i].match) || strcmp(buffer, tests[i].match) != 0) {
+            printf("    %s gave '%s' should have been '%s'\n", tests[i].format, buffer, tests[i].match);
+            ok = 0;
+        }
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("Format spec padding overflow");
+    r = lbfstring(buffer, 10, "{v:>20}", fstr_values_cast { fstr_nint("v", 1), fstr_end });
+    TEST_ASSERT(r == -21);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+
+int table_test()
+{
+    static char buffer[1024], names[200][16];
+    static fstr_value entries[200];
+    fstr_value *list[201];
+    fstr_table *table, *wild;
+    char *result;
+    int i, r;
+    TEST_DECLARE();
+
+    for(i = 0; i < 200; i++) {
+        snprintf(names[i], sizeof(names[i]), "name%d", i);
+        memcpy(&entries[i], fstr_nint(names[i], i), sizeof(fstr_value));
+        list[i] = &entries[i];
+    }
+    list[200] = fstr_end;
+    table = fstr_table_new(list);
+
+    TEST_NAME("fstr_table lookup");
+    r = lbfstring(buffer, sizeof(buffer), "{name0} {NAME150} {name199} {name200}", fstr_values_cast {
+        fstr_tbl(table), fstr_end
+    });
+    TEST_ASSERT(r > 0 && strcmp(buffer, "0 150 199 {name200}") == 0);
+
+    TEST_NAME("fstr_table with bfstring");
+    r = bfstring(buffer, sizeof(buffer), "{name1} {extra}", fstr_nstr("extra", "x"), fstr_tbl(table), fstr_end);
+    TEST_ASSERT(r > 0 && strcmp(buffer, "1 x") == 0);
+
+    TEST_NAME("fstr_table with fstring");
+    result = fstring("{name2}", fstr_tbl(table), fstr_end);
+    TEST_ASSERT(result != NULL && strcmp(result, "2") == 0);
+    free(result);
+
+    TEST_NAME("fstr_table list order");
+    result = lfstring("{name3} {name4}", fstr_values_cast {
+        fstr_nstr("name3", "first"), fstr_tbl(table), fstr_nstr("name4", "last"), fstr_end
+    });
+    TEST_ASSERT(result != NULL && strcmp(result, "first 4") == 0);
+    free(result);
+
+    wild = fstr_table_new(fstr_values_cast {
+        fstr_nstr("a", "A"),
+        fstr_nstr("A", "duplicate"),
+        fstr_nstr("*", "wild"),
+        fstr_nstr("b", "B"),
+        fstr_tbl(table),
+        fstr_end
+    });
+    TEST_NAME("fstr_table wildcard and duplicates");
+    r = bfstring(buffer, sizeof(buffer), "{A} {b} {c} {name5}", fstr_tbl(wild), fstr_end);
+    TEST_ASSERT(r > 0 && strcmp(buffer, "A wild wild wild") == 0);
+
+    fstr_table_free(wild);
+    fstr_table_free(table);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+typedef struct {
+    char *data;
+    size_t len, size;
+    int calls;
+    size_t largest;
+} collect_t;
+
+int collect_write(void *data, const char *buffer, size_t len)
+{
+    collect_t *c = data;
+    if (c->len + len + 1 > c->size) {
+        c->size = (c->len + len + 1) * 2;
+        c->data = realloc(c->data, c->size);
+    }
+    memcpy(c->data + c->len, buffer, len);
+    c->len += len;
+    c->data[c->len] = 0;
+    c->calls++;
+    if (len > c->largest) {
+        c->largest = len;
+    }
+    return 0;
+}
+
+int failing_write(void *data, const char *buffer, size_t len)
+{
+    (*(int *)data)++;
+    return -1;
+}
+
+int sink_test()
+{
+    static char big[3000000], expect[3000100], buffer[1024];
+    collect_t c = { 0 };
+    fstr_template *tpl;
+    ssize_t r;
+    int i, ok, fails = 0, fds[2];
+    FILE *f;
+    TEST_DECLARE();
+
+    TEST_NAME("lsfstring() matches lbfstring()");
+    ok = 1;
+    for(i = 0; i < 2000 && ok; i++) {
+        c.len = 0;
+        r = sfstring(fstr_cb_sink(collect_write, &c), "{i:>6} {d} {s}|", fstr_int(i), fstr_ndouble("d", i / 7.0), 
+                    fstr_nstr("s", "text"), fstr_end);
+        lbfstring(buffer, sizeof(buffer), "{i:>6} {d} {s}|", fstr_values_cast { fstr_int(i), 
+                    fstr_ndouble("d", i / 7.0), fstr_nstr("s", "text"), fstr_end });
+        ok = r == (ssize_t)strlen(buffer) && c.len == (size_t)r && strcmp(c.data, buffer) == 0;
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("lsfstring() large output");
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    strcpy(expect, "start ");
+    strcat(expect, big);
+    strcat(expect, " end");
+    c.len = c.calls = c.largest = 0;
+    r = sfstring(fstr_cb_sink(collect_write, &c), "start {big} end", fstr_str(big), fstr_end);
+    TEST_ASSERT(r == (ssize_t)strlen(expect));
+    TEST_ASSERT(c.len == (size_t)r && strcmp(c.data, expect) == 0);
+    TEST_ASSERT(c.calls == 3);
+
+    TEST_NAME("lsfstring() flushes in chunks");
+    c.len = c.calls = c.largest = 0;
+    tpl = fstr_compile("{i} {s}\n");
+    ok = 1;
+    for(i = 0; i < 20000; i++) {
+        ok &= fstr_render_sink(fstr_cb_sink(collect_write, &c), tpl, fstr_values_cast { 
+                    fstr_int(i), fstr_nstr("s", "a fairly long line of text"), fstr_end }) > 0;
+    }
+    fstr_template_free(tpl);
+    TEST_ASSERT(ok && c.calls == 20000 && c.largest < 4096);
+    c.len = c.calls = c.largest = 0;
+    r = lsfstring(fstr_cb_sink(collect_write, &c), "{s}{s}{s}{s}{s}{s}{s}{s}{s}{s}{s}{s}", fstr_values_cast {
+        fstr_nstr("s", "0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789012345678901234567890123456789"), 
+        fstr_end 
+    });
+    TEST_ASSERT(r == 4200 && c.len == 4200 && c.calls == 2 && c.largest < 4096);
+
+    TEST_NAME("lsfstring() invalid format");
+    TEST_ASSERT(lsfstring(fstr_cb_sink(collect_write, &c), "{a", NULL) == -1);
+
+    TEST_NAME("lsfstring() sink errors");
+    r = sfstring(fstr_cb_sink(failing_write, &fails), "{big}{big}", fstr_str(big), fstr_end);
+    TEST_ASSERT(r == -1 && fails == 1);
+
+    TEST_NAME("ffstring()");
+    f = tmpfile();
+    r = ffstring(f, "{a} and {b:05}", fstr_nstr("a", "file"), fstr_nint("b", 42), fstr_end);
+    rewind(f);
+    memset(buffer, 0, sizeof(buffer));
+    TEST_ASSERT(r == 14 && fread(buffer, 1, sizeof(buffer), f) == 14);
+    TEST_ASSERT(strcmp(buffer, "file and 00042") == 0);
+    fclose(f);
+
+    TEST_NAME("dfstring()");
+    TEST_ASSERT(pipe(fds) == 0);
+    r = dfstring(fds[1], "{a} {b}", fstr_nstr("a", "pipe"), fstr_nlong("b", -7L), fstr_end);
+    close(fds[1]);
+    memset(buffer, 0, sizeof(buffer));
+    TEST_ASSERT(r == 7 && read(fds[0], buffer, sizeof(buffer)) == 7);
+    TEST_ASSERT(strcmp(buffer, "pipe -7") == 0);
+    close(fds[0]);
+
+    free(c.data);
+    TEST_RESULTS();
+    return fail;
+}
+
+/* Write text to a new temporary file, whose name is put in path */
+static int file_write(char *path, const char *text, size_t len)
+{
+    int fd;
+
+    strcpy(path, "/tmp/fstr_testXXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, text, len) != (ssize_t)len) {
+        len = -1;
+    }
+    close(fd);
+    return len == -1 ? -1 : 0;
+}
+
+int file_test()
+{
+    static char text[3000000];
+    char path[32], *expect, *result;
+    fstr_value **values = fstr_values_cast { fstr_nstr("name", "report"), fstr_nint("n", 42), fstr_end };
+    fstr_template *tpl, *compare;
+    collect_t c = { 0 };
+    size_t len, page = sysconf(_SC_PAGESIZE);
+    ssize_t r;
+    TEST_DECLARE();
+
+    for(len = 0; len < sizeof(text) - 100; ) {
+        len += sprintf(text + len, "row %zu of {name}: {n:>6} {{literal}} ", len);
+    }
+
+    TEST_NAME("fstr_compile_file()");
+    TEST_ASSERT(file_write(path, text, len) == 0);
+    tpl = fstr_compile_file(path);
+    compare = fstr_compile(text);
+    TEST_ASSERT(tpl != NULL && compare != NULL);
+
+    TEST_NAME("Larger than fstring's old maximum with fstr_render_alloc()");
+    result = fstr_render_alloc(tpl, values);
+    expect = fstr_render_alloc(compare, values);
+    TEST_ASSERT(result != NULL && expect != NULL && strlen(result) > 2000000 && strcmp(result, expect) == 0);
+
+    TEST_NAME("fstr_compile_file() to a sink");
+    r = fstr_render_sink(fstr_cb_sink(collect_write, &c), tpl, values);
+    TEST_ASSERT(r == (ssize_t)strlen(expect) && c.len == (size_t)r && memcmp(c.data, expect, r) == 0);
+    free(result);
+    free(expect);
+    free(c.data);
+    fstr_template_free(tpl);
+    fstr_template_free(compare);
+    unlink(path);
+
+    TEST_NAME("lfstring() larger than the old maximum");
+    memset(text, 'x', 2000000);
+    text[2000000] = 0;
+    result = lfstring("<{big}>", fstr_values_cast { fstr_nstr("big", text), fstr_end });
+    TEST_ASSERT(result != NULL && strlen(result) == 2000002 && result[2000001] == '>');
+    free(result);
+
+    TEST_NAME("A file that is a whole number of pages");
+    memset(text, '.', page);
+    memcpy(text + page - 6, "{name}", 6);
+    TEST_ASSERT(file_write(path, text, page) == 0);
+    tpl = fstr_compile_file(path);
+    result = fstr_render_alloc(tpl, values);
+    TEST_ASSERT(tpl != NULL && result != NULL && strlen(result) == page && strcmp(result + page - 6, "report") == 0);
+    free(result);
+    fstr_template_free(tpl);
+    unlink(path);
+
+    TEST_NAME("An empty file");
+    TEST_ASSERT(file_write(path, "", 0) == 0);
+    tpl = fstr_compile_file(path);
+    result = fstr_render_alloc(tpl, values);
+    TEST_ASSERT(tpl != NULL && result != NULL && result[0] == 0);
+    free(result);
+    fstr_template_free(tpl);
+    unlink(path);
+
+    TEST_NAME("fstr_compile_file() errors");
+    TEST_ASSERT(fstr_compile_file("/nonexistent/template") == NULL);
+    TEST_ASSERT(file_write(path, "abc {name", 9) == 0);
+    TEST_ASSERT(fstr_compile_file(path) == NULL);
+    unlink(path);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+/* Join iovecs together so they can be compared */
+size_t iov_join(char *out, struct iovec *iov, int n)
+{
+    size_t len = 0;
+    int i;
+    for(i = 0; i < n; i++) {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    out[len] = 0;
+    return len;
+}
+
+int iov_test()
+{
+    static char body[100000], buffer[1024], joined[110000];
+    char scratch[64];
+    struct iovec iov[16];
+    fstr_template *tpl;
+    fstr_value **values;
+    int r, n, fds[2];
+    TEST_DECLARE();
+
+    memset(body, 'b', sizeof(body) - 1);
+    values = fstr_values_cast { fstr_nint("len", 99999), fstr_str(body), fstr_end };
+
+    TEST_NAME("lifstring()");
+    n = lifstring(iov, 16, scratch, sizeof(scratch), "Content-Length: {len}\r\n\r\n{body}", values);
+    TEST_ASSERT(n == 4);
+    TEST_ASSERT(iov[3].iov_base == body && iov[3].iov_len == sizeof(body) - 1);
+    TEST_ASSERT(iov_join(joined, iov, n) == sizeof(body) + 24);
+    TEST_ASSERT(strncmp(joined, "Content-Length: 99999\r\n\r\nbbb", 28) == 0);
+
+    TEST_NAME("lifstring() matches lbfstring()");
+    n = lifstring(iov, 16, scratch, sizeof(scratch), "{a:>5}{b}{{x}}{c:.3f}{missing}!", fstr_values_cast {
+        fstr_nstr("a", "ab"), fstr_nint("b", -12), fstr_ndouble("c", 2.5), fstr_end });
+    r = lbfstring(buffer, sizeof(buffer), "{a:>5}{b}{{x}}{c:.3f}{missing}!", fstr_values_cast {
+        fstr_nstr("a", "ab"), fstr_nint("b", -12), fstr_ndouble("c", 2.5), fstr_end });
+    TEST_ASSERT(n > 0 && iov_join(joined, iov, n) == r && strcmp(joined, buffer) == 0);
+
+    TEST_NAME("lifstring() errors");
+    TEST_ASSERT(lifstring(iov, 16, scratch, sizeof(scratch), "{len", values) == -1);
+    TEST_ASSERT(lifstring(iov, 2, scratch, sizeof(scratch), "Content-Length: {len}\r\n\r\n{body}", values) == -2);
+    TEST_ASSERT(lifstring(iov, 16, scratch, 4, "Content-Length: {len}\r\n\r\n{body}", values) == -2);
+
+    TEST_NAME("fstr_render_iov()");
+    tpl = fstr_compile("{len} {body}");
+    n = fstr_render_iov(iov, 16, scratch, sizeof(scratch), tpl, values);
+    TEST_ASSERT(n == 3 && iov[2].iov_base == body);
+    TEST_ASSERT(iov_join(joined, iov, n) == sizeof(body) + 5 && strncmp(joined, "99999 bb", 8) == 0);
+    fstr_template_free(tpl);
+
+    TEST_NAME("lifstring() with writev()");
+    TEST_ASSERT(pipe(fds) == 0);
+    n = lifstring(iov, 16, scratch, sizeof(scratch), "{a} and {b}", fstr_values_cast { 
+        fstr_nstr("a", "one"), fstr_nint("b", 2), fstr_end });
+    TEST_ASSERT(writev(fds[1], iov, n) == 9);
+    memset(buffer, 0, sizeof(buffer));
+    TEST_ASSERT(read(fds[0], buffer, sizeof(buffer)) == 9 && strcmp(buffer, "one and 2") == 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+/* An allocator that counts what it's asked to do */
+typedef struct {
+    int allocs, frees;
+} alloc_count_t;
+
+void *counting_alloc(void *data, size_t size)
+{
+    ((alloc_count_t *)data)->allocs++;
+    return malloc(size);
+}
+
+void counting_free(void *data, void *ptr)
+{
+    if (ptr) ((alloc_count_t *)data)->frees++;
+    free(ptr);
+}
+
+void *arena_thread(void *arg)
+{
+    char *a, *b;
+    a = afstring(fstr_arena_allocator(NULL), "{x}", fstr_nstr("x", "thread"), fstr_end);
+    b = afstring(fstr_arena_allocator(NULL), "{x}", fstr_nstr("x", "thread"), fstr_end);
+    *(int *)arg = a && b && strcmp(a, "thread") == 0 && strcmp(b, "thread") == 0 && a != b;
+    return NULL;
+}
+
+int allocator_test()
+{
+    alloc_count_t counts = { 0, 0 };
+    fstr_allocator counting = { counting_alloc, counting_free, &counts };
+    fstr_arena *arena;
+    fstr_template *tpl;
+    char *a, *b, *c, *big;
+    int i, ok = 0;
+    pthread_t thread;
+    TEST_DECLARE();
+
+    TEST_NAME("afstring() uses the allocator");
+    a = afstring(&counting, "{a} {b}", fstr_nint("a", 1), fstr_nstr("b", "two"), fstr_end);
+    TEST_ASSERT(a != NULL && strcmp(a, "1 two") == 0);
+    TEST_ASSERT(counts.allocs == 1 && counts.frees == 0);
+    counting_free(&counts, a);
+
+    TEST_NAME("fstr_set_allocator()");
+    counts.allocs = counts.frees = 0;
+    fstr_set_allocator(&counting);
+    a = fstring("{a}", fstr_nint("a", 1), fstr_end);
+    b = lfstring("{a}", fstr_values_cast { fstr_nint("a", 2), fstr_end });
+    tpl = fstr_compile("{a}");
+    c = fstr_render_alloc(tpl, fstr_values_cast { fstr_nint("a", 3), fstr_end });
+    fstr_template_free(tpl);
+    TEST_ASSERT(a && b && c && strcmp(a, "1") == 0 && strcmp(b, "2") == 0 && strcmp(c, "3") == 0);
+    fstr_free(a);
+    fstr_free(b);
+    fstr_free(c);
+    fstr_set_allocator(NULL);
+    TEST_ASSERT(counts.allocs == 3 && counts.frees == 3);
+
+    TEST_NAME("Arena allocations");
+    arena = fstr_arena_new(256);
+    a = lafstring(fstr_arena_allocator(arena), "{a}", fstr_values_cast { fstr_nstr("a", "first"), fstr_end });
+    b = lafstring(fstr_arena_allocator(arena), "{a}", fstr_values_cast { fstr_nstr("a", "second"), fstr_end });
+    TEST_ASSERT(a && b && strcmp(a, "first") == 0 && strcmp(b, "second") == 0);
+    TEST_ASSERT(b - a == 16 && ((uintptr_t)a & 15) == 0);
+    big = malloc(1000);
+    memset(big, 'x', 999);
+    big[999] = 0;
+    c = afstring(fstr_arena_allocator(arena), "{big}", fstr_str(big), fstr_end);
+    TEST_ASSERT(c && strcmp(c, big) == 0 && strcmp(a, "first") == 0);
+    for(i = 0, ok = 1; i < 1000; i++) {
+        a = afstring(fstr_arena_allocator(arena), "{i}", fstr_int(i), fstr_end);
+        ok &= a && atoi(a) == i;
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("Arena reset");
+    fstr_arena_reset(arena);
+    b = lafstring(fstr_arena_allocator(arena), "{a}", fstr_values_cast { fstr_nstr("a", "again"), fstr_end });
+    TEST_ASSERT(b && strcmp(b, "again") == 0);
+    fstr_arena_free(arena);
+    free(big);
+
+    TEST_NAME("Thread arenas");
+    a = afstring(fstr_arena_allocator(NULL), "{x}", fstr_nstr("x", "main"), fstr_end);
+    pthread_create(&thread, NULL, arena_thread, &ok);
+    pthread_join(thread, NULL);
+    TEST_ASSERT(ok && a && strcmp(a, "main") == 0);
+    fstr_arena_reset(NULL);
+    TEST_ASSERT(fstr_thread_arena() != NULL);
+    fstr_arena_free(fstr_thread_arena());
+
+    TEST_RESULTS();
+    return fail;
+}
+
+int call_vbfstring(char *buffer, size_t buffer_len, const char *format, ...)
+{
+    int r;
+    va_list vl;
+    va_start(vl, format);
+    r = vbfstring(buffer, buffer_len, format, vl);
+    va_end(vl);
+    return r;
+}
+
+int varargs_test()
+{
+    static char buffer[1024], compare[1024];
+    char *result;
+    int r;
+    TEST_DECLARE();
+
+    TEST_NAME("bfstring() with many values");
+    r = bfstring(buffer, sizeof(buffer), "{a}{b}{c}{d}{e}{f}{g}{h}{i}{j}{k}{l}{m}{n}{o}{p}{q}{r}{s}{t}{u}{v}{w}{x}{y}{z}"
+        "{aa}{bb}{cc}{dd}{ee}{ff}{gg}{hh}{ii}{jj}{kk}{ll}{mm}{nn}",
+        fstr_nint("a", 1), fstr_nint("b", 2), fstr_nint("c", 3), fstr_nint("d", 4), fstr_nint("e", 5),
+        fstr_nint("f", 6), fstr_nint("g", 7), fstr_nint("h", 8), fstr_nint("i", 9), fstr_nint("j", 10),
+        fstr_nint("k", 11), fstr_nint("l", 12), fstr_nint("m", 13), fstr_nint("n", 14), fstr_nint("o", 15),
+        fstr_nint("p", 16), fstr_nint("q", 17), fstr_nint("r", 18), fstr_nint("s", 19), fstr_nint("t", 20),
+        fstr_nint("u", 21), fstr_nint("v", 22), fstr_nint("w", 23), fstr_nint("x", 24), fstr_nint("y", 25),
+        fstr_nint("z", 26), fstr_nint("aa", 27), fstr_nint("bb", 28), fstr_nint("cc", 29), fstr_nint("dd", 30),
+        fstr_nint("ee", 31), fstr_nint("ff", 32), fstr_nint("gg", 33), fstr_nint("hh", 34), fstr_nint("ii", 35),
+        fstr_nint("jj", 36), fstr_nint("kk", 37), fstr_nint("ll", 38), fstr_nint("mm", 39), fstr_nint("nn", 40),
+        fstr_end);
+    for(r = 1, compare[0] = 0; r <= 40; r++) {
+        sprintf(compare + strlen(compare), "%d", r);
+    }
+    TEST_ASSERT(strcmp(buffer, compare) == 0);
+
+#ifdef COUNT_MALLOC
+    TEST_NAME("bfstring() does not allocate");
+    malloc_calls = 0;
+    r = bfstring(buffer, sizeof(buffer), "{a} {b} {c}", fstr_nstr("a", "x"), fstr_nint("b", 2), fstr_ndouble("c", 0.5), fstr_end);
+    TEST_ASSERT(r > 0 && strcmp(buffer, "x 2 0.5") == 0);
+    TEST_ASSERT(malloc_calls == 0);
+
+    TEST_NAME("vbfstring() does not allocate");
+    malloc_calls = 0;
+    r = call_vbfstring(buffer, sizeof(buffer), "{a}-{b}", fstr_nstr("a", "y"), fstr_nlong("b", 3L), fstr_end);
+    TEST_ASSERT(r > 0 && strcmp(buffer, "y-3") == 0);
+    TEST_ASSERT(malloc_calls == 0);
+
+    TEST_NAME("fstring() only allocates the result");
+    malloc_calls = 0;
+    result = fstring("{a} {b}", fstr_nstr("a", "z"), fstr_nint("b", 4), fstr_end);
+    TEST_ASSERT(result != NULL && strcmp(result, "z 4") == 0);
+    TEST_ASSERT(malloc_calls == 1);
+    free(result);
+#endif
+
+    TEST_RESULTS();
+    return fail;
+}
+
+int scan_test()
+{
+    static char format[300], buffer[600], expect[600];
+    static const int modes[] = { FSTR_SCAN_SCALAR, FSTR_SCAN_SSE2, FSTR_SCAN_AVX2 };
+    fstr_template *tpl;
+    int m, offset, len, brace, r, ok = 1, compiled_ok = 1;
+    char *f;
+    TEST_DECLARE();
+
+    /* Every combination of alignment, length and brace position around 16 and 32 byte blocks */
+    for(m = 0; m < 3; m++) {
+        fstr_scan_mode(modes[m]);
+        for(offset = 0; offset < 32; offset++) {
+            for(len = 0; len < 70; len++) {
+                for(brace = -1; brace < len; brace++) {
+                    f = format + offset;
+                    memset(f, 'a', len);
+                    f[len] = 0;
+                    strcpy(expect, f);
+                    if (brace >= 0) {
+                        /* Put a placeholder at brace */
+                        memmove(f + brace + 3, f + brace, len - brace + 1);
+                        memcpy(f + brace, "{v}", 3);
+                        expect[brace] = 'V';
+                        memset(expect + brace + 1, 'a', len - brace);
+                        expect[len + 1] = 0;
+                    }
+                    r = lbfstring(buffer, sizeof(buffer), f, fstr_values_cast { fstr_nstr("v", "V"), fstr_end });
+                    if (r != strlen(expect) || strcmp(buffer, expect) != 0) {
+                        ok = 0;
+                    }
+                    tpl = fstr_compile(f);
+                    r = fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast { fstr_nstr("v", "V"), fstr_end });
+                    if (r != strlen(expect) || strcmp(buffer, expect) != 0) {
+                        compiled_ok = 0;
+                    }
+                    fstr_template_free(tpl);
+                }
+            }
+        }
+        TEST_NAME(m == 0 ? "Scalar scanning" : (m == 1 ? "SSE2 scanning" : "AVX2 scanning"));
+        TEST_ASSERT(ok && compiled_ok);
+    }
+    fstr_scan_mode(FSTR_SCAN_AUTO);
+
+    TEST_NAME("Scanning a long literal format");
+    f = literal_format();
+    r = bfstring(buffer, sizeof(buffer), "{{}}{x}", fstr_nstr("x", "y"), fstr_end);
+    TEST_ASSERT(r == 4 && strcmp(buffer, "{}}y") == 0);
+    TEST_ASSERT(fstr_measure(f, fstr_values_cast { fstr_end }) == strlen(f));
+
+    TEST_RESULTS();
+    return fail;
+}
+
+int batch_test()
+{
+    static char buffer[200000], row[256];
+    static fstr_value rows[1000][3], columns[3][1000];
+    static size_t offsets[1001];
+    collect_t c = { 0 };
+    fstr_template *tpl = fstr_compile("{name:<6}|{n}|{x:.2f}|{site}|{missing}\n");
+    fstr_value **shared = fstr_values_cast { fstr_nstr("site", "here"), fstr_nstr("n", "not me"), fstr_end };
+    fstr_batch batch = { &rows[0][0], 1000, 3, 0 };
+    char names[1000][8];
+    int i, r, ok;
+    TEST_DECLARE();
+
+    for(i = 0; i < 1000; i++) {
+        sprintf(names[i], "r%d", i);
+        memcpy(&rows[i][0], fstr_nstr("name", names[i]), sizeof(fstr_value));
+        memcpy(&rows[i][1], fstr_nint("n", i * 3), sizeof(fstr_value));
+        memcpy(&rows[i][2], fstr_ndouble("x", i / 8.0), sizeof(fstr_value));
+        memcpy(&columns[0][i], &rows[i][0], sizeof(fstr_value));
+        memcpy(&columns[1][i], &rows[i][1], sizeof(fstr_value));
+        memcpy(&columns[2][i], &rows[i][2], sizeof(fstr_value));
+    }
+
+    TEST_NAME("fstr_render_batch() row major");
+    r = fstr_render_batch(buffer, sizeof(buffer), offsets, tpl, &batch, shared);
+    TEST_ASSERT(r > 0 && offsets[0] == 0 && offsets[1000] == r);
+    for(i = 0, ok = 1; i < 1000 && ok; i++) {
+        sprintf(row, "%-6s|%d|%.2f|here|{missing}\n", names[i], i * 3, i / 8.0);
+        ok = offsets[i + 1] - offsets[i] == strlen(row) && strncmp(buffer + offsets[i], row, strlen(row)) == 0;
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("fstr_render_batch() column major");
+    memset(buffer, 0, sizeof(buffer));
+    batch.values = &columns[0][0];
+    batch.column_major = 1;
+    TEST_ASSERT(fstr_render_batch(buffer, sizeof(buffer), NULL, tpl, &batch, shared) == r);
+    TEST_ASSERT(strncmp(buffer, "r0    |0|0.00|here|{missing}\nr1    |3|0.12|here|{missing}\n", 56) == 0);
+
+    TEST_NAME("fstr_render_batch() too small");
+    TEST_ASSERT(fstr_render_batch(buffer, 100, offsets, tpl, &batch, shared) == -r - 1);
+    TEST_ASSERT(offsets[1000] == r);
+
+    TEST_NAME("fstr_render_batch_sink()");
+    TEST_ASSERT(fstr_render_batch_sink(fstr_cb_sink(collect_write, &c), offsets, tpl, &batch, shared) == r);
+    fstr_render_batch(buffer, sizeof(buffer), NULL, tpl, &batch, shared);
+    TEST_ASSERT(c.len == r && strcmp(c.data, buffer) == 0 && offsets[500] > 0);
+    TEST_ASSERT(strncmp(c.data + offsets[500], "r500  |1500|62.50|here|", 23) == 0);
+    free(c.data);
+
+    TEST_NAME("fstr_render_batch() with no rows");
+    batch.rows = 0;
+    TEST_ASSERT(fstr_render_batch(buffer, sizeof(buffer), offsets, tpl, &batch, NULL) == 0);
+    TEST_ASSERT(offsets[0] == 0 && buffer[0] == 0);
+
+    fstr_template_free(tpl);
+    TEST_RESULTS();
+    return fail;
+}
+
+int parallel_test()
+{
+    static char expect[2000000], names[20000][8];
+    static fstr_value rows[20000][3], columns[3][20000];
+    static size_t offsets[20001], expect_offsets[20001];
+    collect_t c = { 0 };
+    fstr_template *tpl = fstr_compile("{name:<6}|{n}|{x:.2f}|{site}\n");
+    fstr_value **shared = fstr_values_cast { fstr_nstr("site", "here"), fstr_end };
+    fstr_batch batch = { &rows[0][0], 20000, 3, 0 };
+    fstr_buf buf = FSTR_BUF_INIT;
+    int i, r, fails = 0, threads[] = { 1, 2, 4, 7, 0 }, ok;
+    TEST_DECLARE();
+
+    for(i = 0; i < 20000; i++) {
+        sprintf(names[i], "r%d", i);
+        memcpy(&rows[i][0], fstr_nstr("name", names[i]), sizeof(fstr_value));
+        memcpy(&rows[i][1], fstr_nint("n", i * 3), sizeof(fstr_value));
+        memcpy(&rows[i][2], fstr_ndouble("x", i / 8.0), sizeof(fstr_value));
+        memcpy(&columns[0][i], &rows[i][0], sizeof(fstr_value));
+        memcpy(&columns[1][i], &rows[i][1], sizeof(fstr_value));
+        memcpy(&columns[2][i], &rows[i][2], sizeof(fstr_value));
+    }
+    r = fstr_render_batch(expect, sizeof(expect), expect_offsets, tpl, &batch, shared);
+
+    TEST_NAME("fstr_render_batch_parallel() matches fstr_render_batch()");
+    for(i = 0, ok = 1; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        fstr_buf_reset(&buf);
+        memset(offsets, 0, sizeof(offsets));
+        ok = ok && fstr_render_batch_parallel(&buf, offsets, tpl, &batch, shared, threads[i]) == r && buf.len == r;
+        ok = ok && strcmp(buf.data, expect) == 0 && memcmp(offsets, expect_offsets, sizeof(offsets)) == 0;
+    }
+    TEST_ASSERT(ok);
+
+    TEST_NAME("fstr_render_batch_parallel() column major");
+    batch.values = &columns[0][0];
+    batch.column_major = 1;
+    fstr_buf_reset(&buf);
+    TEST_ASSERT(fstr_render_batch_parallel(&buf, NULL, tpl, &batch, shared, 4) == r && strcmp(buf.data, expect) == 0);
+
+    TEST_NAME("fstr_render_batch_parallel() appends");
+    fstr_buf_reset(&buf);
+    fstr_buf_write(&buf, "head\n", 5);
+    TEST_ASSERT(fstr_render_batch_parallel(&buf, offsets, tpl, &batch, shared, 3) == r);
+    TEST_ASSERT(buf.len == r + 5 && strcmp(buf.data + 5, expect) == 0 && offsets[20000] == r);
+    TEST_ASSERT(strncmp(buf.data + 5 + offsets[12345], "r12345|37035|", 13) == 0);
+
+    TEST_NAME("fstr_render_batch_parallel_sink() is in order");
+    TEST_ASSERT(fstr_render_batch_parallel_sink(fstr_cb_sink(collect_write, &c), NULL, tpl, &batch, shared, 4) == r);
+    TEST_ASSERT(c.len == r && strcmp(c.data, expect) == 0);
+    free(c.data);
+
+    TEST_NAME("fstr_render_batch_parallel_sink() errors");
+    TEST_ASSERT(fstr_render_batch_parallel_sink(fstr_cb_sink(failing_write, &fails), NULL, tpl, &batch, shared, 4) == -1);
+    TEST_ASSERT(fails == 1);
+
+    TEST_NAME("fstr_render_batch_parallel() with few rows");
+    batch = (fstr_batch){ &rows[0][0], 3, 3, 0 };
+    fstr_buf_reset(&buf);
+    TEST_ASSERT(fstr_render_batch_parallel(&buf, offsets, tpl, &batch, shared, 8) == expect_offsets[3]);
+    TEST_ASSERT(strcmp(buf.data, "r0    |0|0.00|here\nr1    |3|0.12|here\nr2    |6|0.25|here\n") == 0);
+    batch.rows = 0;
+    fstr_buf_reset(&buf);
+    TEST_ASSERT(fstr_render_batch_parallel(&buf, offsets, tpl, &batch, shared, 8) == 0 && offsets[0] == 0);
+
+    fstr_buf_free(&buf);
+    fstr_template_free(tpl);
+    TEST_RESULTS();
+    return fail;
+}
+
+static int view_calls;
+
+static const char *view_cb(void *data, const char *name)
+{
+    view_calls++;
+    return data;
+}
+
+int view_test()
+{
+    char buffer[256], eta[16] = "12s";
+    fstr_template *tpl = fstr_compile("[{done:>3}/{total}] {name} eta {eta} ({done}) {cb}");
+    fstr_value **values = fstr_values_cast { fstr_nint("done", 7), fstr_nint("total", 100), fstr_nstr("name", "copying"),
+            fstr_str(eta), fstr_ncb("cb", view_cb, "cb"), fstr_end };
+    fstr_range ranges[8];
+    fstr_view *view;
+    const char *text;
+    size_t len;
+    int r;
+    TEST_DECLARE();
+
+    TEST_NAME("fstr_view_new()");
+    view = fstr_view_new(tpl, values);
+    text = fstr_view_text(view, &len);
+    fstr_render(buffer, sizeof(buffer), tpl, values);
+    TEST_ASSERT(view != NULL && strcmp(text, buffer) == 0 && len == strlen(buffer));
+    TEST_ASSERT(strcmp(text, "[  7/100] copying eta 12s (7) cb") == 0 && view_calls == 2);
+
+    TEST_NAME("fstr_view_render() with nothing changed");
+    TEST_ASSERT(fstr_view_render(view, ranges, 8) == 0 && fstr_view_text(view, NULL) == text && view_calls == 2);
+
+    TEST_NAME("Same length values only report the bytes that differ");
+    TEST_ASSERT(fstr_view_set(view, fstr_nint("done", 8)) == 2);
+    r = fstr_view_render(view, ranges, 8);
+    text = fstr_view_text(view, &len);
+    TEST_ASSERT(strcmp(text, "[  8/100] copying eta 12s (8) cb") == 0);
+    TEST_ASSERT(r == 2 && ranges[0].offset == 3 && ranges[0].len == 1 && ranges[1].offset == 27 && ranges[1].len == 1);
+    TEST_ASSERT(view_calls == 2);
+
+    TEST_NAME("A value that didn't really change");
+    fstr_view_set(view, fstr_nstr("NAME", "copying"));
+    TEST_ASSERT(fstr_view_render(view, ranges, 8) == 0);
+
+    TEST_NAME("fstr_view_mark() a string that changed behind the view");
+    strcpy(eta, "9s");
+    TEST_ASSERT(fstr_view_mark(view, values[3]) == 1);
+    r = fstr_view_render(view, ranges, 8);
+    text = fstr_view_text(view, &len);
+    TEST_ASSERT(strcmp(text, "[  8/100] copying eta 9s (8) cb") == 0 && len == 31);
+    TEST_ASSERT(r == 1 && ranges[0].offset == 22 && ranges[0].len == 9);
+
+    TEST_NAME("Changing length moves everything after it");
+    fstr_view_set(view, fstr_nint("done", 10));
+    fstr_view_set(view, fstr_nstr("eta", "10s"));
+    r = fstr_view_render(view, ranges, 8);
+    text = fstr_view_text(view, &len);
+    TEST_ASSERT(strcmp(text, "[ 10/100] copying eta 10s (10) cb") == 0);
+    TEST_ASSERT(r == 2 && ranges[0].offset == 2 && ranges[0].len == 2 && ranges[1].offset == 22 && ranges[1].len == 11);
+
+    TEST_NAME("Getting shorter");
+    fstr_view_set(view, fstr_nstr("name", ""));
+    r = fstr_view_render(view, ranges, 8);
+    text = fstr_view_text(view, &len);
+    TEST_ASSERT(strcmp(text, "[ 10/100]  eta 10s (10) cb") == 0 && len == 26);
+    TEST_ASSERT(r == 1 && ranges[0].offset == 10 && ranges[0].len == 16);
+
+    TEST_NAME("Ranges stop where the text lines up again");
+    fstr_view_set(view, fstr_nstr("name", "x"));
+    fstr_view_set(view, fstr_nstr("eta", "1s"));
+    r = fstr_view_render(view, ranges, 8);
+    TEST_ASSERT(strcmp(fstr_view_text(view, NULL), "[ 10/100] x eta 1s (10) cb") == 0);
+    TEST_ASSERT(r == 1 && ranges[0].offset == 10 && ranges[0].len == 8);
+
+    TEST_NAME("Too many ranges are joined into the last one");
+    fstr_view_set(view, fstr_nint("total", 200));
+    fstr_view_set(view, fstr_nint("done", 20));
+    r = fstr_view_render(view, ranges, 1);
+    TEST_ASSERT(r == 1 && ranges[0].offset == 2 && ranges[0].len == 19);
+    TEST_ASSERT(fstr_view_render(view, NULL, 0) == 0);
+
+    TEST_NAME("fstr_view_mark(NULL) looks everything up again");
+    TEST_ASSERT(fstr_view_mark(view, NULL) == 6);
+    r = fstr_view_render(view, ranges, 8);
+    fstr_render(buffer, sizeof(buffer), tpl, values);
+    TEST_ASSERT(strcmp(fstr_view_text(view, NULL), buffer) == 0 && view_calls == 4);
+    TEST_ASSERT(r == 3 && ranges[0].offset == 2 && ranges[0].len == 2 && ranges[1].offset == 5 && ranges[1].len == 1);
+    TEST_ASSERT(ranges[2].offset == 10 && ranges[2].offset + ranges[2].len == strlen(buffer));
+
+    TEST_NAME("Changed output matches a full render");
+    for(r = 0; r < 1000; r++) {
+        fstr_view_set(view, fstr_nint("done", r * 37 % 1001));
+        if (r % 3 == 0) {
+            sprintf(eta, "%ds", r % 120);
+            fstr_view_mark(view, values[3]);
+        }
+        fstr_view_render(view, ranges, 2);
+        sprintf(buffer, "[%3d/100] copying eta %s (%d) cb", r * 37 % 1001, eta, r * 37 % 1001);
+        if (strcmp(fstr_view_text(view, NULL), buffer) != 0) {
+            break;
+        }
+    }
+    TEST_ASSERT(r == 1000);
+    fstr_view_free(view);
+
+    TEST_NAME("Views of a template with no placeholders");
+    fstr_template_free(tpl);
+    tpl = fstr_compile("");
+    view = fstr_view_new(tpl, NULL);
+    TEST_ASSERT(view != NULL && strcmp(fstr_view_text(view, &len), "") == 0 && len == 0);
+    TEST_ASSERT(fstr_view_mark(view, NULL) == 0 && fstr_view_render(view, ranges, 8) == 0);
+    fstr_view_free(view);
+
+    fstr_template_free(tpl);
+    TEST_RESULTS();
+    return fail;
+}
+
+static atomic_int log_gate;
+
+/* A sink that waits while log_gate is set, so the logger falls behind */
+static int gated_write(void *data, const char *buffer, size_t len)
 {
-    static char buffer[1024];
+    while(atomic_load(&log_gate)) {
+        usleep(1000);
+    }
+    return collect_write(data, buffer, len);
+}
+
+static int log_wcb(void *data, const char *name, char *buffer, size_t len)
+{
+    return snprintf(buffer, len, "<%s>", (char *)data);
+}
+
+typedef struct {
+    pthread_t thread;
+    fstr_logger *logger;
+    fstr_template *tpl;
+    int id;
+} log_arg;
+
+static void *log_worker(void *ptr)
+{
+    log_arg *arg = ptr;
     int i;
-    struct timeval tv_start, tv_end;
-    u_int64_t usec;
 
-    printf("Starting perf test\n");
-    gettimeofday(&tv_start, NULL);
-    for(i = PERF_TEST_COUNT; --i > 0;) {
-       lbfstring(buffer, sizeof(buffer), "test {blah} thing {BLAH} {thing} testing one two three", fstr_values_cast {
-            fstr_nstr("blah", "TEST"),
-            fstr_end
-        });
+    for(i = 0; i < 5000; i++) {
+        fstr_log(arg->logger, arg->tpl, fstr_nint("id", arg->id), fstr_int(i), fstr_end);
     }
-    gettimeofday(&tv_end, NULL);
+    return NULL;
+}
 
-    usec = (1000000 * (tv_end.tv_sec - tv_start.tv_sec)) + (tv_end.tv_usec - tv_start.tv_usec);
-    printf("%ld interations. Elapsed time: %lu us (%lu.%06lu seconds)\n", PERF_TEST_COUNT, 
-            (unsigned long) usec,
-            (unsigned long) usec / 1000000, 
-            (unsigned long) usec % 1000000);
-    return;
+int log_test()
+{
+    static char expect[200000];
+    char text[32], *line;
+    collect_t c = { 0 };
+    fstr_template *tpl = fstr_compile("{i:>4} {s} {d:.2f} {cb} {wcb} {missing}\n");
+    fstr_template *thread_tpl = fstr_compile("{id} {i}\n");
+    fstr_value *table_values[] = { fstr_nstr("s", "from a table"), fstr_nint("i", 7), fstr_end };
+    fstr_table *table;
+    fstr_logger *logger;
+    log_arg args[4];
+    size_t len;
+    int i, ok, next[4], id, n, r;
+    TEST_DECLARE();
+
+    TEST_NAME("fstr_log() matches rendering straight away");
+    logger = fstr_logger_new(fstr_cb_sink(collect_write, &c), 0, FSTR_LOG_BLOCK);
+    TEST_ASSERT(logger != NULL);
+    for(i = 0, len = 0, ok = 1; i < 2000; i++) {
+        sprintf(text, "line %d", i);
+        ok &= fstr_log(logger, tpl, fstr_int(i), fstr_nstr("s", text), fstr_ndouble("d", i / 3.0),
+                       fstr_ncb("cb", view_cb, text), fstr_nwcb("wcb", log_wcb, text), fstr_end) == 0;
+        len += fstr_render(expect + len, sizeof(expect) - len, tpl, fstr_values_cast { fstr_int(i), fstr_nstr("s", text),
+                           fstr_ndouble("d", i / 3.0), fstr_ncb("cb", view_cb, text), fstr_nwcb("wcb", log_wcb, text), fstr_end });
+        /* The strings were copied, and the callbacks called, by fstr_log() */
+        strcpy(text, "overwritten");
+    }
+    TEST_ASSERT(ok && fstr_logger_flush(logger) == 0);
+    TEST_ASSERT(c.len == len && strcmp(c.data, expect) == 0);
+    TEST_ASSERT(strncmp(c.data, "   0 line 0 0.00 line 0 <line 0> {missing}\n", 43) == 0);
+
+    TEST_NAME("fstr_llog() copies tables");
+    c.len = 0;
+    table = fstr_table_new(table_values);
+    fstr_llog(logger, tpl, fstr_values_cast { fstr_ndouble("d", 1), fstr_tbl(table), fstr_end });
+    fstr_table_free(table);
+    fstr_logger_flush(logger);
+    TEST_ASSERT(c.len > 0 && strcmp(c.data, "   7 from a table 1.00 {cb} {wcb} {missing}\n") == 0);
+
+    TEST_NAME("Lines from several threads are all there, in order");
+    c.len = 0;
+    for(i = 0; i < 4; i++) {
+        args[i] = (log_arg){ .logger = logger, .tpl = thread_tpl, .id = i };
+        pthread_create(&args[i].thread, NULL, log_worker, &args[i]);
+    }
+    for(i = 0; i < 4; i++) {
+        pthread_join(args[i].thread, NULL);
+        next[i] = 0;
+    }
+    fstr_logger_flush(logger);
+    for(line = c.data, ok = 1, n = 0; ok && line < c.data + c.len; line = strchr(line, '\n') + 1, n++) {
+        ok = sscanf(line, "%d %d", &id, &r) == 2 && id >= 0 && id < 4 && r == next[id]++;
+    }
+    TEST_ASSERT(ok && n == 20000 && fstr_logger_dropped(logger) == 0);
+    fstr_logger_free(logger);
+
+    TEST_NAME("FSTR_LOG_DROP");
+    c.len = 0;
+    logger = fstr_logger_new(fstr_cb_sink(gated_write, &c), 4096, FSTR_LOG_DROP);
+    atomic_store(&log_gate, 1);
+    for(i = 0, n = 0; i < 1000; i++) {
+        n += fstr_log(logger, thread_tpl, fstr_nint("id", 0), fstr_int(i), fstr_end) == 0;
+    }
+    atomic_store(&log_gate, 0);
+    fstr_logger_flush(logger);
+    TEST_ASSERT(n < 1000 && fstr_logger_dropped(logger) == 1000 - n);
+    for(line = c.data, r = 0; line < c.data + c.len; line = strchr(line, '\n') + 1) {
+        r++;
+    }
+    TEST_ASSERT(r == n && strncmp(c.data, "0 0\n0 1\n", 8) == 0);
+    fstr_logger_free(logger);
+
+    TEST_NAME("FSTR_LOG_COUNT");
+    c.len = 0;
+    logger = fstr_logger_new(fstr_cb_sink(gated_write, &c), 4096, FSTR_LOG_COUNT);
+    atomic_store(&log_gate, 1);
+    for(i = 0, n = 0; i < 1000; i++) {
+        n += fstr_log(logger, thread_tpl, fstr_nint("id", 0), fstr_int(i), fstr_end) == 0;
+    }
+    atomic_store(&log_gate, 0);
+    fstr_logger_flush(logger);
+    for(line = c.data, r = 0; (line = strstr(line, "fstr_log: ")) != NULL; line++) {
+        r += atoi(line + 10);
+    }
+    TEST_ASSERT(n < 1000 && r == 1000 - n && strstr(c.data, " lines dropped\n") != NULL);
+
+    TEST_NAME("Lines more than half the ring are dropped");
+    memset(expect, 'x', 3000);
+    expect[3000] = 0;
+    TEST_ASSERT(fstr_log(logger, thread_tpl, fstr_nstr("id", expect), fstr_end) == -1);
+    TEST_ASSERT(fstr_logger_dropped(logger) == 1001 - n);
+    fstr_logger_free(logger);
+
+    TEST_NAME("Sink errors");
+    logger = fstr_logger_new(fstr_cb_sink(failing_write, &r), 0, FSTR_LOG_BLOCK);
+    r = 0;
+    fstr_log(logger, thread_tpl, fstr_nint("id", 1), fstr_nint("i", 2), fstr_end);
+    TEST_ASSERT(fstr_logger_flush(logger) == -1 && r == 1);
+    fstr_log(logger, thread_tpl, fstr_nint("id", 1), fstr_nint("i", 2), fstr_end);
+    TEST_ASSERT(fstr_logger_flush(logger) == -1 && r == 1);
+    fstr_logger_free(logger);
+
+    free(c.data);
+    fstr_template_free(tpl);
+    fstr_template_free(thread_tpl);
+    TEST_RESULTS();
+    return fail;
 }
 
+static const char *cache_formats[] = {
+    "a {x} {y}", "b {x} {y}", "c {x} {y}", "d {x} {y}", "{x} e {y}", "{x} f {y}", "{x}{y} g", "{x}{y} h"
+};
 
-int calling_test1(char *vl_match, char *str, ...);
-int calling_test2(char *vl_match, char *testing, va_list vl);
+/* Render one of the cache formats the hard way */
+static void cache_expect(char *out, const char *format, int x, const char *y)
+{
+    for(; *format; format++) {
+        if (strncmp(format, "{x}", 3) == 0) {
+            out += sprintf(out, "%d", x);
+            format += 2;
+        } else if (strncmp(format, "{y}", 3) == 0) {
+            out += sprintf(out, "%s", y);
+            format += 2;
+        } else {
+            *out++ = *format;
+        }
+    }
+    *out = 0;
+}
 
+static void *cache_worker(void *ptr)
+{
+    thread_arg *arg = ptr;
+    char buffer[256], compare[256];
+    const char *format;
+    long i;
+    int x;
 
-/* Called with fstr_val_str("boo", "arg"), fstr_val_int("agent", 99), fstr_val_end */
-int calling_test() {
-    return calling_test1(
-        "boom arg 99",
-        "boom {boo} {agent}", 
-        fstr_nstr("boo", "arg"), fstr_nint("agent", 99), fstr_end);
+    for(i = 0; i < arg->iterations; i++) {
+        x = arg->id * 1000 + (int)(i % 1000);
+        format = cache_formats[(i + arg->id) % 8];
+        lbfstring(buffer, sizeof(buffer), format, fstr_values_cast { fstr_int(x), fstr_nstr("y", format), fstr_end });
+        cache_expect(compare, format, x, format);
+        if (strcmp(buffer, compare) != 0) {
+            arg->errors++;
+        }
+    }
+    return NULL;
 }
-int calling_test1(char *vl_match, char *str, ...)
+
+int cache_test()
 {
-    va_list vl;
-    int r;
-    va_start(vl, str);
-    r = calling_test2(vl_match, str, vl);
-    va_end(vl);
-    return r;
+    char buffer[256], format[64];
+    fstr_cache_info before, after;
+    struct iovec iov[8];
+    thread_arg args[4];
+    char *result;
+    int i, r, ok;
+    TEST_DECLARE();
+
+    TEST_NAME("fstr_cache_enable()");
+    TEST_ASSERT(fstr_cache_enable(64) == 0);
+
+    TEST_NAME("Cache hits");
+    fstr_cache_stats(&before);
+    for(i = 0, ok = 1; i < 100; i++) {
+        r = bfstring(buffer, sizeof(buffer), "cached {i:>4}", fstr_int(i), fstr_end);
+        sprintf(format, "cached %4d", i);
+        ok &= r == strlen(format) && strcmp(buffer, format) == 0;
+    }
+    fstr_cache_stats(&after);
+    TEST_ASSERT(ok);
+    TEST_ASSERT(after.hits - before.hits == 99 && after.misses - before.misses == 1);
+    TEST_ASSERT(after.size == 64 && after.entries >= 1);
+
+    TEST_NAME("Cache checks the format hasn't changed");
+    strcpy(format, "first {x}");
+    bfstring(buffer, sizeof(buffer), format, fstr_nstr("x", "1"), fstr_end);
+    strcpy(format, "again {x}");
+    bfstring(buffer, sizeof(buffer), format, fstr_nstr("x", "2"), fstr_end);
+    TEST_ASSERT(strcmp(buffer, "again 2") == 0);
+    strcpy(format, "{x} is longer");
+    bfstring(buffer, sizeof(buffer), format, fstr_nstr("x", "3"), fstr_end);
+    TEST_ASSERT(strcmp(buffer, "3 is longer") == 0);
+
+    TEST_NAME("Cached formats with other functions");
+    result = fstring("{a}-{b}", fstr_nint("a", 1), fstr_nint("b", 2), fstr_end);
+    TEST_ASSERT(result != NULL && strcmp(result, "1-2") == 0);
+    free(result);
+    result = fstring("{a}-{b}", fstr_nint("a", 3), fstr_nint("b", 4), fstr_end);
+    TEST_ASSERT(result != NULL && strcmp(result, "3-4") == 0);
+    free(result);
+    TEST_ASSERT(fstr_measure("{a}-{b}", fstr_values_cast { fstr_nint("a", 10), fstr_end }) == 6);
+    strcpy(format, "literal {a} text");
+    r = lifstring(iov, 8, buffer, sizeof(buffer), format, fstr_values_cast { fstr_nint("a", 5), fstr_end });
+    r = lifstring(iov, 8, buffer, sizeof(buffer), format, fstr_values_cast { fstr_nint("a", 5), fstr_end });
+    TEST_ASSERT(r == 3 && iov[0].iov_base == format && iov[2].iov_base == format + 11);
+    TEST_ASSERT(lbfstring(buffer, sizeof(buffer), "{bad", NULL) == -1);
+    TEST_ASSERT(lbfstring(buffer, sizeof(buffer), "{bad", NULL) == -1);
+
+    TEST_NAME("Cache eviction");
+    TEST_ASSERT(fstr_cache_enable(2) == 0);
+    fstr_cache_stats(&before);
+    for(i = 0, ok = 1; i < 8; i++) {
+        bfstring(buffer, sizeof(buffer), cache_formats[i], fstr_nint("x", i), fstr_nstr("y", "y"), fstr_end);
+        ok &= strchr(buffer, '0' + i) != NULL;
+    }
+    fstr_cache_stats(&after);
+    TEST_ASSERT(ok && after.evictions > before.evictions && after.entries <= 2);
+
+    TEST_NAME("Cache with threads");
+    for(i = 0; i < 4; i++) {
+        args[i].id = i;
+        args[i].iterations = 50000;
+        args[i].errors = 0;
+        pthread_create(&args[i].thread, NULL, cache_worker, &args[i]);
+    }
+    for(i = 0, r = 0; i < 4; i++) {
+        pthread_join(args[i].thread, NULL);
+        r += args[i].errors;
+    }
+    TEST_ASSERT(r == 0);
+
+    TEST_NAME("Cache off");
+    TEST_ASSERT(fstr_cache_enable(0) == 0);
+    fstr_cache_stats(&after);
+    TEST_ASSERT(after.size == 0 && after.entries == 0);
+
+    TEST_RESULTS();
+    return fail;
 }
 
-int calling_test2(char *vl_match, char *testing, va_list vl)
+
+int strn_test()
 {
-    /* There are many ways to call fstring, lets try them all! 
+    static char buffer[1024], scratch[64];
+    const char header[] = "Host: example.com\r\nAccept: */*\r\n";
+    const char *host = header + 6, *accept = header + 27;
+    fstr_value *list[] = { fstr_nstrn("host", host, 11), fstr_nstrn("accept", accept, 3), fstr_end };
+    fstr_template *tpl;
+    fstr_table *table;
+    collect_t c = { 0 };
+    struct iovec iov[8];
+    char *result;
+    int r, n;
+    TEST_DECLARE();
 
-extern char *fstring(const char *format, fstr_value *, ...);
-extern char *vfstring(const char *format, va_list vl);
-extern char *lfstring(const char *format, fstr_value *values[]);
+    TEST_NAME("fstr_nstrn() isn't \\0 terminated");
+    r = lbfstring(buffer, sizeof(buffer), "[{host}] [{accept}]", list);
+    TEST_ASSERT(r == 19 && strcmp(buffer, "[example.com] [*/*]") == 0);
+    r = bfstring(buffer, sizeof(buffer), "{host}!", fstr_strn(host, 7), fstr_end);
+    TEST_ASSERT(r == 8 && strcmp(buffer, "example!") == 0);
+    r = bfstring(buffer, sizeof(buffer), "<{empty}>", fstr_nstrn("empty", header, 0), fstr_end);
+    TEST_ASSERT(r == 2 && strcmp(buffer, "<>") == 0);
 
-extern int bfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *, ...);
-extern int vbfstring(char *buffer, size_t buffer_len, const char *format, va_list vl);
-extern int lbfstring(char *buffer, size_t buffer_len, const char *format, fstr_value *values[]);
+    TEST_NAME("fstr_nstrn() with a format spec");
+    r = lbfstring(buffer, sizeof(buffer), "[{host:>13}] [{accept:-^7}] [{host:.4}]", list);
+    TEST_ASSERT(r == 32 && strcmp(buffer, "[  example.com] [--*/*--] [exam]") == 0);
 
-     */
+    TEST_NAME("fstr_nstrn() everywhere fstr_str is");
+    result = lfstring("{host} {accept}", list);
+    TEST_ASSERT(result != NULL && strcmp(result, "example.com */*") == 0);
+    free(result);
+    tpl = fstr_compile("{accept} from {host}");
+    TEST_ASSERT(fstr_render(buffer, sizeof(buffer), tpl, list) == 20 && strcmp(buffer, "*/* from example.com") == 0);
+    TEST_ASSERT(fstr_render_sink(fstr_cb_sink(collect_write, &c), tpl, list) == 20);
+    TEST_ASSERT(c.len == 20 && strncmp(c.data, "*/* from example.com", 20) == 0);
+    free(c.data);
+    fstr_template_free(tpl);
+    table = fstr_table_new(list);
+    r = bfstring(buffer, sizeof(buffer), "{HOST}", fstr_tbl(table), fstr_end);
+    TEST_ASSERT(r == 11 && strcmp(buffer, "example.com") == 0);
+    fstr_table_free(table);
+    TEST_ASSERT(fstr_measure("{host}{accept}", list) == 14);
 
-    char *str1 = "Testing";
-    char *str2 = "Blah";
-    int x = 10;
-    int y = 12;
-    float f = 3.1415;
-    double d = 3.333333;
-    int r;
-    va_list vl_test1, vl_test2;
-    fstr_value *variables[] = {
-        fstr_int(x),
-        fstr_str(str2),
-        fstr_str(str1),
-        fstr_ndouble("blah", 1.123456),
-        fstr_end
-    };
-    static char buffer[1024];
+    TEST_NAME("fstr_nstrn() iovecs point at the slice");
+    n = lifstring(iov, 8, scratch, sizeof(scratch), "Host: {host}\r\n", list);
+    TEST_ASSERT(n == 3 && iov[1].iov_base == host && iov[1].iov_len == 11);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+/* Value lists have to keep working as static initializers, and in read only memory */
+static fstr_value *static_values[] = { fstr_nint("hello", 3), fstr_nstr("who", "me"), NULL };
+static const fstr_value const_value = { .name = "Content_Length", .type = fstr_vt_int, .value.i = 9 };
+
+int name_hash_test()
+{
+    static char buffer[256], runtime[32], long_name[64], names[1000][16];
+    static uint32_t hashes[1000];
+    fstr_value *lit = fstr_nint("Content_Length", 42), hashed;
+    fstr_value *dyn, *var;
+    int r, i, j, content_length = 3;
     TEST_DECLARE();
 
+    TEST_NAME("Static value lists");
+    r = lbfstring(buffer, sizeof(buffer), "{hello} {who}", static_values);
+    TEST_ASSERT(r == 4 && strcmp(buffer, "3 me") == 0);
+    r = lbfstring(buffer, sizeof(buffer), "{content_length}", fstr_values_cast { (fstr_value *)&const_value, fstr_end });
+    TEST_ASSERT(r == 1 && strcmp(buffer, "9") == 0);
+
+    TEST_NAME("Names are hashed case insensitively");
+    TEST_ASSERT(fstr_name_hash("content_LENGTH", 14) == fstr_name_hash("Content_Length", 14));
+    TEST_ASSERT(fstr_name_hash("abc", 3) != fstr_name_hash("acb", 3) && fstr_name_hash("a", 1) != fstr_name_hash("b", 1));
+    TEST_ASSERT(fstr_name_hash("ad", 2) != fstr_name_hash("cc", 2));
+
+    TEST_NAME("Similar names hash differently");
+    for(i = 0, r = 0; i < 1000; i++) {
+        sprintf(names[i], "%s%d", i & 1 ? "field" : "col_", i);
+        hashes[i] = fstr_name_hash(names[i], strlen(names[i]));
+        for(j = 0; j < i; j++) {
+            r += hashes[i] == hashes[j];
+        }
+    }
+    TEST_ASSERT(r == 0);
+
+    TEST_NAME("Names taken from variables have their length");
+    var = fstr_int(content_length);
+    TEST_ASSERT(var->name_len == 14 && var->name_hashed == 0);
+    r = lbfstring(buffer, sizeof(buffer), "{Content_Length} {content}", fstr_values_cast { var, fstr_end });
+    TEST_ASSERT(r == 11 && strcmp(buffer, "3 {content}") == 0);
+    memcpy(&hashed, var, sizeof(hashed));
+    hashed.name_len = 7;
+    r = lbfstring(buffer, sizeof(buffer), "{content_length}", fstr_values_cast { &hashed, fstr_end });
+    TEST_ASSERT(r == 16 && strcmp(buffer, "{content_length}") == 0);
+
+    TEST_NAME("Values with their name's hash");
+    memcpy(&hashed, fstr_nint("Content_Length", 5), sizeof(hashed));
+    hashed.name_hashed = 1;
+    hashed.name_hash = fstr_name_hash(hashed.name, 14);
+    hashed.name_len = 14;
+    r = lbfstring(buffer, sizeof(buffer), "{CONTENT_length} {content}", fstr_values_cast { &hashed, fstr_end });
+    TEST_ASSERT(r == 11 && strcmp(buffer, "5 {content}") == 0);
+    r = lbfstring(buffer, sizeof(buffer), "{CONTENT_length} {content}", fstr_values_cast { var, &hashed, fstr_end });
+    TEST_ASSERT(r == 11 && strcmp(buffer, "3 {content}") == 0);
+    hashed.name_hash ^= 1;
+    r = lbfstring(buffer, sizeof(buffer), "{content_length}", fstr_values_cast { &hashed, fstr_end });
+    TEST_ASSERT(r == 16 && strcmp(buffer, "{content_length}") == 0);
+
+    TEST_NAME("Looking values up doesn't change them");
+    strcpy(runtime, "CONTENT_length");
+    dyn = fstr_nint(runtime, 7);
+    r = lbfstring(buffer, sizeof(buffer), "{content_length}", fstr_values_cast { dyn, fstr_end });
+    TEST_ASSERT(r == 1 && strcmp(buffer, "7") == 0);
+    TEST_ASSERT(dyn->name_len == 0 && dyn->name_hash == 0 && dyn->name_hashed == 0 && lit->name_len == 0);
+
+    TEST_NAME("Long names");
+    memset(long_name, 'n', 40);
+    r = bfstring(buffer, sizeof(buffer), "{nnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnn} {a_name_that_is_much_longer_than_most}", 
+            fstr_nstr(long_name, "x"), fstr_nstr("a_name_that_is_much_longer_than_most", "y"), fstr_end);
+    TEST_ASSERT(r == 3 && strcmp(buffer, "x y") == 0);
+
+    TEST_NAME("Renamed values");
+    strcpy(runtime, "other");
+    r = lbfstring(buffer, sizeof(buffer), "{content_length} {other}", fstr_values_cast { dyn, fstr_end });
+    TEST_ASSERT(r == 18 && strcmp(buffer, "{content_length} 7") == 0);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+/* Writes data (a repeated character) as "xxx...", counting how many times it's called */
+typedef struct {
+    char c;
+    int len;
+    int calls;
+} repeat_t;
+
+static int repeat_write(void *data, const char *name, char *buffer, size_t buffer_len)
+{
+    repeat_t *rep = data;
+
+    rep->calls++;
+    if (rep->len < 0) {
+        return -1;
+    }
+    if (buffer_len > 0) {
+        memset(buffer, rep->c, (size_t)rep->len < buffer_len ? rep->len : buffer_len - 1);
+    }
+    return rep->len;
+}
+
+static int name_write(void *data, const char *name, char *buffer, size_t buffer_len)
+{
+    return snprintf(buffer, buffer_len, "<%s>", name);
+}
+
+int write_callback_test()
+{
+    static char buffer[20000], compare[20000], scratch[64];
+    repeat_t rep = { 'x', 5, 0 };
+    collect_t c = { 0 };
+    struct iovec iov[8];
     char *result;
+    int r, n;
+    TEST_DECLARE();
 
+    TEST_NAME("Write callback into a buffer");
+    r = bfstring(buffer, sizeof(buffer), "a {rep} b", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == 9 && strcmp(buffer, "a xxxxx b") == 0 && rep.calls == 1);
 
-    TEST_NAME("fstring()");
-    result = fstring("Testing {str1}", fstr_str(str1), fstr_str(str2), fstr_end);
-    TEST_ASSERT(result != NULL);
-    TEST_ASSERT(strcmp(result, "Testing Testing") == 0);
+    TEST_NAME("Write callback is given a \\0 terminated name");
+    r = bfstring(buffer, sizeof(buffer), "{name_write}{other}.", fstr_wcb(name_write, NULL), 
+            fstr_nwcb("other", name_write, NULL), fstr_end);
+    TEST_ASSERT(r == 20 && strcmp(buffer, "<name_write><other>.") == 0);
 
-    TEST_NAME("vfstring()");
-    va_copy(vl_test1, vl);
-    result = vfstring(testing, vl_test1);
-    TEST_ASSERT(result != NULL);
-    TEST_ASSERT(strcmp(result, vl_match) == 0);
+    TEST_NAME("Write callback with no value");
+    rep.len = -1;
+    r = bfstring(buffer, sizeof(buffer), "a {rep} b", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == 9 && strcmp(buffer, "a {rep} b") == 0);
 
-    TEST_NAME("lfstring()");
-    result = lfstring("Another {f} test {y}", fstr_values_cast {
-        fstr_str(str2), fstr_float(f), fstr_int(y), fstr_double(d), fstr_end
-    });
-    TEST_ASSERT(result != NULL);
-    TEST_ASSERT(strcmp(result, "Another 3.141500 test 12") == 0);
+    TEST_NAME("Write callback too big for the buffer");
+    rep.len = 50;
+    rep.calls = 0;
+    r = bfstring(buffer, 20, "a {rep} b", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == -55 && rep.calls == 1);
+    TEST_ASSERT(fstr_measure("a {rep} b", fstr_values_cast { fstr_nwcb("rep", repeat_write, &rep), fstr_end }) == 54);
 
-    TEST_NAME("bfstring()");
-    r = bfstring(buffer, sizeof(buffer), "Testing {x} {str2}", fstr_str(str2), fstr_int(x), fstr_end);
-    TEST_ASSERT(r > 0);
-    TEST_ASSERT(strcmp(result, "Testing 12 str2"));
+    TEST_NAME("Write callback with a format spec");
+    rep.len = 3;
+    r = bfstring(buffer, sizeof(buffer), "[{rep:*^9}] [{rep:.2}]", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == 16 && strcmp(buffer, "[***xxx***] [xx]") == 0);
+    rep.len = 10000;
+    r = bfstring(buffer, sizeof(buffer), "{rep:>10}|{rep:.4}", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == 10005 && buffer[0] == 'x' && buffer[9999] == 'x' && strcmp(buffer + 10000, "|xxxx") == 0);
 
-    TEST_NAME("vbfstring()");
-    va_copy(vl_test2, vl);
-    r = vbfstring(buffer, sizeof(buffer), testing, vl_test2);
-    TEST_ASSERT(r > 0);
-    TEST_ASSERT(strcmp(result, vl_match));
+    TEST_NAME("Write callback into a sink");
+    rep.len = 3000;
+    rep.calls = 0;
+    r = sfstring(fstr_cb_sink(collect_write, &c), "{s} {rep} {rep} {rep}.", fstr_nstr("s", "start"), 
+            fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    memset(compare, 'x', 9000);
+    TEST_ASSERT(r == 9009 && c.len == r && strncmp(c.data, "start xxx", 9) == 0 && c.data[9008] == '.');
+    TEST_ASSERT(c.data[3006] == ' ' && c.data[6007] == ' ' && strncmp(c.data + 6008, compare, 3000) == 0);
+    /* The last two don't fit in what's left of the staging buffer, and are tried again */
+    TEST_ASSERT(rep.calls == 5);
+    rep.len = 10000;
+    c.len = 0;
+    r = sfstring(fstr_cb_sink(collect_write, &c), "{rep}!", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(r == 10001 && c.len == r && c.data[0] == 'x' && c.data[9999] == 'x' && c.data[10000] == '!');
+    free(c.data);
 
-    TEST_NAME("lbfstring()");
-    r = lbfstring(buffer, sizeof(buffer), "Testing {blah} {str2} {str1} {x} {missing}", variables);
-    TEST_ASSERT(r > 0);
-    TEST_ASSERT(strcmp(result, "Testing 1.123456 Testing Blah 12 "));
+    TEST_NAME("Write callback with fstring()");
+    rep.len = 1000;
+    result = fstring("<{rep}>", fstr_nwcb("rep", repeat_write, &rep), fstr_end);
+    TEST_ASSERT(result != NULL && strlen(result) == 1002 && result[1] == 'x' && result[1001] == '>');
+    free(result);
+
+    TEST_NAME("Write callback into iovec scratch space");
+    rep.len = 10;
+    n = lifstring(iov, 8, scratch, sizeof(scratch), "a {rep} b", fstr_values_cast { 
+            fstr_nwcb("rep", repeat_write, &rep), fstr_end });
+    TEST_ASSERT(n == 3 && iov[1].iov_base == scratch && iov[1].iov_len == 10);
+    TEST_ASSERT(iov_join(buffer, iov, n) == 14 && strcmp(buffer, "a xxxxxxxxxx b") == 0);
+    rep.len = 100;
+    n = lifstring(iov, 8, scratch, sizeof(scratch), "a {rep} b", fstr_values_cast { 
+            fstr_nwcb("rep", repeat_write, &rep), fstr_end });
+    TEST_ASSERT(n == -2);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+
+int buf_test()
+{
+    static char big[300000], compare[2000000];
+    alloc_count_t counts = { 0 };
+    fstr_allocator counting = { counting_alloc, counting_free, &counts };
+    fstr_buf buf = FSTR_BUF_INIT;
+    fstr_template *tpl = fstr_compile("<{i}>");
+    repeat_t rep = { 'x', 5000, 0 };
+    char *data;
+    size_t size, len;
+    int i, ok;
+    TEST_DECLARE();
+
+    TEST_NAME("fstr_buf_append()");
+    TEST_ASSERT(fstr_buf_append(&buf, "{a} and {b}", fstr_nint("a", 1), fstr_nstr("b", "two"), fstr_end) == 9);
+    TEST_ASSERT(fstr_buf_lappend(&buf, ", {c}", fstr_values_cast { fstr_nint("c", 3), fstr_end }) == 3);
+    TEST_ASSERT(fstr_buf_write(&buf, "!", 1) == 1);
+    TEST_ASSERT(buf.len == 13 && strcmp(buf.data, "1 and two, 3!") == 0);
+
+    TEST_NAME("fstr_buf grows past MAX_BUFFER_LEN");
+    memset(big, 'b', sizeof(big) - 1);
+    for(i = 0, len = 0; i < 6; i++) {
+        TEST_ASSERT(fstr_buf_append(&buf, "{i}{big}", fstr_int(i), fstr_str(big), fstr_end) == sizeof(big));
+        compare[len++] = '0' + i;
+        memcpy(compare + len, big, sizeof(big) - 1);
+        len += sizeof(big) - 1;
+    }
+    TEST_ASSERT(buf.len == 13 + len && strcmp(buf.data + 13, compare) == 0 && buf.size > 1048576);
+
+    TEST_NAME("fstr_buf_reset() keeps the buffer");
+    data = buf.data;
+    size = buf.size;
+    fstr_buf_reset(&buf);
+    TEST_ASSERT(buf.len == 0 && buf.data == data && buf.size == size && buf.data[0] == 0);
+    TEST_ASSERT(fstr_buf_append(&buf, "again {a}", fstr_nint("a", 4), fstr_end) == 7 && strcmp(buf.data, "again 4") == 0);
+    TEST_ASSERT(buf.data == data);
+    fstr_buf_free(&buf);
+    TEST_ASSERT(buf.data == NULL && buf.len == 0 && buf.size == 0);
+
+    TEST_NAME("fstr_buf grows geometrically");
+    fstr_buf_init(&buf, &counting);
+    for(i = 0, ok = 1; i < 10000; i++) {
+        ok &= fstr_buf_render(&buf, tpl, fstr_values_cast { fstr_int(i), fstr_end }) > 0;
+    }
+    TEST_ASSERT(ok && strncmp(buf.data, "<0><1><2>", 9) == 0 && strcmp(buf.data + buf.len - 6, "<9999>") == 0);
+    TEST_ASSERT(counts.allocs <= 10 && counts.frees == counts.allocs - 1);
+    fstr_buf_free(&buf);
+    TEST_ASSERT(counts.frees == counts.allocs);
+
+    TEST_NAME("fstr_buf calls callbacks once");
+    counter_calls = 0;
+    TEST_ASSERT(fstr_buf_append(&buf, "{counter} {big}", fstr_ncb("counter", counter_callback, NULL), 
+                fstr_str(big), fstr_end) > 0);
+    TEST_ASSERT(counter_calls == 1 && strncmp(buf.data, "call1 bbb", 9) == 0);
+    TEST_ASSERT(fstr_buf_append(&buf, "{rep:.3}{rep}", fstr_nwcb("rep", repeat_write, &rep), fstr_end) == 5003);
+    TEST_ASSERT(strncmp(buf.data + buf.len - 5003, "xxxxx", 5) == 0 && buf.data[buf.len - 1] == 'x');
+    fstr_buf_free(&buf);
 
+    TEST_NAME("fstr_buf errors");
+    fstr_buf_append(&buf, "start", fstr_end);
+    TEST_ASSERT(fstr_buf_append(&buf, "{bad", fstr_end) == -1 && buf.len == 5 && strcmp(buf.data, "start") == 0);
+    TEST_ASSERT(fstr_buf_reserve(&buf, 10000) == 0 && buf.size > 10005 && strcmp(buf.data, "start") == 0);
+    fstr_buf_free(&buf);
+
+    fstr_template_free(tpl);
     TEST_RESULTS();
+    return fail;
+}
+
+
+#ifdef FSTR_STATS
+typedef struct {
+    int calls;
+    size_t len;
+    const char *format;
+} hook_count_t;
+
+static void count_hook(void *data, const char *format, size_t len, unsigned long ns)
+{
+    hook_count_t *hc = data;
+
+    hc->calls++;
+    hc->len += len;
+    hc->format = format;
+}
+#endif
+
+
+int stats_test()
+{
+    fstr_stats_info info;
+#ifdef FSTR_STATS
+    char buffer[256], formats[6][16];
+    fstr_format_stats top[8];
+    hook_count_t hc = { 0 };
+    fstr_template *tpl;
+    fstr_buf buf = FSTR_BUF_INIT;
+    size_t n;
+    int i, r;
+#endif
+    TEST_DECLARE();
+
+#ifndef FSTR_STATS
+    TEST_NAME("Stats are compiled out");
+    TEST_ASSERT(fstr_stats(&info) == -1 && info.renders == 0 && info.hits == 0);
+    TEST_ASSERT(fstr_stats_formats(8) == -1 && fstr_stats_top(NULL, 0) == 0);
+#else
+    TEST_NAME("Counts a render");
+    fstr_stats_reset();
+    r = lbfstring(buffer, sizeof(buffer), "{a} {cb} {nope}", fstr_values_cast {
+        fstr_nstr("a", "one"), fstr_ncb("cb", test_callback1, NULL), fstr_end });
+    TEST_ASSERT(fstr_stats(&info) == 0);
+    TEST_ASSERT(info.renders == 1 && info.bytes == r && info.hits == 2 && info.misses == 1 && info.wildcards == 0);
+    TEST_ASSERT(info.callbacks == 1 && info.allocs == 0 && info.resizes == 0);
+
+    TEST_NAME("Counts wildcards and bytes that didn't fit");
+    fstr_stats_reset();
+    r = lbfstring(buffer, 4, "{x} {y}", fstr_values_cast { fstr_nstr("*", "any"), fstr_end });
+    fstr_stats(&info);
+    TEST_ASSERT(r == -8 && info.bytes == 7 && info.hits == 2 && info.wildcards == 2);
+
+    TEST_NAME("Counts allocations and resizes");
+    fstr_stats_reset();
+    for(i = 0; i < 100; i++) {
+        fstr_buf_append(&buf, "{i} of 100 appends\n", fstr_int(i), fstr_end);
+    }
+    free(lfstring("{i}", fstr_values_cast { fstr_int(i), fstr_end }));
+    fstr_stats(&info);
+    TEST_ASSERT(info.renders == 101 && info.bytes == buf.len + 3);
+    TEST_ASSERT(info.allocs >= 5 && info.resizes == info.allocs - 2);
+    fstr_buf_free(&buf);
+
+    TEST_NAME("Templates, batches and the cache count once per render");
+    fstr_stats_reset();
+    tpl = fstr_compile("{a}");
+    fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast { fstr_nint("a", 1), fstr_end });
+    fstr_render_batch(buffer, sizeof(buffer), NULL, tpl, &(fstr_batch){ .values = (fstr_value[]){
+        *fstr_nint("a", 2), *fstr_nint("a", 3), *fstr_nint("a", 4) }, .rows = 3, .columns = 1 }, NULL);
+    fstr_cache_enable(16);
+    for(i = 0; i < 3; i++) {
+        lbfstring(buffer, sizeof(buffer), "{a}{a}", fstr_values_cast { fstr_nint("a", 1), fstr_end });
+    }
+    fstr_cache_enable(0);
+    fstr_stats(&info);
+    TEST_ASSERT(info.renders == 7 && info.bytes == 10 && info.hits == 10);
+
+    TEST_NAME("Counts by format");
+    TEST_ASSERT(fstr_stats_formats(4) == 0);
+    for(i = 0; i < 5; i++) {
+        fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast { fstr_nint("a", 10), fstr_end });
+    }
+    /* Only the first 3 of these fit, the rest are counted together */
+    for(i = 0; i < 6; i++) {
+        snprintf(formats[i], sizeof(formats[i]), "{a}%d", i);
+        lbfstring(buffer, sizeof(buffer), formats[i], fstr_values_cast { fstr_nint("a", i), fstr_end });
+    }
+    lbfstring(buffer, sizeof(buffer), formats[1], fstr_values_cast { fstr_nint("a", 1), fstr_end });
+    n = fstr_stats_top(top, 8);
+    TEST_ASSERT(n == 5);
+    TEST_ASSERT(strcmp(top[0].format, "{a}") == 0 && top[0].renders == 5 && top[0].bytes == 10);
+    TEST_ASSERT(top[1].format == NULL && top[1].renders == 3);
+    TEST_ASSERT(strcmp(top[2].format, "{a}1") == 0 && top[2].renders == 2 && top[3].renders == 1);
+    TEST_ASSERT(fstr_stats_top(top, 1) == 1 && top[0].renders == 5);
+    fstr_stats_reset();
+    TEST_ASSERT(fstr_stats_top(top, 8) == 0);
+    fstr_stats_formats(0);
 
+    TEST_NAME("Hook is called after each render");
+    fstr_stats_hook(count_hook, &hc);
+    lbfstring(buffer, sizeof(buffer), "hooked {a}", fstr_values_cast { fstr_nint("a", 1), fstr_end });
+    fstr_render(buffer, sizeof(buffer), tpl, fstr_values_cast { fstr_nint("a", 123), fstr_end });
+    fstr_stats_hook(NULL, NULL);
+    lbfstring(buffer, sizeof(buffer), "not hooked", NULL);
+    TEST_ASSERT(hc.calls == 2 && hc.len == 11 && strcmp(hc.format, "{a}") == 0);
+    fstr_template_free(tpl);
+#endif
+
+    TEST_RESULTS();
     return fail;
 }
 
@@ -193,6 +2167,8 @@ int main(int argc, char *argv[])
     static char buffer[1024], compare[1024];
     int r, i, total = 0, fail = 0, success = 0;
     char *thing = "magic thingy";
+    fstr_template *tpl;
+    char *result;
 
     total++;
 
@@ -238,11 +2214,23 @@ int main(int argc, char *argv[])
         { "Callback test: {CALLBACK}", "Callback test: PASS"},
         { "CB: {CALLBACK}", "CB: PASS"},
         { "CB: {CB2}", "CB: Wrong name passed"},
+        { "{}", "{}" },
+        { "}{SHORT}}", "}sh}" },
+        { "{{{SHORT}{{", "{sh{" },
+        { "{{T}", "{T}" },
         { NULL, NULL }
     };
     for(i = 0; tests[i].test != NULL; i++) {
         memset(buffer, '*', sizeof(buffer));
         total++;
+        tpl = fstr_compile(tests[i].test);
+        r = tpl ? fstr_render(compare, sizeof(compare), tpl, params) : -1;
+        fstr_template_free(tpl);
+        if (r < 0 || strcmp(compare, tests[i].match) != 0) {
+            printf("%d: "S_FAIL": Compiled template returned %d, input: %s\n", total, r, tests[i].test);
+            fail++;
+            continue;
+        }
         r =lbfstring(buffer, sizeof(buffer), tests[i].test, params);
         if (r < 0) {
             printf("%d: "S_FAIL": Got error code %d, input: %s\n", total, r, tests[i].test);
@@ -270,7 +2258,7 @@ int main(int argc, char *argv[])
         int retval;
     } fail_tests[] = {
         { "This shall not fit at all blah", 10, -31 }, // 30 characters
-        { "{LONGLOOKUP}", 0, -13 }, // 12 characters
+        { "{LONGLOOKUP}", 0, -6 }, // Expands to "short"
         { "a", 0, -2 },
         { "x", 1, -2 },
         { "y", 2, 1 },
@@ -291,6 +2279,36 @@ int main(int argc, char *argv[])
 
     printf("\nAnd now testing some edge cases\n");
 
+    total++;
+    tpl = fstr_compile("Unterminated {brace");
+    if (tpl != NULL) {
+        printf("%d: "S_FAIL": Compiled an unterminated brace\n", total);
+        fstr_template_free(tpl);
+        fail++;
+    } else {
+        printf("%d: "S_PASS": Unterminated brace not compiled\n", total);
+        success++;
+    }
+
+    total++;
+    tpl = fstr_compile("{T} and {{ {SHORT}");
+    r = fstr_render(buffer, 5, tpl, params);
+    if (r != -21) {
+        printf("%d: "S_FAIL": Compiled template overrun returned %d\n", total, r);
+        fail++;
+    } else {
+        result = fstr_render_alloc(tpl, params);
+        if (result == NULL || strcmp(result, "long string and { sh") != 0) {
+            printf("%d: "S_FAIL": fstr_render_alloc returned %s\n", total, result);
+            fail++;
+        } else {
+            printf("%d: "S_PASS": Compiled template overrun and alloc: %s\n", total, result);
+            success++;
+        }
+        free(result);
+    }
+    fstr_template_free(tpl);
+
     total++;
     memset(buffer, '*', sizeof(buffer));
     r =lbfstring(buffer, 8, "{SHORT}", params);
@@ -308,7 +2326,7 @@ int main(int argc, char *argv[])
 
     total++;
     r =lbfstring(buffer, 2, "{T}", params);
-    if (r != -4) {
+    if (r != -12) {
         total++;
         printf("%d: "S_FAIL": short template overrun returned %d\n", total, r);
         fail++;
@@ -318,10 +2336,10 @@ int main(int argc, char *argv[])
     }
     total++;
     memset(buffer, '*', sizeof(buffer));
-    /* {T} is 10 charcters long */
+    /* {T} is 11 charcters long */
     r = lbfstring(buffer, 5, "{T}", params);
-    /* So we should need 11 bytes to store it */
-    if (r != -11) {
+    /* So we should need 12 bytes to store it, with the \0 */
+    if (r != -12) {
         printf("%d: "S_FAIL": template overrun returned %d\n", total, r);
         fail++;
     } else if (buffer[5] != '*') {
@@ -385,8 +2403,74 @@ int main(int argc, char *argv[])
     printf("\n\nCalling tests\n\n");
     fail += calling_test();
 
+    printf("\n\nMeasure tests\n\n");
+    fail += measure_test();
+
+    printf("\n\nNumber tests\n\n");
+    fail += number_test();
+
+    printf("\n\nFormat spec tests\n\n");
+    fail += spec_test();
+
+    printf("\n\nTable tests\n\n");
+    fail += table_test();
+
+    printf("\n\nSink tests\n\n");
+    fail += sink_test();
+
+    printf("\n\nTemplate file tests\n\n");
+    fail += file_test();
+
+    printf("\n\nIovec tests\n\n");
+    fail += iov_test();
+
+    printf("\n\nAllocator tests\n\n");
+    fail += allocator_test();
+
+    printf("\n\nVarargs tests\n\n");
+    fail += varargs_test();
+
+    printf("\n\nScanning tests\n\n");
+    fail += scan_test();
+
+    printf("\n\nBatch tests\n\n");
+    fail += batch_test();
+
+    printf("\n\nParallel batch tests\n\n");
+    fail += parallel_test();
+
+    printf("\n\nView tests\n\n");
+    fail += view_test();
+
+    printf("\n\nLogger tests\n\n");
+    fail += log_test();
+
+    printf("\n\nCache tests\n\n");
+    fail += cache_test();
+
+    printf("\n\nString slice tests\n\n");
+    fail += strn_test();
+
+    printf("\n\nName hash tests\n\n");
+    fail += name_hash_test();
+
+    printf("\n\nWrite callback tests\n\n");
+    fail += write_callback_test();
+
+    printf("\n\nBuilder tests\n\n");
+    fail += buf_test();
+
+    printf("\n\nStats tests\n\n");
+    fail += stats_test();
+
+    printf("\n\nThread tests\n\n");
+    fail += thread_test();
+
     if (argc > 1 && strcmp(argv[1], "performance") == 0) {
         performance_test();
     }
+    if (argc > 1 && strcmp(argv[1], "threads") == 0) {
+        thread_performance_test(argc > 2 ? atoi(argv[2]) : 8, PERF_TEST_COUNT / 10);
+    }
     return fail;
 }
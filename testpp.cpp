@@ -0,0 +1,250 @@
+/*
+ * Copyright Nick Clifford, 2021
+ *
+ * Nick Clifford (nick@crypto.geek.nz)
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+
+#include "fstring.hpp"
+
+using namespace fstr::literals;
+
+#define S_PASS "\x1b[32mPASS\x1b[0m"
+#define S_FAIL "\x1b[31mFAIL\x1b[0m"
+
+#define TEST_DECLARE()    int total = 0, pass = 0, fail = 0; const char *test_name
+#define TEST_NAME(NAME) do { test_name = NAME; total++; } while(0)
+
+#define TEST_ASSERT(TEST)       do {  \
+                    if (TEST) { \
+                        pass++; \
+                        printf("%02d: " S_PASS ": %s\n", total, test_name); \
+                    } else { \
+                        fail++; \
+                        printf("%02d: " S_FAIL ": %s assertion failed: %s\n", total, test_name, #TEST); \
+                    } } while(0)
+
+#define TEST_RESULTS()     do { \
+                    if (fail == 0) { \
+                        printf("\n\n[%d/%d] \x1b[32mAll tests passed succesfully\x1b[0m\n", pass, pass); \
+                    } else { \
+                        printf("\n\n\x1b[31mSome tests failed\x1b[0m: Failed=%d passed=%d total=%d\n", fail, pass, total); \
+                    } } while(0)
+
+static const char *upper_cb(void *data, const char *name)
+{
+    return "CALLED";
+}
+
+/* Check the C++ interface gives the same output as the C functions */
+static int compare_test()
+{
+    TEST_DECLARE();
+    char buffer[512];
+    std::string s;
+
+    TEST_NAME("Strings and integers");
+    s = fstr::format<"{method} {path} -> {status} in {bytes}">("method"_a = "GET", "path"_a = std::string("/index"),
+                                                              "status"_a = 200, "bytes"_a = -12345678901L);
+    TEST_ASSERT(s == "GET /index -> 200 in -12345678901");
+
+    TEST_NAME("Names match case insensitively");
+    s = fstr::format<"{Name}/{NAME}/{name}">(fstr::arg<"nAmE"> = std::string_view("abcdef", 3));
+    TEST_ASSERT(s == "abc/abc/abc");
+
+    TEST_NAME("Escapes and stray braces");
+    s = fstr::format<"{{{x}{{ }{x}}">("x"_a = 1);
+    TEST_ASSERT(s == "{1{ }1}");
+
+    TEST_NAME("No placeholders");
+    s = fstr::format<"just text">();
+    TEST_ASSERT(s == "just text");
+
+    TEST_NAME("Empty format");
+    s = fstr::format<"">();
+    TEST_ASSERT(s.empty());
+
+    TEST_NAME("Wildcard");
+    s = fstr::format<"{a} {b}">("a"_a = "A", "*"_a = "any");
+    TEST_ASSERT(s == "A any");
+
+    /* Specs, floats and anything else go through the C formatting */
+    struct {
+        const char *what;
+        std::string got;
+        const char *match;
+    } specs[] = {
+        { "Padded int", fstr::format<"[{n:>8}]">("n"_a = 42), "[      42]" },
+        { "Grouped long", fstr::format<"{n:,}">("n"_a = 1234567890123L), "1,234,567,890,123" },
+        { "Hex", fstr::format<"{n:#x}">("n"_a = 255), "0xff" },
+        { "Double", fstr::format<"{d}">("d"_a = 0.1), "0.1" },
+        { "Double precision", fstr::format<"{d:.3f}">("d"_a = 3.14159), "3.142" },
+        { "Float", fstr::format<"{f}">("f"_a = 2.5f), "2.5" },
+        { "Centred string", fstr::format<"{s:*^9}">("s"_a = "mid"), "***mid***" },
+        { "Unicode fill", fstr::format<"{s:→<5}">("s"_a = "ab"), "ab→→→" },
+        { "Percent", fstr::format<"{d:.1%}">("d"_a = 0.256), "25.6%" },
+    };
+    for(auto &t : specs) {
+        TEST_NAME(t.what);
+        TEST_ASSERT(t.got == t.match);
+    }
+
+    TEST_NAME("Not a spec is part of the name");
+    s = fstr::format<"{a:b:c}">(fstr::arg<"a:b:c"> = "x");
+    TEST_ASSERT(s == "x");
+
+    TEST_NAME("fstr_value arguments");
+    fstr_value cb = { .name = "cb", .type = fstr_vt_cb, .name_hashed = 0, .value = { .cb = upper_cb }, .cb_data = nullptr,
+                      .name_hash = 0, .name_len = 0 };
+    s = fstr::format<"{cb} {cb:>8}">("cb"_a = &cb);
+    TEST_ASSERT(s == "CALLED   CALLED");
+
+    TEST_NAME("fstr_value arguments go by the argument's name");
+    s = fstr::format<"[{x}]">("x"_a = &cb);
+    TEST_ASSERT(s == "[CALLED]");
+
+    TEST_NAME("Unsigned long");
+    s = fstr::format<"{u} {u:d}">("u"_a = 18446744073709551615UL);
+    TEST_ASSERT(s == "18446744073709551615 18446744073709551615");
+    s = fstr::format<"{u:>22,}">("u"_a = (unsigned long long)ULLONG_MAX);
+    TEST_ASSERT(s == "18,446,744,073,709,551,615");
+
+    TEST_NAME("Long strings grow the result");
+    std::string big(5000, 'x');
+    s = fstr::format<"<{b:>6000}>">("b"_a = big);
+    TEST_ASSERT(s.size() == 6002 && s[1000] == ' ' && s[1001] == 'x' && s[6001] == '>');
+
+    TEST_NAME("Wide doubles grow the result");
+    s = fstr::format<"{d:.2f}">("d"_a = 1e100);
+    snprintf(buffer, sizeof(buffer), "%.2f", 1e100);
+    TEST_ASSERT(s == buffer);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+static int buffer_test()
+{
+    TEST_DECLARE();
+    char buffer[32];
+    size_t len;
+
+    TEST_NAME("format_to");
+    len = fstr::format_to<"{a}-{b}">(buffer, sizeof(buffer), "a"_a = "one", "b"_a = 2);
+    TEST_ASSERT(len == 5 && strcmp(buffer, "one-2") == 0);
+
+    TEST_NAME("format_to too small");
+    memset(buffer, '*', sizeof(buffer));
+    len = fstr::format_to<"{a}-{b}">(buffer, 4, "a"_a = "one", "b"_a = 2);
+    TEST_ASSERT(len == 5 && strcmp(buffer, "one") == 0 && buffer[4] == '*');
+
+    TEST_NAME("format_to exactly too small");
+    len = fstr::format_to<"{a}">(buffer, 3, "a"_a = "one");
+    TEST_ASSERT(len == 3 && buffer[0] == 0);
+
+    TEST_NAME("format_to stops at a string that doesn't fit");
+    memset(buffer, 'Z', sizeof(buffer));
+    len = fstr::format_to<"abc{s}">(buffer, 10, "s"_a = "0123456789");
+    TEST_ASSERT(len == 13 && strcmp(buffer, "abc") == 0);
+    memset(buffer, 'Z', sizeof(buffer));
+    len = fstr::format_to<"abc{s}de{n}">(buffer, 10, "s"_a = "0123456789", "n"_a = 1);
+    TEST_ASSERT(len == 16 && strcmp(buffer, "abc") == 0);
+
+    TEST_NAME("Spec value left out rather than cut");
+    len = fstr::format_to<"ab{n:>5}">(buffer, 6, "n"_a = 1);
+    TEST_ASSERT(len == 7 && strcmp(buffer, "ab") == 0);
+    memset(buffer, 'Z', sizeof(buffer));
+    len = fstr::format_to<"ab{n:>5}c">(buffer, 7, "n"_a = 1);
+    TEST_ASSERT(len == 8 && strcmp(buffer, "ab") == 0);
+
+    TEST_NAME("formatted_size");
+    TEST_ASSERT(fstr::formatted_size<"{n:08.3f}!">("n"_a = 3.5) == 9);
+
+    TEST_NAME("Append to fstr_buf");
+    fstr_buf buf = FSTR_BUF_INIT;
+    for(int i = 0; i < 100; i++) {
+        fstr::append<"{i:03},">(buf, "i"_a = i);
+    }
+    TEST_ASSERT(buf.len == 400 && strncmp(buf.data, "000,001,", 8) == 0 && strcmp(buf.data + 396, "099,") == 0);
+
+    TEST_NAME("Append grows past the guess");
+    fstr_buf_reset(&buf);
+    TEST_ASSERT(fstr::append<"{d:.1f}">(buf, "d"_a = 1e300) == 303 && buf.len == 303 && buf.data[303] == 0);
+    fstr_buf_free(&buf);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+static int values_test()
+{
+    TEST_DECLARE();
+    char buffer[128];
+    std::string path = "/home";
+    fstr_template *tpl;
+    int r;
+
+    auto list = fstr::values("method"_a = "GET", "path"_a = path, "status"_a = 404, "ms"_a = 1.5);
+
+    TEST_NAME("Values for lbfstring");
+    r = lbfstring(buffer, sizeof(buffer), "{method} {path} {status} {ms:.2f}", list);
+    TEST_ASSERT(r == 18 && strcmp(buffer, "GET /home 404 1.50") == 0);
+
+    TEST_NAME("Names are hashed at compile time");
+    fstr_value **v = list.list();
+    TEST_ASSERT(v[0]->name_len == 6 && v[0]->name_hash == fstr_name_hash("method", 6) && v[4] == NULL);
+
+    TEST_NAME("fstr_value values go by the argument's name");
+    fstr_value named = { .name = "cb", .type = fstr_vt_int, .name_hashed = 0, .value = { .i = 7 }, .cb_data = nullptr,
+                        .name_hash = 0, .name_len = 0 };
+    auto renamed = fstr::values("x"_a = &named, "y"_a = named);
+    r = lbfstring(buffer, sizeof(buffer), "[{x}] [{y}] [{cb}]", renamed);
+    TEST_ASSERT(r == 14 && strcmp(buffer, "[7] [7] [{cb}]") == 0);
+
+    TEST_NAME("Values for a template");
+    tpl = fstr_compile("[{STATUS}]");
+    r = fstr_render(buffer, sizeof(buffer), tpl, list);
+    TEST_ASSERT(r == 5 && strcmp(buffer, "[404]") == 0);
+    fstr_template_free(tpl);
+
+    TEST_RESULTS();
+    return fail;
+}
+
+int main(int argc, char *argv[])
+{
+    int fail = 0;
+
+    printf("\n\nC++ format tests\n\n");
+    fail += compare_test();
+
+    printf("\n\nC++ buffer tests\n\n");
+    fail += buffer_test();
+
+    printf("\n\nC++ value list tests\n\n");
+    fail += values_test();
+
+    return fail;
+}